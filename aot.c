@@ -0,0 +1,883 @@
+/*============================================================================
+  ravm-aot, an ahead-of-time compiler for RAVM programs.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// Translates the text of an image into C, one instruction at a time, each
+// doing exactly what its handler in interpreter-x86.asm does, quirks and
+// all, and compiles that into a shared object for ravm --native. See
+// native.h for how the generated code runs.
+//---------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libravm.h"
+#include "opcodes.h"
+#include "native.h"
+
+#define COMPILER_NAME "ravm-aot"
+#define CFLAGS "-m32 -O2 -msse2 -mfpmath=sse -fno-math-errno -fPIC -shared"
+
+static VM *vm;
+static char *program;
+static uint32_t length;
+static FILE *ouf;
+
+//------------------------------
+// Translation is done twice. The
+// first time nothing is written,
+// only branch targets and return
+// addresses are noted as entries.
+//
+static bool scanning = true;
+static char *starts;		// Per word: an instruction starts there.
+static char *entries;		// Per word: code may be entered there.
+static uint32_t n_entries = 0;
+static uint32_t n_instructions = 0;
+
+//----------------------------------------------------------------------------
+// Name:	error
+//----------------------------------------------------------------------------
+static void
+error (const char *s)
+{
+	fprintf (stderr, COMPILER_NAME ": %s\n", s);
+	exit (1);
+}
+
+static void
+usage ()
+{
+	printf ("Usage: " COMPILER_NAME " input-file output-file\n");
+	printf ("The output is C if its name ends in .c, else a shared object.\n");
+	exit (0);
+}
+
+static void
+emit (const char *format, ...)
+{
+	if (scanning)
+		return;
+	va_list args;
+	va_start (args, format);
+	vfprintf (ouf, format, args);
+	va_end (args);
+}
+
+static uint32_t
+word_at (uint32_t offset)
+{
+	uint32_t v;
+	memcpy (&v, program + offset, 4);
+	return v;
+}
+
+//----------------------------------------------------------------------------
+// Name:	instruction_end
+// Purpose:	Gives where the instruction at offset ends, including any
+//		switch table. The image was verified when it was loaded.
+//----------------------------------------------------------------------------
+static uint32_t
+instruction_end (uint32_t offset)
+{
+	uint32_t op = word_at (offset) & 0xff000000;
+	uint32_t end = offset + instruction_length (op);
+	if (op == OP_SWITCH && end <= length)
+		end += 4 * word_at (offset + 4);
+	return end;
+}
+
+//----------------------------------------------------------------------------
+// Name:	entry
+// Purpose:	Notes that code may be entered at the given offset, by a
+//		branch or on being resumed.
+//----------------------------------------------------------------------------
+static void
+entry (uint32_t offset)
+{
+	if (scanning && offset < length && !(offset & 3) && starts [offset / 4]
+	    && !entries [offset / 4]) {
+		entries [offset / 4] = 1;
+		n_entries++;
+	}
+}
+
+//----------------------------------------------------------------------------
+// Name:	taken
+// Purpose:	Emits a taken branch. Targets that are not instructions are
+//		left to the dispatch, which gives them to the interpreter.
+//----------------------------------------------------------------------------
+static void
+taken (uint32_t target)
+{
+	entry (target);
+	if (target < length && !(target & 3) && starts [target / 4])
+		emit ("TAKEN (%u);\n", target);
+	else
+		emit ("{ ip = 0x%xu; goto taken; }\n", target);
+}
+
+//----------------------------------------------------------------------------
+// Name:	memory_access
+// Purpose:	Emits a bounds checked memory access at p. Writes may not
+//		go below writable_start.
+//----------------------------------------------------------------------------
+static void
+memory_access (const char *address, uint32_t at, const char *action, bool writing)
+{
+	emit ("\t{\n\t\tchar *p;\n\t\t%s (p, %s, %u);\n\t\t%s;\n\t}\n",
+	      writing ? "WRITE_ADDRESS" : "ADDRESS", address, at, action);
+}
+
+//----------------------------------------------------------------------------
+// Name:	short_form
+// Purpose:	Emits one half of an OP_PAIR, as the handlers in the pair
+//		table do it.
+//----------------------------------------------------------------------------
+static void
+short_form (unsigned op, unsigned d, unsigned s, uint32_t at)
+{
+	static const char *alu [] = { "=", "+=", "-=", "&=", "|=", "^=", "*=" };
+	char address [32], action [64];
+
+	switch (op) {
+	case SHORT_MOV: case SHORT_ADD: case SHORT_SUB: case SHORT_AND:
+	case SHORT_OR: case SHORT_XOR: case SHORT_MUL:
+		emit ("\tr [%u] %s r [%u];\n", d, alu [op], s);
+		break;
+	case SHORT_ADD_IMM:
+		emit ("\tr [%u] += %u;\n", d, s);
+		break;
+	case SHORT_SUB_IMM:
+		emit ("\tr [%u] -= %u;\n", d, s);
+		break;
+	case SHORT_SHL_IMM:
+		emit ("\tr [%u] <<= %u;\n", d, s);
+		break;
+	case SHORT_SHR_IMM:
+		emit ("\tr [%u] >>= %u;\n", d, s);
+		break;
+	case SHORT_SAR_IMM:
+		emit ("\tr [%u] = (int32_t) r [%u] >> %u;\n", d, d, s);
+		break;
+	case SHORT_MOV_IMM:
+		emit ("\tr [%u] = %u;\n", d, s);
+		break;
+	case SHORT_LOAD32:
+		sprintf (address, "r [%u]", s);
+		sprintf (action, "r [%u] = get32 (p)", d);
+		memory_access (address, at, action, false);
+		break;
+	case SHORT_STORE32:
+		sprintf (address, "r [%u]", s);
+		sprintf (action, "put32 (p, r [%u])", d);
+		memory_access (address, at, action, true);
+		break;
+	}
+}
+
+//----------------------------------------------------------------------------
+// Name:	translate
+// Purpose:	Emits the C for the instruction at offset.
+//----------------------------------------------------------------------------
+static void
+translate (uint32_t offset)
+{
+	uint32_t w = word_at (offset);
+	uint32_t op = w & 0xff000000;
+	unsigned d = w & 255;
+	unsigned s = (w >> 8) & 255;
+	unsigned b2 = (w >> 16) & 255;
+	unsigned d1 = (d + 1) & 255;		// High halves of pairs.
+	unsigned s1 = (s + 1) & 255;
+	unsigned b21 = (b2 + 1) & 255;
+	uint32_t end = instruction_end (offset);
+	uint32_t at = offset + 4;		// Where errors leave the IP.
+	uint32_t near = offset + 4 + (int8_t) s;
+	char address [64], action [64];
+	bool writing = false;
+
+	// Running off the end is
+	// left to the interpreter.
+	if (end > length) {
+		emit ("\tSTOP (NATIVE_INTERPRET, %u);\n", offset);
+		return;
+	}
+	uint32_t imm = end >= offset + 8 ? word_at (offset + 4) : 0;
+	uint32_t far = offset + 4 + imm;
+
+	switch (op) {
+	case MAINLOOP:
+		break;
+	case OP_DUMP:
+		emit ("\tnative_dump (r);\n");
+		break;
+	case OP_EXIT:
+		emit ("\tSTOP (RESULT_OK, %u);\n", at);
+		break;
+
+	//------------------------------
+	// Moves, loads and stores.
+	//
+	case OP_MOV:
+		emit ("\tr [%u] = r [%u];\n", d, s);
+		break;
+	case OP_MOV_IMM8_SIGNED:
+		emit ("\tr [%u] = 0x%xu;\n", d, (uint32_t) (int8_t) s);
+		break;
+	case OP_MOV_IMM16_SIGNED:	// Into byte 1's register.
+		emit ("\tr [%u] = 0x%xu;\n", s, (uint32_t) (int16_t) (w >> 8));
+		break;
+	case OP_MOV_IMM32:
+		emit ("\tr [%u] = 0x%xu;\n", d, imm);
+		break;
+
+	case OP_LOAD32: case OP_LOAD16_UNSIGNED: case OP_LOAD16_SIGNED:
+	case OP_LOAD8_UNSIGNED: case OP_LOAD8_SIGNED:
+	case OP_STORE32: case OP_STORE16: case OP_STORE8:
+		sprintf (address, "r [%u]", s);
+		goto load_store;
+	case OP_LOAD32_DISP: case OP_LOAD16_UNSIGNED_DISP: case OP_LOAD16_SIGNED_DISP:
+	case OP_LOAD8_UNSIGNED_DISP: case OP_LOAD8_SIGNED_DISP:
+	case OP_STORE32_DISP: case OP_STORE16_DISP: case OP_STORE8_DISP:
+		sprintf (address, "r [%u] + 0x%xu", s, imm);
+		at = end;
+		goto load_store;
+	case OP_LOAD32_INDEXED: case OP_STORE32_INDEXED:
+		sprintf (address, "r [%u] + r [%u] * 4", s, b2);
+		goto load_store;
+	case OP_LOAD16_UNSIGNED_INDEXED: case OP_LOAD16_SIGNED_INDEXED:
+	case OP_STORE16_INDEXED:
+		sprintf (address, "r [%u] + r [%u] * 2", s, b2);
+		goto load_store;
+	case OP_LOAD8_UNSIGNED_INDEXED: case OP_LOAD8_SIGNED_INDEXED:
+	case OP_STORE8_INDEXED:
+		sprintf (address, "r [%u] + r [%u]", s, b2);
+	load_store:
+		switch (op) {
+		case OP_LOAD32: case OP_LOAD32_DISP: case OP_LOAD32_INDEXED:
+			sprintf (action, "r [%u] = get32 (p)", d);
+			break;
+		case OP_LOAD16_UNSIGNED: case OP_LOAD16_UNSIGNED_DISP:
+		case OP_LOAD16_UNSIGNED_INDEXED:
+			sprintf (action, "r [%u] = get16 (p)", d);
+			break;
+		case OP_LOAD16_SIGNED: case OP_LOAD16_SIGNED_DISP:
+		case OP_LOAD16_SIGNED_INDEXED:
+			sprintf (action, "r [%u] = (int16_t) get16 (p)", d);
+			break;
+		case OP_LOAD8_UNSIGNED: case OP_LOAD8_UNSIGNED_DISP:
+		case OP_LOAD8_UNSIGNED_INDEXED:
+			sprintf (action, "r [%u] = (unsigned char) *p", d);
+			break;
+		case OP_LOAD8_SIGNED: case OP_LOAD8_SIGNED_DISP:
+		case OP_LOAD8_SIGNED_INDEXED:
+			sprintf (action, "r [%u] = (signed char) *p", d);
+			break;
+		case OP_STORE32: case OP_STORE32_DISP: case OP_STORE32_INDEXED:
+			sprintf (action, "put32 (p, r [%u])", d);
+			writing = true;
+			break;
+		case OP_STORE16: case OP_STORE16_DISP: case OP_STORE16_INDEXED:
+			sprintf (action, "put16 (p, r [%u])", d);
+			writing = true;
+			break;
+		default:
+			sprintf (action, "*p = r [%u]", d);
+			writing = true;
+		}
+		memory_access (address, at, action, writing);
+		break;
+
+	case OP_WRITE_MEMORY32:
+		sprintf (address, "0x%xu", imm);
+		sprintf (action, "put32 (p, 0x%xu)", word_at (offset + 8));
+		memory_access (address, end, action, true);
+		break;
+	case OP_WRITE_MEMORY16:
+		sprintf (address, "0x%xu", imm);
+		sprintf (action, "put16 (p, 0x%x)", word_at (offset + 8) & 0xffff);
+		memory_access (address, end, action, true);
+		break;
+	case OP_WRITE_MEMORY8:		// The byte is in byte 1.
+		sprintf (address, "0x%xu", imm);
+		sprintf (action, "*p = %u", s);
+		memory_access (address, end, action, true);
+		break;
+
+	//------------------------------
+	// Arithmetic. Imm8 operands are
+	// unsigned, except for idiv and
+	// imod.
+	//
+	case OP_ADD: emit ("\tr [%u] += r [%u];\n", d, s); break;
+	case OP_SUB: emit ("\tr [%u] -= r [%u];\n", d, s); break;
+	case OP_AND: emit ("\tr [%u] &= r [%u];\n", d, s); break;
+	case OP_OR: emit ("\tr [%u] |= r [%u];\n", d, s); break;
+	case OP_XOR: emit ("\tr [%u] ^= r [%u];\n", d, s); break;
+	case OP_MUL: case OP_IMUL: emit ("\tr [%u] *= r [%u];\n", d, s); break;
+	case OP_ADD_IMM8: emit ("\tr [%u] += %u;\n", d, s); break;
+	case OP_SUB_IMM8: emit ("\tr [%u] -= %u;\n", d, s); break;
+	case OP_MUL_IMM8: case OP_IMUL_IMM8: emit ("\tr [%u] *= %u;\n", d, s); break;
+	case OP_MUL_10: emit ("\tr [%u] *= 10;\n", d); break;
+	case OP_MUL_100: emit ("\tr [%u] *= 100;\n", d); break;
+	case OP_ADD_IMM32: emit ("\tr [%u] += 0x%xu;\n", d, imm); break;
+	case OP_NEG: emit ("\tr [%u] = -r [%u];\n", d, d); break;
+	case OP_NOT: emit ("\tr [%u] = ~r [%u];\n", d, d); break;
+
+	// The bit forms use the imm8 as
+	// a mask, as the handlers do.
+	case OP_AND_IMM8: case OP_CLEAR_BIT_IMM8:
+		emit ("\tr [%u] &= %u;\n", d, s);
+		break;
+	case OP_OR_IMM8: case OP_SET_BIT_IMM8:
+		emit ("\tr [%u] |= %u;\n", d, s);
+		break;
+	case OP_XOR_IMM8: case OP_INVERT_BIT_IMM8:
+		emit ("\tr [%u] ^= %u;\n", d, s);
+		break;
+
+	case OP_DIV: case OP_MOD: case OP_IDIV: case OP_IMOD:
+		emit ("\tif (!r [%u])\n\t\tSTOP (RESULT_DIVIDE_BY_ZERO, %u);\n", s, at);
+		if (op == OP_DIV || op == OP_MOD)
+			emit ("\tr [%u] %s= r [%u];\n", d, op == OP_DIV ? "/" : "%", s);
+		else	// EDX is cleared, not sign extended.
+			emit ("\tr [%u] = (int64_t) r [%u] %s (int32_t) r [%u];\n",
+			      d, d, op == OP_IDIV ? "/" : "%", s);
+		break;
+	case OP_DIV_IMM8: case OP_MOD_IMM8: case OP_IDIV_IMM8: case OP_IMOD_IMM8:
+		if (!s)
+			emit ("\tSTOP (RESULT_DIVIDE_BY_ZERO, %u);\n", at);
+		else if (op == OP_DIV_IMM8 || op == OP_MOD_IMM8)
+			emit ("\tr [%u] %s= %u;\n", d, op == OP_DIV_IMM8 ? "/" : "%", s);
+		else
+			emit ("\tr [%u] = (int64_t) r [%u] %s (%d);\n",
+			      d, d, op == OP_IDIV_IMM8 ? "/" : "%", (int8_t) s);
+		break;
+
+	//------------------------------
+	// Logical operations. land only
+	// stores 1 if both are nonzero.
+	// lnot's cmovnz sees the flags
+	// of the dispatch, and its store
+	// goes through EBX, which it has
+	// just set to 1.
+	//
+	case OP_LOGICAL_OR:
+		emit ("\tr [%u] = (r [%u] | r [%u]) != 0;\n", d, d, s);
+		break;
+	case OP_LOGICAL_AND:
+		emit ("\tif (r [%u] && r [%u])\n\t\tr [%u] = 1;\n", d, s, d);
+		break;
+	case OP_LOGICAL_NOT:
+		emit ("\tr [1] = 1;\n");
+		break;
+
+	//------------------------------
+	// Shifts and rotates use the
+	// count modulo 32.
+	//
+	case OP_SHL: emit ("\tr [%u] <<= r [%u] & 31;\n", d, s); break;
+	case OP_SHR: emit ("\tr [%u] >>= r [%u] & 31;\n", d, s); break;
+	case OP_SAR: emit ("\tr [%u] = (int32_t) r [%u] >> (r [%u] & 31);\n", d, d, s); break;
+	case OP_SHL_IMM8: emit ("\tr [%u] <<= %u;\n", d, s & 31); break;
+	case OP_SHR_IMM8: emit ("\tr [%u] >>= %u;\n", d, s & 31); break;
+	case OP_SAR_IMM8: emit ("\tr [%u] = (int32_t) r [%u] >> %u;\n", d, d, s & 31); break;
+	case OP_ROL: emit ("\tr [%u] = rotate_left (r [%u], r [%u]);\n", d, d, s); break;
+	case OP_ROR: emit ("\tr [%u] = rotate_left (r [%u], 32 - (r [%u] & 31));\n", d, d, s); break;
+	case OP_ROL_IMM8: emit ("\tr [%u] = rotate_left (r [%u], %u);\n", d, d, s); break;
+	case OP_ROR_IMM8: emit ("\tr [%u] = rotate_left (r [%u], %u);\n", d, d, 32 - (s & 31)); break;
+
+	//------------------------------
+	// Bit manipulation. The host
+	// instructions and fallbacks
+	// give the same results.
+	//
+	case OP_POPCNT:
+		emit ("\tr [%u] = __builtin_popcount (r [%u]);\n", d, s);
+		break;
+	case OP_LZCNT:
+		emit ("\tr [%u] = r [%u] ? __builtin_clz (r [%u]) : 32;\n", d, s, s);
+		break;
+	case OP_TZCNT:
+		emit ("\tr [%u] = r [%u] ? __builtin_ctz (r [%u]) : 32;\n", d, s, s);
+		break;
+	case OP_BSWAP:
+		emit ("\tr [%u] = __builtin_bswap32 (r [%u]);\n", d, d);
+		break;
+	case OP_CRC32C:
+		emit ("\tr [%u] = crc32c_bits (r [%u] ^ r [%u], 32);\n", d, d, s);
+		break;
+	case OP_CRC32C8:
+		emit ("\tr [%u] = crc32c_bits (r [%u] ^ (r [%u] & 255), 8);\n", d, d, s);
+		break;
+
+	//------------------------------
+	// 64-bit math on register pairs.
+	// The handlers read everything
+	// before storing anything.
+	//
+	case OP_ADD64: case OP_SUB64: case OP_MUL64:
+		emit ("\t{\n\t\tuint64_t v = ((uint64_t) r [%u] << 32 | r [%u]) %s "
+		      "((uint64_t) r [%u] << 32 | r [%u]);\n",
+		      d1, d, op == OP_ADD64 ? "+" : op == OP_SUB64 ? "-" : "*", s1, s);
+		emit ("\t\tr [%u] = v;\n\t\tr [%u] = v >> 32;\n\t}\n", d, d1);
+		break;
+	case OP_MULW:
+		emit ("\t{\n\t\tuint64_t v = (uint64_t) r [%u] * r [%u];\n", d, s);
+		emit ("\t\tr [%u] = v;\n\t\tr [%u] = v >> 32;\n\t}\n", d, d1);
+		break;
+	case OP_IMULW:
+		emit ("\t{\n\t\tint64_t v = (int64_t) (int32_t) r [%u] * (int32_t) r [%u];\n", d, s);
+		emit ("\t\tr [%u] = v;\n\t\tr [%u] = (uint64_t) v >> 32;\n\t}\n", d, d1);
+		break;
+	case OP_SHL64: case OP_SHR64: case OP_SAR64:
+	case OP_SHL64_IMM8: case OP_SHR64_IMM8: case OP_SAR64_IMM8:
+		if (op == OP_SHL64 || op == OP_SHR64 || op == OP_SAR64)
+			sprintf (action, "(r [%u] & 63)", s);
+		else
+			sprintf (action, "%u", s & 63);
+		emit ("\t{\n\t\tuint64_t v = (uint64_t) r [%u] << 32 | r [%u];\n", d1, d);
+		if (op == OP_SHL64 || op == OP_SHL64_IMM8)
+			emit ("\t\tv <<= %s;\n", action);
+		else if (op == OP_SHR64 || op == OP_SHR64_IMM8)
+			emit ("\t\tv >>= %s;\n", action);
+		else
+			emit ("\t\tv = (int64_t) v >> %s;\n", action);
+		emit ("\t\tr [%u] = v >> 32;\n\t\tr [%u] = v;\n\t}\n", d1, d);
+		break;
+	case OP_CMP64: case OP_CMPU64:
+		sprintf (action, op == OP_CMP64 ? "int64_t" : "uint64_t");
+		emit ("\t{\n\t\t%s a = (uint64_t) r [%u] << 32 | r [%u];\n", action, s1, s);
+		emit ("\t\t%s b = (uint64_t) r [%u] << 32 | r [%u];\n", action, b21, b2);
+		emit ("\t\tr [%u] = a < b ? -1 : a != b;\n\t}\n", d);
+		break;
+
+	//------------------------------
+	// Floating point. FP register
+	// numbers are modulo 16.
+	//
+	case OP_FADDS: case OP_FSUBS: case OP_FMULS: case OP_FDIVS:
+		emit ("\tsetf (vm, %u, getf (vm, %u) %c getf (vm, %u));\n", d & 15, d & 15,
+		      "+-*/" [(op - OP_FADDS) >> 25], s & 15);
+		break;
+	case OP_FADDD: case OP_FSUBD: case OP_FMULD: case OP_FDIVD:
+		emit ("\tvm->fregs [%u] = vm->fregs [%u] %c vm->fregs [%u];\n", d & 15, d & 15,
+		      "+-*/" [(op - OP_FADDD) >> 25], s & 15);
+		break;
+	case OP_FSQRTS:
+		emit ("\tsetf (vm, %u, __builtin_sqrtf (getf (vm, %u)));\n", d & 15, s & 15);
+		break;
+	case OP_FSQRTD:
+		emit ("\tvm->fregs [%u] = __builtin_sqrt (vm->fregs [%u]);\n", d & 15, s & 15);
+		break;
+	case OP_FCMPS:
+		emit ("\tr [%u] = fcompare (getf (vm, %u), getf (vm, %u));\n", d, s & 15, b2 & 15);
+		break;
+	case OP_FCMPD:
+		emit ("\tr [%u] = fcompare (vm->fregs [%u], vm->fregs [%u]);\n", d, s & 15, b2 & 15);
+		break;
+	case OP_CVTSI2S:
+		emit ("\tsetf (vm, %u, (int32_t) r [%u]);\n", d & 15, s);
+		break;
+	case OP_CVTSI2D:
+		emit ("\tvm->fregs [%u] = (int32_t) r [%u];\n", d & 15, s);
+		break;
+	case OP_CVTS2SI:
+		emit ("\tr [%u] = _mm_cvttss_si32 (_mm_set_ss (getf (vm, %u)));\n", d, s & 15);
+		break;
+	case OP_CVTD2SI:
+		emit ("\tr [%u] = _mm_cvttsd_si32 (_mm_set_sd (vm->fregs [%u]));\n", d, s & 15);
+		break;
+	case OP_CVTS2D:
+		emit ("\tvm->fregs [%u] = getf (vm, %u);\n", d & 15, s & 15);
+		break;
+	case OP_CVTD2S:
+		emit ("\tsetf (vm, %u, vm->fregs [%u]);\n", d & 15, s & 15);
+		break;
+	case OP_FMOV:
+		emit ("\tmemcpy (&vm->fregs [%u], &vm->fregs [%u], 8);\n", d & 15, s & 15);
+		break;
+	case OP_FLOADS: case OP_FLOADD: case OP_FSTORES: case OP_FSTORED:
+		sprintf (address, "r [%u]", s);
+		if (op == OP_FLOADS || op == OP_FLOADD)
+			sprintf (action, "memcpy (&vm->fregs [%u], p, %u)", d & 15,
+				 op == OP_FLOADS ? 4 : 8);
+		else
+			sprintf (action, "memcpy (p, &vm->fregs [%u], %u)", d & 15,
+				 op == OP_FSTORES ? 4 : 8);
+		memory_access (address, at, action, op == OP_FSTORES || op == OP_FSTORED);
+		break;
+
+	//------------------------------
+	// The stack. The IP and return
+	// addresses are host pointers.
+	//
+	case OP_PUSH:
+		emit ("\tPUSH (r [%u], %u);\n", d, at);
+		break;
+	case OP_POP:
+		emit ("\tif (sp >= stack_end)\n\t\tSTOP (RESULT_STACK_UNDERFLOW, %u);\n", at);
+		emit ("\tr [%u] = get32 (sp);\n\tsp += 4;\n", d);
+		break;
+	case OP_ALLOCA:
+	case OP_DROP:
+		if (!s || (s & 3))
+			emit ("\tSTOP (RESULT_INVALID_ALLOCA_PARAM, %u);\n", at);
+		else if (op == OP_ALLOCA)
+			emit ("\tsp -= %u;\n\tif (sp < stack_start)\n"
+			      "\t\tSTOP (RESULT_STACK_OVERFLOW, %u);\n", s, at);
+		else
+			emit ("\tsp += %u;\n\tif (sp > stack_end)\n"
+			      "\t\tSTOP (RESULT_STACK_UNDERFLOW, %u);\n", s, at);
+		break;
+	case OP_GET_STACK_RELATIVE:
+	case OP_PUT_STACK_RELATIVE:
+		emit ("\tif (sp + %u >= stack_end)\n\t\tSTOP (RESULT_STACK_UNDERFLOW, %u);\n",
+		      4 * s, at);
+		if (op == OP_GET_STACK_RELATIVE)
+			emit ("\tr [%u] = get32 (sp + %u);\n", d, 4 * s);
+		else
+			emit ("\tput32 (sp + %u, r [%u]);\n", 4 * s, d);
+		break;
+	case OP_PUSHM:
+		if (s < d) {
+			emit ("\tSTOP (RESULT_STACK_OVERFLOW, %u);\n", at);
+			break;
+		}
+		emit ("\tsp -= %u;\n\tif (sp < stack_start)\n"
+		      "\t\tSTOP (RESULT_STACK_OVERFLOW, %u);\n", 4 * (s - d + 1), at);
+		emit ("\t{\n\t\tint i;\n\t\tfor (i = 0; i <= %u; i++)\n"
+		      "\t\t\tput32 (sp + %u - 4 * i, r [%u + i]);\n\t}\n",
+		      s - d, 4 * (s - d), d);
+		break;
+	case OP_POPM:
+		if (s < d) {
+			emit ("\tSTOP (RESULT_STACK_UNDERFLOW, %u);\n", at);
+			break;
+		}
+		emit ("\tif (sp + %u > stack_end)\n\t\tSTOP (RESULT_STACK_UNDERFLOW, %u);\n",
+		      4 * (s - d + 1), at);
+		emit ("\t{\n\t\tint i;\n\t\tfor (i = 0; i <= %u; i++)\n"
+		      "\t\t\tr [%u - i] = get32 (sp + 4 * i);\n\t}\n\tsp += %u;\n",
+		      s - d, s, 4 * (s - d + 1));
+		break;
+
+	//------------------------------
+	// Calls and returns.
+	//
+	case OP_CALL:
+		emit ("\tPUSH (HOST (%u), %u);\n\t", end, at);
+		entry (end);
+		taken (far);
+		break;
+	case OP_CALL_REGISTER_INDIRECT:
+		emit ("\tPUSH (HOST (%u), %u);\n\tJUMP (r [%u]);\n", at, at, d);
+		entry (at);
+		break;
+	case OP_CALL_RELATIVE_NEAR_FORWARD:
+	case OP_CALL_RELATIVE_NEAR_BACKWARD:
+	case OP_JUMP_RELATIVE_NEAR:		// Also a call.
+		emit ("\tPUSH (HOST (%u), %u);\n\t", at, at);
+		entry (at);
+		if (op == OP_CALL_RELATIVE_NEAR_FORWARD)
+			taken (at + s);
+		else if (op == OP_CALL_RELATIVE_NEAR_BACKWARD)
+			taken (at - s);
+		else
+			taken (near);
+		break;
+	case OP_RET:
+		emit ("\tif (sp >= stack_end)\n\t\tSTOP (RESULT_STACK_UNDERFLOW, %u);\n", at);
+		emit ("\tsp += 4;\n\tJUMP (get32 (sp - 4));\n");
+		break;
+
+	//------------------------------
+	// Branches. jz, jnz and decjnz
+	// use fuel whether or not they
+	// branch.
+	//
+	case OP_JUMP:
+		emit ("\t");
+		taken (far);
+		break;
+	case OP_JUMP_NEAR:		// Its handler adds the opcode.
+		emit ("\t");
+		taken (at + (int8_t) (op >> 24));
+		break;
+	case OP_JZ: case OP_JNZ:
+		emit ("\tif (%sr [%u])\n\t\t", op == OP_JZ ? "!" : "", d);
+		taken (far);
+		emit ("\t");
+		taken (end);
+		break;
+	case OP_DECJNZ:
+		emit ("\tif (--r [%u])\n\t\t", d);
+		taken (far);
+		emit ("\t");
+		taken (end);
+		break;
+	case OP_DECJNZ_NEAR:
+		emit ("\tif (--r [%u])\n\t\t", d);
+		taken (at - s);
+		break;
+	case OP_JZ_NEAR: case OP_JNZ_NEAR:
+		emit ("\tif (%sr [%u])\n\t\t", op == OP_JZ_NEAR ? "!" : "", d);
+		taken (near);
+		break;
+	case OP_JA: case OP_JAE: case OP_JB: case OP_JBE: case OP_JE: case OP_JNE:
+	case OP_JA_NEAR: case OP_JAE_NEAR: case OP_JB_NEAR: case OP_JBE_NEAR:
+	case OP_JE_NEAR: case OP_JNE_NEAR: {
+		static const char *cc [] = { ">", ">", ">=", ">=", "<", "<", "<=", "<=" };
+		const char *c = op == OP_JE || op == OP_JE_NEAR ? "=="
+			: op == OP_JNE || op == OP_JNE_NEAR ? "!="
+			: cc [(op - OP_JA) >> 24];
+		emit ("\tif (r [%u] %s r [%u])\n\t\t", d, c, s);
+		taken ((op - OP_JA) & (1 << 24) ? near : far);
+		break;
+	}
+	case OP_JG: case OP_JGE: case OP_JL: case OP_JLE:
+	case OP_JG_NEAR: case OP_JGE_NEAR: case OP_JL_NEAR: case OP_JLE_NEAR: {
+		static const char *cc [] = { ">", ">", ">=", ">=", "<", "<", "<=", "<=" };
+		emit ("\tif ((int32_t) r [%u] %s (int32_t) r [%u])\n\t\t",
+		      d, cc [(op - OP_JG) >> 24], s);
+		taken ((op - OP_JG) & (1 << 24) ? near : far);
+		break;
+	}
+	case OP_JSET: case OP_JSET_NEAR: case OP_JCLEAR: case OP_JCLEAR_NEAR:
+		emit ("\tif (%s(r [%u] & 0x%xu))\n\t\t",
+		      op == OP_JSET || op == OP_JSET_NEAR ? "" : "!", d, 1u << (s & 31));
+		taken (op == OP_JSET_NEAR || op == OP_JCLEAR_NEAR ? near : far);
+		break;
+	case OP_LOOP:
+		emit ("\tif (--r [%u])\n\t\tJUMP (r [%u]);\n", d, s);
+		break;
+	case OP_REPEAT:
+		emit ("\tr [%u] = HOST (%u);\n", d, at);
+		entry (at);
+		break;
+	case OP_SWITCH: {
+		uint32_t table = offset + 8;
+		uint32_t i;
+		emit ("\tswitch (r [%u]) {\n", d);
+		for (i = 0; i < imm; i++) {
+			emit ("\tcase %u: ", i);
+			taken (table + word_at (table + 4 * i));
+		}
+		emit ("\t}\n");
+		break;
+	}
+
+	//------------------------------
+	// I/O. A pending callout is
+	// resumed after the instruction.
+	//
+	case OP_PUTCHAR:
+		emit ("\tputchar (r [%u]);\n", d);
+		break;
+	case OP_PRINT:
+		emit ("\tif (!native_print (vm, r [%u], %u))\n"
+		      "\t\tSTOP (RESULT_MEMORY_BOUNDS, %u);\n", d, s, at);
+		break;
+	case OP_PRINTHEX:
+		emit ("\tprintf (\"%%08x%s\", r [%u]);\n", s ? "\\n" : "", d);
+		break;
+	case OP_CALLOUT:
+		emit ("\tif (vm->async_callouts) {\n");
+		emit ("\t\tvm->callout_which = %u;\n", b2);
+		emit ("\t\tvm->callout_param1 = r [%u];\n", d);
+		emit ("\t\tvm->callout_param2 = r [%u];\n", s);
+		emit ("\t\tvm->callout_register = %u;\n", d);
+		emit ("\t\tvm->callout_pending = 1;\n");
+		emit ("\t\tSTOP (RESULT_CALLOUT_PENDING, %u);\n\t}\n", at);
+		emit ("\tif (!vm->callout)\n\t\tSTOP (RESULT_CALLOUT_IMPOSSIBLE, %u);\n", at);
+		emit ("\tr [%u] = vm->callout (%u, r [%u], r [%u]);\n", d, b2, d, s);
+		entry (at);
+		break;
+
+	case OP_ALLOC: case OP_FREE: case OP_REALLOC:
+		emit ("\tif ((retval = vm->heap_op (vm, %u, %u, %u)))\n\t\tSTOP (retval, %u);\n",
+		      op == OP_ALLOC ? HEAP_ALLOC : op == OP_FREE ? HEAP_FREE : HEAP_REALLOC,
+		      d, s, at);
+		break;
+
+	case OP_PAIR:
+		short_form (b2 & 15, d & 15, d >> 4, at);
+		short_form (b2 >> 4, s & 15, s >> 4, at);
+		break;
+
+	default:		// Unused opcodes exit.
+		emit ("\tSTOP (RESULT_OK, %u);\n", at);
+	}
+}
+
+//----------------------------------------------------------------------------
+// Name:	translate_program
+//----------------------------------------------------------------------------
+static void
+translate_program (const char *inpath)
+{
+	uint32_t offset, line = 0;
+
+	emit ("// Made by " COMPILER_NAME " from %s.\n\n", inpath);
+	emit ("#define NATIVE_CODE\n#include \"native.h\"\n\n");
+	emit ("const uint32_t ravm_native_length = %u;\n", length);
+	emit ("const uint32_t ravm_native_checksum = 0x%08xu;\n\n",
+	      native_checksum (program, length));
+	emit ("int\nravm_native (VM *vm)\n{\n\tNATIVE_ENTER\n\n");
+	emit ("dispatch:\n\tif (ip >= length)\n\t\tSTOP (RESULT_PROGRAM_BOUNDS, ip);\n");
+	emit ("\tswitch (ip) {\n\tdefault:\n\t\tSTOP (NATIVE_INTERPRET, ip);\n");
+
+	for (offset = 0; offset + 4 <= length; offset = instruction_end (offset)) {
+		if (!scanning && entries [offset / 4])
+			emit ("case %u: L%u:\n", offset, offset);
+		if (!scanning && vm->lines && ravm_line_at (vm, offset) != line) {
+			line = ravm_line_at (vm, offset);
+			emit ("\t// Line %u.\n", line);
+		}
+		translate (offset);
+	}
+
+	// Falling off the end.
+	emit ("\t}\n\tSTOP (RESULT_PROGRAM_BOUNDS, %u);\n\n", offset);
+	emit ("\tNATIVE_LEAVE\n}\n");
+}
+
+//----------------------------------------------------------------------------
+// Name:	compile
+// Purpose:	Runs the C compiler on cpath. It is run directly, not by
+//		way of the shell, so that the paths are taken as they are.
+//		$CC may hold options after the compiler's name.
+// Returns:	false if it could not be run or failed.
+//----------------------------------------------------------------------------
+static bool
+compile (const char *cpath, const char *outpath)
+{
+	const char *cc = getenv ("CC");
+	const char *include = getenv ("RAVM_INCLUDE");
+	char *words = malloc (strlen (cc ? cc : "gcc") + sizeof (CFLAGS) + 1);
+	char *include_option = malloc (strlen (include ? include : ".") + 3);
+	if (!words || !include_option)
+		error ("Out of memory.");
+	sprintf (words, "%s " CFLAGS, cc ? cc : "gcc");
+	sprintf (include_option, "-I%s", include ? include : ".");
+
+	const char *args [64];
+	int n = 0;
+	char *word;
+	for (word = strtok (words, " \t"); word && n < 59; word = strtok (NULL, " \t"))
+		args [n++] = word;
+	args [n++] = include_option;
+	args [n++] = "-o";
+	args [n++] = outpath;
+	args [n++] = cpath;
+	args [n] = NULL;
+
+	int status = 0;
+	pid_t pid = fork ();
+	if (!pid) {
+		execvp (args [0], (char**) args);
+		perror (args [0]);
+		_exit (127);
+	}
+	bool built = pid > 0 && waitpid (pid, &status, 0) == pid
+		     && WIFEXITED (status) && !WEXITSTATUS (status);
+	free (words);
+	free (include_option);
+	return built;
+}
+
+//----------------------------------------------------------------------------
+// Name:	main
+//----------------------------------------------------------------------------
+int
+main (int argc, const char **argv)
+{
+	if (argc != 3)
+		usage ();
+
+	const char *inpath = argv[1];
+	const char *outpath = argv[2];
+
+	int fd = open (inpath, O_RDONLY);
+	if (fd < 0) {
+		perror (COMPILER_NAME);
+		return 1;
+	}
+	vm = ravm_create (MINIMUM_MEMORY_MB);
+	if (!vm)
+		error ("Out of memory.");
+	int result = ravm_load_fd (vm, fd);
+	close (fd);
+	if (result)
+		error (ravm_strerror (result));
+
+	program = vm->program_start;
+	length = vm->program_end - vm->program_start;
+	starts = calloc (1, length / 4 + 1);
+	entries = calloc (1, length / 4 + 1);
+	if (!starts || !entries)
+		error ("Out of memory.");
+
+	uint32_t offset;
+	for (offset = 0; offset + 4 <= length; offset = instruction_end (offset)) {
+		starts [offset / 4] = 1;
+		n_instructions++;
+	}
+	entry (vm->entry);
+	translate_program (inpath);
+
+	//------------------------------
+	// Write the C, then unless that
+	// was all that was wanted, build
+	// it with the runtime's headers.
+	//
+	size_t n = strlen (outpath);
+	bool c_only = n > 2 && !strcmp (outpath + n - 2, ".c");
+	char *cpath = malloc (n + 3);
+	sprintf (cpath, c_only ? "%s" : "%s.c", outpath);
+
+	ouf = fopen (cpath, "w");
+	if (!ouf) {
+		perror (COMPILER_NAME);
+		return 1;
+	}
+	scanning = false;
+	translate_program (inpath);
+	if (fclose (ouf))
+		error ("Cannot write the output file.");
+
+	printf ("%u instructions, %u entry points.\n", n_instructions, n_entries);
+	if (c_only)
+		return 0;
+
+	bool built = compile (cpath, outpath);
+	unlink (cpath);
+	if (!built)
+		error ("The C compiler failed.");
+	return 0;
+}
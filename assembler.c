@@ -24,136 +24,90 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "defs.h"
+#include "opcodes.h"
+#include "image.h"
 
 #define ASSEMBLER_NAME "rasm"
 
-#define MAX_LABELS (2000)
 #define MAX_LINELEN (1024)
 #define MAX_WORDS (MAX_LINELEN/2)
 
 static uint32_t address = 0;
-static uint32_t constants_length = 0;
 static int pass_number = 0;
-static int in_section = 't';
+static int in_section = SECTION_TEXT;
+
+//------------------------------
+// Text, rodata and data, indexed
+// by SECTION_*. Each keeps its own
+// address while another is current.
+// Rodata and data labels are VM
+// pointers, so they start at base.
+//
+static struct {
+	FILE *file;		// Pass 2 only.
+	uint32_t address;
+	uint32_t base;
+	uint32_t length;
+	uint32_t align;		// What an object says rodata and data need.
+} sections [SECTION_DATA + 1];
+
+// What goes into the image besides the code.
+static uint32_t entry = 0;
+static ImageLine *lines = NULL;
+static uint32_t n_lines = 0;
+
+// The switch being assembled.
+static bool in_switch = false;
+static uint32_t switch_table = 0;	// Address of its first case.
+static uint32_t switch_cases = 0;
+static long switch_count_position = 0;
+
+// The file being assembled.
+static const char *source_path = "";
+
+// With --compress, text, rodata and data are compressed.
+static bool compress = false;
+
+// With --dense, short forms are paired up two to a word.
+static bool dense = false;
+static uint32_t n_pairs = 0;
+static bool pair_open = false;		// The last word holds one short form,
+static uint32_t pair_address = 0;	// at this address,
+static long pair_position = 0;		// at this offset in the output.
+static unsigned pair_first = 0;
+
+//------------------------------
+// Names are found by hashing them,
+// ignoring case. An index holds
+// positions in an array of names.
+//
+typedef struct {
+	int *slots;		// Position + 1, or 0 if empty.
+	uint32_t size;		// A power of two.
+	uint32_t used;
+} NameIndex;
 
 static int n_labels = 0;
-static char *labels [MAX_LABELS];
-static uint32_t label_addresses [MAX_LABELS];
-
-#define DEST(XX) (((((unsigned)XX) & 255))<<0)
-#define SRC(XX) (((((unsigned)XX) & 255))<<8)
-
-enum {
-	MAINLOOP = 0<<24,
-	OP_DUMP = 1<<24,
-	OP_EXIT = 2<<24,
-	OP_LOAD16_SIGNED = 3<<24,
-	OP_LOAD16_UNSIGNED = 4<<24,
-	OP_LOAD32 = 5<<24,
-	OP_LOAD8_SIGNED = 6<<24,
-	OP_LOAD8_UNSIGNED = 7<<24,
-	OP_MOV = 8<<24,
-	OP_MOV_IMM16_SIGNED = 9<<24,
-	OP_MOV_IMM32 = 10<<24,
-	OP_MOV_IMM8_SIGNED = 11<<24,
-	OP_STORE16 = 12<<24,
-	OP_STORE32 = 13<<24,
-	OP_STORE8 = 14<<24,
-	OP_WRITE_MEMORY16 = 15<<24,
-	OP_WRITE_MEMORY32 = 16<<24,
-	OP_WRITE_MEMORY8 = 17<<24,
-	OP_SAR = 18<<24,
-	OP_SAR_IMM8 = 19<<24,
-	OP_SHL = 20<<24,
-	OP_SHL_IMM8 = 21<<24,
-	OP_SHR = 22<<24,
-	OP_SHR_IMM8 = 23<<24,
-	OP_ADD = 24<<24,
-	OP_ADD_IMM32 = 25<<24,
-	OP_ADD_IMM8 = 26<<24,
-	OP_DIV = 27<<24,
-	OP_DIV_IMM8 = 28<<24,
-	OP_IDIV = 29<<24,
-	OP_IDIV_IMM8 = 30<<24,
-	OP_IMOD = 31<<24,
-	OP_IMOD_IMM8 = 32<<24,
-	OP_IMUL = 33<<24,
-	OP_IMUL_IMM8 = 34<<24,
-	OP_MOD = 35<<24,
-	OP_MOD_IMM8 = 36<<24,
-	OP_MUL = 37<<24,
-	OP_MUL_10 = 38<<24,
-	OP_MUL_100 = 39<<24,
-	OP_MUL_IMM8 = 40<<24,
-	OP_NEG = 41<<24,
-	OP_SUB = 42<<24,
-	OP_SUB_IMM8 = 43<<24,
-	OP_LOGICAL_AND = 44<<24,
-	OP_LOGICAL_NOT = 45<<24,
-	OP_LOGICAL_OR = 46<<24,
-	OP_AND = 47<<24,
-	OP_AND_IMM8 = 48<<24,
-	OP_CLEAR_BIT_IMM8 = 49<<24,
-	OP_INVERT_BIT_IMM8 = 50<<24,
-	OP_NOT = 51<<24,
-	OP_OR = 52<<24,
-	OP_OR_IMM8 = 53<<24,
-	OP_SET_BIT_IMM8 = 54<<24,
-	OP_XOR = 55<<24,
-	OP_XOR_IMM8 = 56<<24,
-	OP_CALL = 57<<24,
-	OP_CALL_REGISTER_INDIRECT = 58<<24,
-	OP_CALL_RELATIVE_NEAR_BACKWARD = 59<<24,
-	OP_CALL_RELATIVE_NEAR_FORWARD = 60<<24,
-	OP_RET = 61<<24,
-	OP_ALLOCA = 62<<24,
-	OP_DROP = 63<<24,
-	OP_GET_STACK_RELATIVE = 64<<24,
-	OP_POP = 65<<24,
-	OP_PUSH = 66<<24,
-	OP_PUT_STACK_RELATIVE = 67<<24,
-	OP_DECJNZ = 68<<24,
-	OP_DECJNZ_NEAR = 69<<24,
-	OP_JA = 70<<24,
-	OP_JA_NEAR = 71<<24,
-	OP_JAE = 72<<24,
-	OP_JAE_NEAR = 73<<24,
-	OP_JB = 74<<24,
-	OP_JB_NEAR = 75<<24,
-	OP_JBE = 76<<24,
-	OP_JBE_NEAR = 77<<24,
-	OP_JCLEAR = 78<<24,
-	OP_JCLEAR_NEAR = 79<<24,
-	OP_JE = 80<<24,
-	OP_JE_NEAR = 81<<24,
-	OP_JG = 82<<24,
-	OP_JG_NEAR = 83<<24,
-	OP_JGE = 84<<24,
-	OP_JGE_NEAR = 85<<24,
-	OP_JL = 86<<24,
-	OP_JL_NEAR = 87<<24,
-	OP_JLE = 88<<24,
-	OP_JLE_NEAR = 89<<24,
-	OP_JNE = 90<<24,
-	OP_JNE_NEAR = 91<<24,
-	OP_JNZ = 92<<24,
-	OP_JNZ_NEAR = 93<<24,
-	OP_JSET = 94<<24,
-	OP_JSET_NEAR = 95<<24,
-	OP_JUMP = 96<<24,
-	OP_JUMP_NEAR = 97<<24,
-	OP_JUMP_RELATIVE_NEAR = 98<<24,
-	OP_JZ = 99<<24,
-	OP_JZ_NEAR = 100<<24,
-	OP_LOOP = 101<<24,
-	OP_REPEAT = 102<<24,
-	OP_PUTCHAR = 103<<24,
-	OP_CALLOUT = 104<<24,
-	OP_PRINT = 105<<24,
-        OP_PRINTHEX = 106<<24
-};
+static int max_labels = 0;
+static char **labels = NULL;
+static uint32_t *label_addresses = NULL;
+static int *label_sections = NULL;
+static bool *label_global = NULL;
+static NameIndex label_index;
+
+// With -c, an object is made, and labels
+// not defined in it are left to the linker.
+static bool object = false;
+static int n_externals = 0;
+static char **externals = NULL;
+static NameIndex external_index;
+static ImageRelocation *relocations = NULL;
+static uint32_t n_relocations = 0;
 
 enum {
 	ERR_USAGE=1,
@@ -167,7 +121,10 @@ enum {
 
 void usage (void)
 {
-	fprintf (stderr, "Usage: rasm input-file output-file\n");
+	fprintf (stderr, "Usage: rasm [--dense] [--compress] input-file [output-file]\n");
+	fprintf (stderr, "       rasm [--dense] -c input-file [object-file]\n");
+	fprintf (stderr, "       rasm [--compress] --link output-file object-file...\n");
+	fprintf (stderr, "       rasm [--dense] [--compress] --build output-file input-file...\n");
 	exit (ERR_USAGE);
 }
 
@@ -180,6 +137,8 @@ void error (const char *str)
 void unknown_label (const char *str)
 {
 	fprintf (stderr, "Error: Unknown label \"%s\"\n", str);
+	if (object)
+		fprintf (stderr, "Only far branches, calls, switches and entry may use a label of another module.\n");
 	exit (ERR_UNKNOWN_LABEL);
 }
 
@@ -194,8 +153,128 @@ void syntax (char **words, int n_words)
 	exit (ERR_SYNTAX);
 }
 
+//-----------------------------------------------------------------------------
+// Name:	hash_name
+// Purpose:	FNV-1a of a name, ignoring case.
+//-----------------------------------------------------------------------------
+
+static uint32_t
+hash_name (const char *s)
+{
+	uint32_t hash = 2166136261u;
+	while (*s)
+		hash = (hash ^ (unsigned char) tolower ((int) *s++)) * 16777619u;
+	return hash;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	find_name
+// Purpose:	Looks a name up in an index of the array names.
+// Returns:	Its position in the array, or -1.
+//-----------------------------------------------------------------------------
+
+static int
+find_name (const NameIndex *index, char **names, const char *s)
+{
+	if (!index->size)
+		return -1;
+
+	uint32_t mask = index->size - 1;
+	uint32_t i = hash_name (s) & mask;
+	while (index->slots [i]) {
+		int position = index->slots [i] - 1;
+		if (!strcasecmp (s, names [position]))
+			return position;
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	index_name
+// Purpose:	Adds names[position] to an index, which is kept under half
+//		full. A name already there is left as it is.
+//-----------------------------------------------------------------------------
+
+static void
+index_name (NameIndex *index, char **names, int position)
+{
+	uint32_t i, mask;
+
+	if (2 * (index->used + 1) > index->size) {
+		NameIndex bigger;
+		bigger.size = index->size ? 2 * index->size : 1024;
+		bigger.used = index->used;
+		bigger.slots = calloc (bigger.size, sizeof (int));
+		if (!bigger.slots)
+			error ("Out of memory.");
+		mask = bigger.size - 1;
+		uint32_t j;
+		for (j = 0; j < index->size; j++) {
+			if (!index->slots [j])
+				continue;
+			i = hash_name (names [index->slots [j] - 1]) & mask;
+			while (bigger.slots [i])
+				i = (i + 1) & mask;
+			bigger.slots [i] = index->slots [j];
+		}
+		free (index->slots);
+		*index = bigger;
+	}
+
+	mask = index->size - 1;
+	i = hash_name (names [position]) & mask;
+	while (index->slots [i]) {
+		if (!strcasecmp (names [position], names [index->slots [i] - 1]))
+			return;
+		i = (i + 1) & mask;
+	}
+	index->slots [i] = position + 1;
+	index->used++;
+}
+
+static void
+free_index (NameIndex *index)
+{
+	free (index->slots);
+	index->slots = NULL;
+	index->size = index->used = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	define_label
+// Purpose:	Adds a label. The first definition of a name is the one
+//		that is found.
+//-----------------------------------------------------------------------------
+
+static void
+define_label (const char *s, uint32_t at, int section, bool global)
+{
+	if (n_labels == max_labels) {
+		max_labels = max_labels ? 2 * max_labels : 1024;
+		labels = realloc (labels, max_labels * sizeof (char*));
+		label_addresses = realloc (label_addresses, max_labels * sizeof (uint32_t));
+		label_sections = realloc (label_sections, max_labels * sizeof (int));
+		label_global = realloc (label_global, max_labels * sizeof (bool));
+		if (!labels || !label_addresses || !label_sections || !label_global)
+			error ("Out of memory.");
+	}
+
+	labels [n_labels] = strdup (s);
+	if (!labels [n_labels])
+		error ("Out of memory.");
+	label_addresses [n_labels] = at;
+	label_sections [n_labels] = section;
+	label_global [n_labels] = global;
+	index_name (&label_index, labels, n_labels);
+	n_labels++;
+}
+
 void add_label (char *s)
 {
+	// Nothing may branch into the middle of a pair.
+	pair_open = false;
+
 	if (pass_number != 1) {
 		//----------------------------------------
 		// If we're not in Pass 1, we're not
@@ -206,12 +285,7 @@ void add_label (char *s)
 
 	printf ("LABEL %s is @ 0x%x\n", s, address);
 
-	if (n_labels >= MAX_LABELS) 
-		error ("Too many labels.");
-
-	labels [n_labels] = strdup (s);
-	label_addresses [n_labels] = address;
-	n_labels++;
+	define_label (s, address, in_section, false);
 }
 
 int lookup_label (char *s, uint32_t *return_address)
@@ -226,18 +300,80 @@ int lookup_label (char *s, uint32_t *return_address)
 		return true;
 	}
 
-	if (!s || !return_address || !n_labels)
+	if (!s || !return_address)
 		return false;
-	int i = 0;
-	while (i < n_labels) {
-		if (!strcasecmp (s, labels[i])) {
-			*return_address = label_addresses[i];
-			return true;
+	int i = find_name (&label_index, labels, s);
+	if (i < 0)
+		return false;
+	*return_address = label_addresses[i];
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	add_relocation
+// Purpose:	Notes that the word at the current address in an object
+//		refers to a label, which is labels[label], or if that is -1
+//		one of another module.
+//-----------------------------------------------------------------------------
+
+#define EXTERNAL 0x80000000	// Marks the index of an external until output.
+
+static void
+add_relocation (char *name, int label, uint32_t type)
+{
+	static uint32_t max_relocations = 0;
+
+	if (pass_number != 2)
+		return;
+
+	if (label < 0) {
+		label = find_name (&external_index, externals, name);
+		if (label < 0) {
+			externals = realloc (externals, (n_externals + 1) * sizeof (char*));
+			if (!externals || !(externals [n_externals] = strdup (name)))
+				error ("Out of memory.");
+			label = n_externals++;
+			index_name (&external_index, externals, label);
 		}
-		i++;
+		label |= EXTERNAL;
+	}
+
+	if (n_relocations == max_relocations) {
+		max_relocations = max_relocations ? 2 * max_relocations : 256;
+		relocations = realloc (relocations, max_relocations * sizeof (ImageRelocation));
+		if (!relocations)
+			error ("Out of memory.");
 	}
+	relocations [n_relocations].section = in_section;
+	relocations [n_relocations].address = address;
+	relocations [n_relocations].symbol = label;
+	relocations [n_relocations].type = type;
+	n_relocations++;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	data_address
+// Purpose:	Finds the VM address of a rodata or data label, for mov and
+//		dd, which write it at the current address. In an object it is
+//		left to the linker.
+//-----------------------------------------------------------------------------
 
-	return false;
+static uint32_t
+data_address (char *name)
+{
+	if (pass_number != 2)
+		return 0;
+
+	int label = find_name (&label_index, labels, name);
+	if (label >= 0 && label_sections [label] == SECTION_TEXT)
+		error ("Only rodata and data labels have addresses.");
+	if (object) {
+		add_relocation (name, label, RELOCATION_ABSOLUTE);
+		return 0;
+	}
+	if (label < 0)
+		unknown_label (name);
+	return label_addresses [label];
 }
 
 uint32_t parse_number (char *s)
@@ -260,6 +396,16 @@ uint32_t parse_number (char *s)
 	error ("Bad number expression.");
 }
 
+static bool
+is_register (const char *s)
+{
+	if (tolower ((int) *s++) != 'r' || !*s)
+		return false;
+	while (isdigit ((int) *s))
+		s++;
+	return !*s;
+}
+
 int parse_register (char *s)
 {
 	if (!s)
@@ -339,17 +485,79 @@ write_byte (FILE *f, uint32_t v)
 	address++;
 }
 
+//-----------------------------------------------------------------------------
+// Name:	short_form
+// Purpose:	Finds the 12-bit short form of a one-word instruction.
+// Returns:	The short form, or -1 if it has none.
+//-----------------------------------------------------------------------------
+
+static int
+short_form (uint32_t op)
+{
+	static const uint32_t forms [N_SHORT_FORMS] = SHORT_FORMS;
+	unsigned dest = op & 255;
+	unsigned src = (op >> 8) & 255;
+	int i;
+
+	if (dest > 15 || src > 15 || (op & 0xff0000))
+		return -1;
+	for (i = 0; i < N_SHORT_FORMS; i++)
+		if ((op & 0xff000000) == forms [i])
+			return (i << 8) | (src << 4) | dest;
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	write_opcode
+// Purpose:	Writes an instruction word. In dense mode, an instruction
+//		with a short form that directly follows another one is
+//		folded into its word, which becomes an OP_PAIR.
+//-----------------------------------------------------------------------------
+
 void
 write_opcode (FILE *f, uint32_t op)
 {
+	int code = dense ? short_form (op) : -1;
+
+	if (code >= 0 && pair_open && address == pair_address + 4) {
+		if (pass_number == 2) {
+			uint32_t pair = SHORT_PAIR (pair_first, code);
+			long position = ftell (f);
+			fseek (f, pair_position, SEEK_SET);
+			fwrite (&pair, 1, 4, f);
+			fseek (f, position, SEEK_SET);
+		}
+		pair_open = false;
+		n_pairs++;
+		return;
+	}
+
+	pair_open = code >= 0;
+	pair_first = code;
+	pair_address = address;
+	if (pass_number == 2)
+		pair_position = ftell (f);
 	write_uint32 (f, op);
-	if (pass_number == 2) 
-		; // printf ("Writing opcode %08x\n", op);
+}
+
+//-----------------------------------------------------------------------------
+// Name:	write_placeholder
+// Purpose:	Holds the place of a branch in pass 1. Like the branch it
+//		stands for, it never joins a pair, so that the addresses
+//		after it are the same in both passes.
+//-----------------------------------------------------------------------------
+
+static void
+write_placeholder (FILE *f)
+{
+	pair_open = false;
+	write_uint32 (f, 0);
 }
 
 //-----------------------------------------------------------------------------
 // Name:	readline
-// Purpose:	Special-purpose readline. Filters out comments, commas.
+// Purpose:	Special-purpose readline. Filters out comments, commas,
+//		except within double quotes.
 // Returns:	# chars, or EOF.
 //-----------------------------------------------------------------------------
 
@@ -357,6 +565,7 @@ static int
 readline (FILE *f, char *line, int max)
 {
 	int ch=0, ix=0;
+	bool quoted = false;
 
 	if (!f || !line || max<2)
 		return EOF;
@@ -367,6 +576,21 @@ readline (FILE *f, char *line, int max)
 			continue;
 		if (ch == '\n')
 			break;
+		if (quoted) {
+			if (ch == '"')
+				quoted = false;
+			else if (ch == '\\' && ix < max-2) {
+				line [ix++] = ch;	// Keep it and what it escapes.
+				if (EOF == (ch = fgetc (f)) || ch == '\n')
+					break;
+			}
+			line [ix++] = ch;
+			if (ix == max-1)
+				break;
+			continue;
+		}
+		if (ch == '"')
+			quoted = true;
 		if (ch == ',')	// Ignore comma char.
 			continue;
 
@@ -400,6 +624,7 @@ readline (FILE *f, char *line, int max)
 // Returns:	# words.
 // Note:	Words are not strdup'd. Their pointers point into the line.
 // Note:	Observes MAX_WORDS.
+// Note:	A word in double quotes may hold spaces.
 //-----------------------------------------------------------------------------
 
 int
@@ -417,6 +642,11 @@ break_line_into_words (char *line /* Mutable */, char **words_return)
 
 		words_return [n_words++] = line + ix;
 
+		if (line[ix] == '"') {
+			for (ix++; line[ix] && line[ix] != '"'; ix++)
+				if (line[ix] == '\\' && line[ix+1])
+					ix++;
+		}
 		while (line[ix] && !isspace (ch = line[ix])) 
 			ix++;
 		
@@ -447,9 +677,336 @@ uint32_t calculate_branch32 (char *label)
 	return u.d;
 }
 
+//-----------------------------------------------------------------------------
+// Name:	relative_to
+// Purpose:	Finds how far a label is past base, for 32-bit branch
+//		offsets and switch tables, which are written at the current
+//		address. In an object, a label of another module is left to
+//		the linker.
+//-----------------------------------------------------------------------------
+
+uint32_t relative_to (char *label, uint32_t base)
+{
+	uint32_t dest;
+	if (!lookup_label (label, &dest)) {
+		if (!object)
+			unknown_label (label);
+		add_relocation (label, -1, RELOCATION_RELATIVE);
+		return address - base;
+	}
+	return dest - base;
+}
+
+uint32_t far_branch32 (char *label)
+{
+	uint32_t rel32 = relative_to (label, address);
+	if (pass_number == 2)
+		printf ("BRANCH OFFSET 0x%x\n", (int) rel32);
+	return rel32;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	parse_string
+// Purpose:	Decodes a string in double quotes, with the escapes \n \r
+//		\t \0 \\ and \".
+// Returns:	Its length. The string is decoded in place.
+//-----------------------------------------------------------------------------
+
+static uint32_t
+parse_string (char *word)
+{
+	char *in = word, *out = word;
+	size_t n = strlen (word);
+
+	if (n < 2 || *in != '"' || word [n-1] != '"')
+		error ("Bad string.");
+	word [n-1] = 0;
+	in++;
+	while (*in) {
+		char ch = *in++;
+		if (ch == '\\') {
+			switch (ch = *in++) {
+			case 'n': ch = '\n'; break;
+			case 'r': ch = '\r'; break;
+			case 't': ch = '\t'; break;
+			case '0': ch = 0; break;
+			case '\\':
+			case '"': break;
+			default: error ("Bad escape in string.");
+			}
+		}
+		*out++ = ch;
+	}
+	*out = 0;
+	return out - word;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	included_path
+// Purpose:	Finds a file named by incbin, relative to the directory of
+//		the source file that names it.
+// Returns:	The path, malloc'd.
+//-----------------------------------------------------------------------------
+
+static char *
+included_path (const char *source, const char *name)
+{
+	const char *slash = strrchr (source, '/');
+	size_t directory = *name == '/' || !slash ? 0 : slash + 1 - source;
+	char *path = malloc (directory + strlen (name) + 1);
+	if (!path)
+		error ("Out of memory.");
+	memcpy (path, source, directory);
+	strcpy (path + directory, name);
+	return path;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	write_incbin
+// Purpose:	Copies all or part of a file into the current section:
+//		  incbin "file"
+//		  incbin "file" offset
+//		  incbin "file" offset length
+//-----------------------------------------------------------------------------
+
+static void
+write_incbin (FILE *ouf, char **words, int n_words)
+{
+	if (n_words < 2 || n_words > 4)
+		syntax (words, n_words);
+
+	char name [MAX_LINELEN];
+	strcpy (name, words[1]);
+	parse_string (name);
+	char *path = included_path (source_path, name);
+	FILE *f = fopen (path, "rb");
+	if (!f) {
+		perror (path);
+		exit (ERR_INFILE);
+	}
+
+	fseek (f, 0, SEEK_END);
+	long size = ftell (f);
+	uint32_t offset = n_words > 2 ? parse_number (words[2]) : 0;
+	if (offset > size)
+		error ("incbin offset is past the end of the file.");
+	uint32_t length = n_words > 3 ? parse_number (words[3]) : size - offset;
+	if (length > size - offset)
+		error ("incbin length is past the end of the file.");
+
+	if (pass_number == 2) {
+		char buffer [65536];
+		uint32_t left = length;
+		fseek (f, offset, SEEK_SET);
+		while (left) {
+			size_t n = left < sizeof (buffer) ? left : sizeof (buffer);
+			if (fread (buffer, 1, n, f) != n)
+				error ("Cannot read the incbin file.");
+			fwrite (buffer, 1, n, ouf);
+			left -= n;
+		}
+	}
+	address += length;
+	fclose (f);
+	free (path);
+}
+
+//-----------------------------------------------------------------------------
+// Name:	parse_data
+// Purpose:	Assembles a line of rodata or data:
+//		  db value ...		bytes
+//		  dw value ...		16-bit words
+//		  dd value ...		32-bit words, or addresses of labels
+//		  ascii "string"	without a terminating NUL
+//		  asciz "string"	with one
+//		  zero count		zero bytes
+//		  align n		pads with zeros to a power of two
+//		  incbin "file" ...	the contents of a file
+//-----------------------------------------------------------------------------
+
 int
 parse_data (char **words, int n_words, FILE *ouf)
 {
+	char *word = words[0];
+	int i;
+
+	if (!strcasecmp ("db", word) || !strcasecmp ("dw", word)) {
+		if (n_words < 2)
+			syntax (words, n_words);
+
+		bool bytes = tolower (word[1]) == 'b';
+		for (i = 1; i < n_words; i++) {
+			uint32_t value = parse_number (words[i]);
+			uint32_t limit = bytes ? 0xff : 0xffff;
+			if (value > limit && value < ~(limit >> 1))
+				error ("Value is too large.");
+			if (bytes)
+				write_byte (ouf, value & 0xff);
+			else
+				write_uint16 (ouf, value);
+		}
+	}
+	else if (!strcasecmp ("dd", word)) {
+		if (n_words < 2)
+			syntax (words, n_words);
+
+		for (i = 1; i < n_words; i++) {
+			if (isdigit ((int) *words[i]) || '-' == *words[i])
+				write_uint32 (ouf, parse_number (words[i]));
+			else
+				write_uint32 (ouf, data_address (words[i]));
+		}
+	}
+	else if (!strcasecmp ("ascii", word) || !strcasecmp ("asciz", word)) {
+		if (n_words != 2)
+			syntax (words, n_words);
+
+		uint32_t length = parse_string (words[1]);
+		for (i = 0; i < length; i++)
+			write_byte (ouf, (unsigned char) words[1][i]);
+		if (tolower (word[4]) == 'z')
+			write_byte (ouf, 0);
+	}
+	else if (!strcasecmp ("zero", word)) {
+		if (n_words != 2)
+			syntax (words, n_words);
+
+		uint32_t count = parse_number (words[1]);
+		if (count > MAX_DATA_SECTION_LENGTH)
+			error ("Too many zeros.");
+		if (pass_number == 2) {
+			for (i = 0; i < count; i++)
+				fputc (0, ouf);
+		}
+		address += count;
+	}
+	else if (!strcasecmp ("align", word)) {
+		if (n_words != 2)
+			syntax (words, n_words);
+
+		uint32_t n = parse_number (words[1]);
+		if (!n || (n & (n - 1)) || n > IMAGE_PAGE)
+			error ("Alignment must be a power of two up to a page.");
+		while (address & (n - 1))
+			write_byte (ouf, 0);
+		if (n > sections [in_section].align)
+			sections [in_section].align = n;
+	}
+	else if (!strcasecmp ("incbin", word)) {
+		write_incbin (ouf, words, n_words);
+	}
+	else {
+		fprintf (stderr, "Unknown data directive %s.\n", word);
+		exit (ERR_INSTRUCTION);
+	}
+
+	return 0;
+}
+
+int parse_fp_register (char *s)
+{
+	if (tolower ((int)*s) != 'f' || !isdigit ((int) s[1]))
+		error ("Bad floating point register expression.");
+
+	int reg = atoi (s+1);
+	if (reg >= FP_REGISTERS)
+		error ("Bad floating point register expression.");
+
+	return reg;
+}
+
+//-----------------------------------------------------------------------------
+// Floating point instructions. The operand letters say what each word
+// must be: f = FP register, r = integer register. Operands go in bytes
+// 0, 1 and 2 in order.
+//-----------------------------------------------------------------------------
+static const struct {
+	const char *name;
+	uint32_t opcode;
+	const char *operands;
+} fp_instructions [] = {
+	{ "fadds", OP_FADDS, "ff" },
+	{ "faddd", OP_FADDD, "ff" },
+	{ "fsubs", OP_FSUBS, "ff" },
+	{ "fsubd", OP_FSUBD, "ff" },
+	{ "fmuls", OP_FMULS, "ff" },
+	{ "fmuld", OP_FMULD, "ff" },
+	{ "fdivs", OP_FDIVS, "ff" },
+	{ "fdivd", OP_FDIVD, "ff" },
+	{ "fsqrts", OP_FSQRTS, "ff" },
+	{ "fsqrtd", OP_FSQRTD, "ff" },
+	{ "fcmps", OP_FCMPS, "rff" },
+	{ "fcmpd", OP_FCMPD, "rff" },
+	{ "cvtsi2s", OP_CVTSI2S, "fr" },
+	{ "cvtsi2d", OP_CVTSI2D, "fr" },
+	{ "cvts2si", OP_CVTS2SI, "rf" },
+	{ "cvtd2si", OP_CVTD2SI, "rf" },
+	{ "cvts2d", OP_CVTS2D, "ff" },
+	{ "cvtd2s", OP_CVTD2S, "ff" },
+	{ "floads", OP_FLOADS, "fr" },
+	{ "floadd", OP_FLOADD, "fr" },
+	{ "fstores", OP_FSTORES, "fr" },
+	{ "fstored", OP_FSTORED, "fr" },
+	{ "fmov", OP_FMOV, "ff" },
+	{ NULL }
+};
+
+bool
+parse_fp_instruction (char **words, int n_words, FILE *ouf)
+{
+	int i;
+	for (i = 0; fp_instructions[i].name; i++) {
+		if (!strcasecmp (fp_instructions[i].name, words[0]))
+			break;
+	}
+	if (!fp_instructions[i].name)
+		return false;
+
+	const char *operands = fp_instructions[i].operands;
+	if (n_words != 1 + strlen (operands))
+		syntax (words, n_words);
+
+	uint32_t instruction = fp_instructions[i].opcode;
+	int j;
+	for (j = 0; operands[j]; j++) {
+		char *word = words [j+1];
+		int reg = operands[j] == 'f' ? parse_fp_register (word) : parse_register (word);
+		if (reg < 0)
+			syntax (words, n_words);
+		instruction |= reg << (8 * j);
+	}
+
+	write_opcode (ouf, instruction);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	write_memory_access
+// Purpose:	Writes a load or store in one of its addressing modes:
+//		  op rD rA		address is rA
+//		  op rD rA disp		rA + disp
+//		  op rD rA rI		rA + rI * access size
+//-----------------------------------------------------------------------------
+void
+write_memory_access (FILE *ouf, char **words, int n_words, int dest_reg, int src_reg,
+		     uint32_t op, uint32_t op_disp, uint32_t op_indexed)
+{
+	if (n_words == 3) {
+		write_opcode (ouf, op | DEST(dest_reg) | SRC(src_reg));
+	}
+	else if (n_words != 4) {
+		syntax (words, n_words);
+	}
+	else if ('r' == tolower ((int) *words[3])) {
+		int index_reg = parse_register (words[3]);
+		if (index_reg < 0)
+			syntax (words, n_words);
+		write_opcode (ouf, op_indexed | DEST(dest_reg) | SRC(src_reg) | SRC2(index_reg));
+	}
+	else {
+		write_opcode (ouf, op_disp | DEST(dest_reg) | SRC(src_reg));
+		write_uint32 (ouf, parse_number (words[3]));
+	}
 }
 
 int
@@ -482,6 +1039,9 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 		}
 	}
 
+	if (in_switch && strcasecmp ("case", word) && strcasecmp ("endswitch", word))
+		error ("Only case lines may follow switch.");
+
 	if (!strcasecmp ("exit", word)) {
 		if (n_words != 1)
 			syntax (words, n_words);
@@ -504,7 +1064,7 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 		}
 
 		address += 4;
-		uint32_t rel32 = calculate_branch32 (words[2]);
+		uint32_t rel32 = far_branch32 (words[2]);
 		address -= 4;
 
 		write_opcode (ouf, op | DEST(dest_reg)); 
@@ -558,7 +1118,12 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 		if (dest_reg < 0) 
 			syntax (words, n_words);
 
-		if (src_reg >= 0) {
+		if (n_words == 3 && !have_immed && !is_register (words[2])) {
+			// The address of a rodata or data label.
+			write_opcode (ouf, OP_MOV_IMM32 | DEST(dest_reg));
+			write_uint32 (ouf, data_address (words[2]));
+		}
+		else if (src_reg >= 0) {
 			write_opcode (ouf, OP_MOV + DEST(dest_reg) + SRC(src_reg));
 		} else {
 			if (immed >= -128 && immed < 128) {
@@ -654,49 +1219,57 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 		if (dest_reg < 0 || src_reg < 0) 
 			syntax (words, n_words);
 
-		write_opcode (ouf, OP_LOAD32 + DEST(dest_reg) + SRC(src_reg));
+		write_memory_access (ouf, words, n_words, dest_reg, src_reg,
+			OP_LOAD32, OP_LOAD32_DISP, OP_LOAD32_INDEXED);
 	}
 	else if (!strcasecmp ("store32", word)) {
 		if (dest_reg < 0 || src_reg < 0) 
 			syntax (words, n_words);
 
-		write_opcode (ouf, OP_STORE32 + DEST(dest_reg) + SRC(src_reg));
+		write_memory_access (ouf, words, n_words, dest_reg, src_reg,
+			OP_STORE32, OP_STORE32_DISP, OP_STORE32_INDEXED);
 	}
 	else if (!strcasecmp ("store16", word)) {
 		if (dest_reg < 0 || src_reg < 0) 
 			syntax (words, n_words);
 
-		write_opcode (ouf, OP_STORE16 + DEST(dest_reg) + SRC(src_reg));
+		write_memory_access (ouf, words, n_words, dest_reg, src_reg,
+			OP_STORE16, OP_STORE16_DISP, OP_STORE16_INDEXED);
 	}
 	else if (!strcasecmp ("store8", word)) {
 		if (dest_reg < 0 || src_reg < 0) 
 			syntax (words, n_words);
 
-		write_opcode (ouf, OP_STORE8 + DEST(dest_reg) + SRC(src_reg));
+		write_memory_access (ouf, words, n_words, dest_reg, src_reg,
+			OP_STORE8, OP_STORE8_DISP, OP_STORE8_INDEXED);
 	}
 	else if (!strcasecmp ("load8s", word)) {
 		if (dest_reg < 0 || src_reg < 0) 
 			syntax (words, n_words);
 
-		write_opcode (ouf, OP_LOAD8_SIGNED + DEST(dest_reg) + SRC(src_reg));
+		write_memory_access (ouf, words, n_words, dest_reg, src_reg,
+			OP_LOAD8_SIGNED, OP_LOAD8_SIGNED_DISP, OP_LOAD8_SIGNED_INDEXED);
 	}
 	else if (!strcasecmp ("load8", word)) {
 		if (dest_reg < 0 || src_reg < 0) 
 			syntax (words, n_words);
 
-		write_opcode (ouf, OP_LOAD8_UNSIGNED + DEST(dest_reg) + SRC(src_reg));
+		write_memory_access (ouf, words, n_words, dest_reg, src_reg,
+			OP_LOAD8_UNSIGNED, OP_LOAD8_UNSIGNED_DISP, OP_LOAD8_UNSIGNED_INDEXED);
 	}
 	else if (!strcasecmp ("load16s", word)) {
 		if (dest_reg < 0 || src_reg < 0) 
 			syntax (words, n_words);
 
-		write_opcode (ouf, OP_LOAD16_SIGNED + DEST(dest_reg) + SRC(src_reg));
+		write_memory_access (ouf, words, n_words, dest_reg, src_reg,
+			OP_LOAD16_SIGNED, OP_LOAD16_SIGNED_DISP, OP_LOAD16_SIGNED_INDEXED);
 	}
 	else if (!strcasecmp ("load16", word)) {
 		if (dest_reg < 0 || src_reg < 0) 
 			syntax (words, n_words);
 
-		write_opcode (ouf, OP_LOAD16_UNSIGNED + DEST(dest_reg) + SRC(src_reg));
+		write_memory_access (ouf, words, n_words, dest_reg, src_reg,
+			OP_LOAD16_UNSIGNED, OP_LOAD16_UNSIGNED_DISP, OP_LOAD16_UNSIGNED_INDEXED);
 	}
 	else if (!strcasecmp ("set", word)) {
 		if (dest_reg < 0 || src_reg >= 0) 
@@ -829,6 +1402,19 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 
 		write_opcode (ouf, OP_DROP | SRC(immed));
 	}
+	else if (!strcasecmp ("alloc", word) || !strcasecmp ("realloc", word)) {
+		if (n_words != 3 || dest_reg < 0 || src_reg < 0) 
+			syntax (words, n_words);
+
+		uint32_t op = tolower (word[0]) == 'a' ? OP_ALLOC : OP_REALLOC;
+		write_opcode (ouf, op | DEST(dest_reg) | SRC(src_reg));
+	}
+	else if (!strcasecmp ("free", word)) {
+		if (n_words != 2 || dest_reg < 0) 
+			syntax (words, n_words);
+
+		write_opcode (ouf, OP_FREE | DEST(dest_reg));
+	}
 	else if (!strcasecmp ("print", word)) {
 		if (n_words != 3 || dest_reg < 0 || src_reg >= 0)
 			syntax (words, n_words);
@@ -854,6 +1440,21 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 	else if (!strcasecmp ("pop", word)) {
 		write_opcode (ouf, OP_POP | DEST(dest_reg));
 	}
+	else if (!strcasecmp ("pushm", word) || !strcasecmp ("popm", word)) {
+		//-----------------------------
+		// Saves or restores the range
+		// dest..src with one bounds check.
+		// popm undoes the pushm with the
+		// same range.
+		//-----------------------------
+		if (n_words != 3 || dest_reg < 0 || src_reg < 0) 
+			syntax (words, n_words);
+		if (src_reg < dest_reg)
+			error ("Register range is backwards.");
+
+		write_opcode (ouf, (word[1] == 'u' || word[1] == 'U' ? OP_PUSHM : OP_POPM)
+			| DEST(dest_reg) | SRC(src_reg));
+	}
 	else if (!strcasecmp ("mul", word)) {
 		if (dest_reg < 0) 
 			syntax (words, n_words);
@@ -919,6 +1520,89 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 			write_opcode (ouf, OP_SAR_IMM8 | DEST(dest_reg) | SRC(immed));
 		}
 	}
+	else if (!strcasecmp ("popcnt", word) || !strcasecmp ("lzcnt", word)
+	      || !strcasecmp ("tzcnt", word) || !strcasecmp ("crc32c", word)
+	      || !strcasecmp ("crc32c8", word)) {
+		if (n_words != 3 || dest_reg < 0 || src_reg < 0) 
+			syntax (words, n_words);
+
+		uint32_t op;
+		switch (tolower (word[0])) {
+		case 'p': op = OP_POPCNT; break;
+		case 'l': op = OP_LZCNT; break;
+		case 't': op = OP_TZCNT; break;
+		default: op = strcasecmp ("crc32c", word) ? OP_CRC32C8 : OP_CRC32C;
+		}
+		write_opcode (ouf, op | DEST(dest_reg) | SRC(src_reg));
+	}
+	else if (!strcasecmp ("bswap", word)) {
+		if (n_words != 2 || dest_reg < 0) 
+			syntax (words, n_words);
+
+		write_opcode (ouf, OP_BSWAP | DEST(dest_reg));
+	}
+	else if (!strcasecmp ("rol", word) || !strcasecmp ("ror", word)) {
+		if (n_words != 3 || dest_reg < 0 || (src_reg < 0 && !have_immed)) 
+			syntax (words, n_words);
+
+		bool left = tolower (word[2]) == 'l';
+		if (src_reg >= 0) {
+			write_opcode (ouf, (left ? OP_ROL : OP_ROR) | DEST(dest_reg) | SRC(src_reg));
+		} else {
+			if (immed >= 32) {
+				error ("Rotate count is too large.");
+			} 
+			write_opcode (ouf, (left ? OP_ROL_IMM8 : OP_ROR_IMM8) | DEST(dest_reg) | SRC(immed));
+		}
+	}
+	else if (!strcasecmp ("add64", word) || !strcasecmp ("sub64", word)
+	      || !strcasecmp ("mul64", word) || !strcasecmp ("mulw", word)
+	      || !strcasecmp ("imulw", word)) {
+		//-----------------------------
+		// 64-bit values are register
+		// pairs: rN low, rN+1 high.
+		//-----------------------------
+		if (n_words != 3 || dest_reg < 0 || src_reg < 0) 
+			syntax (words, n_words);
+
+		uint32_t op;
+		switch (tolower (word[0])) {
+		case 'a': op = OP_ADD64; break;
+		case 's': op = OP_SUB64; break;
+		case 'i': op = OP_IMULW; break;
+		default: op = strcasecmp ("mulw", word) ? OP_MUL64 : OP_MULW;
+		}
+		write_opcode (ouf, op | DEST(dest_reg) | SRC(src_reg));
+	}
+	else if (!strcasecmp ("shl64", word) || !strcasecmp ("shr64", word)
+	      || !strcasecmp ("sar64", word)) {
+		if (n_words != 3 || dest_reg < 0 || (src_reg < 0 && !have_immed)) 
+			syntax (words, n_words);
+
+		int which = !strcasecmp ("shl64", word) ? 0 : !strcasecmp ("shr64", word) ? 1 : 2;
+		if (src_reg >= 0) {
+			uint32_t ops[] = { OP_SHL64, OP_SHR64, OP_SAR64 };
+			write_opcode (ouf, ops[which] | DEST(dest_reg) | SRC(src_reg));
+		} else {
+			if (immed >= 64) {
+				error ("Shift count is too large.");
+			} 
+			uint32_t ops[] = { OP_SHL64_IMM8, OP_SHR64_IMM8, OP_SAR64_IMM8 };
+			write_opcode (ouf, ops[which] | DEST(dest_reg) | SRC(immed));
+		}
+	}
+	else if (!strcasecmp ("cmp64", word) || !strcasecmp ("cmpu64", word)) {
+		//-----------------------------
+		// cmp64 rX rA rB sets rX to
+		// -1, 0 or 1. B goes in byte 2.
+		//-----------------------------
+		if (n_words != 4 || dest_reg < 0 || src_reg < 0 || tolower (*words[3]) != 'r') 
+			syntax (words, n_words);
+
+		uint32_t other_reg = 255 & parse_register (words[3]);
+		write_opcode (ouf, (strcasecmp ("cmp64", word) ? OP_CMPU64 : OP_CMP64)
+			| DEST(dest_reg) | SRC(src_reg) | SRC2(other_reg));
+	}
 	else if (!strcasecmp ("div", word)) {
 		if (dest_reg < 0) 
 			syntax (words, n_words);
@@ -1005,7 +1689,7 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 
 		write_opcode (ouf, base + DEST(dest_reg) + SRC(src_reg));
 
-		uint32_t dest = calculate_branch32 (words[2]);
+		uint32_t dest = far_branch32 (words[2]);
 		write_uint32 (ouf, dest);
 	}
 	else if (!strcasecmp ("jbnear", word)
@@ -1045,7 +1729,7 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 		address -= 4;
 
 		if (pass_number == 1) {
-			write_opcode (ouf, 0); // Write dummy instruction.
+			write_placeholder (ouf);
 		}
 		else {
 			if (rel32 < 128 || rel32 > 0xffffff80) {
@@ -1073,7 +1757,7 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 			if (pass_number == 2)
 				error ("Call branch out of range.");
 
-			write_opcode (ouf, 0); // Write dummy instruction.
+			write_placeholder (ouf);
 		}
 	}
 	else if (!strcasecmp ("callnearb", word) 	// Call near backward
@@ -1097,7 +1781,7 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 			if (pass_number == 2)
 				error ("Call branch out of range.");
 
-			write_opcode (ouf, 0); // Write dummy instruction.
+			write_placeholder (ouf);
 		}
 	}
 	else if (!strcasecmp ("call", word)) {
@@ -1105,7 +1789,7 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 			syntax (words, n_words);
 
 		address += 4;
-		uint32_t rel32 = calculate_branch32 (words[1]);
+		uint32_t rel32 = far_branch32 (words[1]);
 		address -= 4;
 
 		write_opcode (ouf, OP_CALL);
@@ -1122,15 +1806,57 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 			syntax (words, n_words);
 		write_opcode (ouf, OP_DUMP);
 	}
+	else if (!strcasecmp ("switch", word)) {
+		//-----------------------------
+		// switch rI label0 label1 ...
+		// or switch rI, one case label
+		// per line, then endswitch.
+		// An index past the last case
+		// goes on after the table.
+		//-----------------------------
+		if (n_words < 2 || dest_reg < 0 || in_switch) 
+			syntax (words, n_words);
+
+		write_opcode (ouf, OP_SWITCH | DEST(dest_reg));
+		if (pass_number == 2)
+			switch_count_position = ftell (ouf);
+		write_uint32 (ouf, n_words - 2);
+		switch_table = address;
+		switch_cases = 0;
+
+		int i;
+		for (i = 2; i < n_words; i++)
+			write_uint32 (ouf, relative_to (words[i], switch_table));
+		in_switch = n_words == 2;
+	}
+	else if (!strcasecmp ("case", word)) {
+		if (n_words != 2 || !in_switch) 
+			syntax (words, n_words);
+
+		write_uint32 (ouf, relative_to (words[1], switch_table));
+		switch_cases++;
+	}
+	else if (!strcasecmp ("endswitch", word)) {
+		if (n_words != 1 || !in_switch) 
+			syntax (words, n_words);
+
+		if (pass_number == 2) {
+			long here = ftell (ouf);
+			fseek (ouf, switch_count_position, SEEK_SET);
+			fwrite (&switch_cases, 1, 4, ouf);
+			fseek (ouf, here, SEEK_SET);
+		}
+		in_switch = false;
+	}
 	else if (!strcasecmp ("jmp", word)) {	// Absolute.
 		if (n_words != 2) 
 			syntax (words, n_words);
 
 		write_opcode (ouf, OP_JUMP);
-		uint32_t rel32 = calculate_branch32 (words[1]);
+		uint32_t rel32 = far_branch32 (words[1]);
 		write_uint32 (ouf, rel32);
 	}
-	else {
+	else if (!parse_fp_instruction (words, n_words, ouf)) {
 		fprintf (stderr, "Unknown instruction %s.\n", word);
 		exit (ERR_INSTRUCTION);
 	}
@@ -1138,8 +1864,47 @@ parse_instruction (char **words, int n_words, FILE *ouf)
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// Name:	switch_section
+// Purpose:	Makes another section current.
+//-----------------------------------------------------------------------------
+
+static void
+switch_section (int section)
+{
+	pair_open = false;
+	sections [in_section].address = address;
+	in_section = section;
+	address = sections [section].address;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	add_line
+// Purpose:	Notes that the instruction at a text address came from a line.
+//-----------------------------------------------------------------------------
+
+static void
+add_line (uint32_t at, int line_number)
+{
+	static uint32_t max_lines = 0;
+
+	if (pass_number != 2)
+		return;
+	if (n_lines && lines [n_lines - 1].address == at)
+		return;
+	if (n_lines == max_lines) {
+		max_lines = max_lines ? 2 * max_lines : 256;
+		lines = realloc (lines, max_lines * sizeof (ImageLine));
+		if (!lines)
+			error ("Out of memory.");
+	}
+	lines [n_lines].address = at;
+	lines [n_lines].line = line_number;
+	n_lines++;
+}
+
 int
-process (FILE *inf, FILE *ouf)
+process (FILE *inf)
 {
 	if (pass_number != 1 && pass_number != 2)
 		return false;
@@ -1148,6 +1913,12 @@ process (FILE *inf, FILE *ouf)
 	char line [MAX_LINELEN];
 	char *words [MAX_WORDS];
 
+	int i;
+	for (i = SECTION_TEXT; i <= SECTION_DATA; i++)
+		sections [i].address = sections [i].base;
+	in_section = SECTION_TEXT;
+	address = sections [SECTION_TEXT].base;
+
 	int len=0;
 	while (EOF != (len = readline (inf, line, 255))) 
 	{
@@ -1189,60 +1960,321 @@ process (FILE *inf, FILE *ouf)
 			if (n_words != 2)
 				syntax (words, n_words);
 			if (!strcasecmp (words[1], "text")) {
-				in_section = 't';
+				switch_section (SECTION_TEXT);
+			}
+			else if (!strcasecmp (words[1], "rodata")) {
+				switch_section (SECTION_RODATA);
 			}
 			else if (!strcasecmp (words[1], "data")) {
-				in_section = 'd';
+				switch_section (SECTION_DATA);
 			}
 			else
 				error ("Invalid section type.");
 			continue;
 		}
+		if (!strcasecmp ("entry", word)) {
+			if (n_words != 2)
+				syntax (words, n_words);
+			if (!lookup_label (words[1], &entry))
+				unknown_label (words[1]);
+			continue;
+		}
+		if (!strcasecmp ("global", word)) {
+			//-----------------------------
+			// global label ... exports
+			// labels to other modules.
+			//-----------------------------
+			if (n_words < 2)
+				syntax (words, n_words);
+			for (i = 1; i < n_words && pass_number == 2; i++) {
+				int label = find_name (&label_index, labels, words[i]);
+				if (label < 0)
+					unknown_label (words[i]);
+				label_global [label] = true;
+			}
+			continue;
+		}
 
+		FILE *ouf = sections [in_section].file;
 		switch (in_section) {
-		case 't':
+		case SECTION_TEXT: {
+			uint32_t at = address;
+			uint32_t pairs = n_pairs;
 			parse_instruction (words, n_words, ouf);
+			if (n_pairs != pairs)
+				add_line (at - 4, line_number);
+			else if (address != at)
+				add_line (at, line_number);
 			break;
-		case 'd':
+		}
+		default:
 			parse_data (words, n_words, ouf);
 			break;
 		}
 
 	}
+
+	if (in_switch)
+		error ("Missing endswitch.");
+	switch_section (SECTION_TEXT);
 	return 0;
 }
 
-int
-main (int argc, const char **argv)
+//-----------------------------------------------------------------------------
+// Name:	write_padding
+// Purpose:	Pads the output with zeros up to an offset.
+//-----------------------------------------------------------------------------
+
+static void
+write_padding (FILE *f, uint32_t offset)
 {
-	if (argc < 2 || argc > 3)
-		usage ();
+	while (ftell (f) < offset)
+		fputc (0, f);
+}
 
-        printf ("This is "ASSEMBLER_NAME" version "RELEASE".\n");
-        printf ("Copyright (C) 2012-2013 by Zack T Smith.\n\n");
-        printf ("This software is covered by the GNU Public License.\n");
-        printf ("It is provided AS-IS, use at your own risk.\n");
-        printf ("See the file COPYING for more information.\n\n");
-        fflush (stdout);
+//-----------------------------------------------------------------------------
+// Name:	pack_section
+// Purpose:	Compresses a section as a series of chunks. A chunk that
+//		does not get smaller is stored as is.
+// Returns:	The chunks, in a buffer that replaces raw.
+//-----------------------------------------------------------------------------
 
-	const char *inpath = argv[1];
-	const char *outpath = argc == 3 ? argv[2] : "out.dat";
+static char *
+pack_section (const char *raw, uint32_t length, uint32_t *packed)
+{
+	uint32_t n_chunks = (length + LZ_CHUNK - 1) / LZ_CHUNK;
+	char *out = malloc (length + n_chunks * sizeof (ImageChunk) + 1);
+	if (!out)
+		error ("Out of memory.");
+
+	uint32_t at = 0, position = 0;
+	while (at < length) {
+		ImageChunk chunk;
+		chunk.length = length - at < LZ_CHUNK ? length - at : LZ_CHUNK;
+		chunk.packed = lz_compress (raw + at, chunk.length,
+					    out + position + sizeof (chunk));
+		if (!chunk.packed) {
+			chunk.packed = chunk.length;
+			memcpy (out + position + sizeof (chunk), raw + at, chunk.length);
+		}
+		memcpy (out + position, &chunk, sizeof (chunk));
+		position += sizeof (chunk) + chunk.packed;
+		at += chunk.length;
+	}
+	*packed = position;
+	return out;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	write_image
+// Purpose:	Puts the sections assembled in pass 2 together into a
+//		version 2 image, adding the symbols and the line table.
+//		With -c, writes an object instead, which is not compressed.
+//-----------------------------------------------------------------------------
+
+static void
+write_image (FILE *ouf, const char *inpath)
+{
+	bool pack = compress && !object;
+
+	//------------------------------
+	// The strings: the source file,
+	// then the label names. An object
+	// also names the labels it uses
+	// from other modules.
+	//
+	int n_symbols = n_labels + (object ? n_externals : 0);
+	uint32_t strings_length = strlen (inpath) + 1;
+	int i;
+	for (i = 0; i < n_symbols; i++)
+		strings_length += strlen (i < n_labels ? labels [i] : externals [i - n_labels]) + 1;
+	strings_length = (strings_length + 3) & ~3;
+
+	char *strings = calloc (1, strings_length);
+	ImageSymbol *symbols = calloc (n_symbols + 1, sizeof (ImageSymbol));
+	if (!strings || !symbols)
+		error ("Out of memory.");
+	strcpy (strings, inpath);
+	uint32_t name = strlen (inpath) + 1;
+	for (i = 0; i < n_symbols; i++) {
+		const char *label = i < n_labels ? labels [i] : externals [i - n_labels];
+		strcpy (strings + name, label);
+		symbols [i].name = name;
+		if (i >= n_labels) {
+			symbols [i].section = SYMBOL_UNDEFINED;
+			symbols [i].address = 0;
+		} else {
+			symbols [i].section = label_sections [i];
+			if (object && label_global [i])
+				symbols [i].section |= SYMBOL_GLOBAL;
+			symbols [i].address = label_addresses [i];
+		}
+		name += strlen (label) + 1;
+	}
+	for (i = 0; i < n_relocations && object; i++)
+		if (relocations [i].symbol & EXTERNAL)
+			relocations [i].symbol = n_labels + (relocations [i].symbol & ~EXTERNAL);
+
+	//------------------------------
+	// Lay out the sections. Empty
+	// rodata and data are left out.
+	//
+	ImageSection table [MAX_IMAGE_SECTIONS];
+	char *contents [MAX_IMAGE_SECTIONS];
+	int n = 0;
+	for (i = SECTION_TEXT; i <= SECTION_DATA; i++) {
+		uint32_t length = sections [i].length;
+		if (i != SECTION_TEXT && !length)
+			continue;
+
+		char *raw = malloc (length + 1);
+		if (!raw)
+			error ("Out of memory.");
+		rewind (sections [i].file);
+		if (fread (raw, 1, length, sections [i].file) != length)
+			error ("Cannot read back the temporary file.");
+
+		table [n].type = i;
+		table [n].length = length;
+		table [n].address = object && i != SECTION_TEXT ? sections [i].align : sections [i].base;
+		contents [n++] = raw;
+	}
+	table [n].type = SECTION_SYMBOLS;
+	table [n].length = n_symbols * sizeof (ImageSymbol);
+	table [n].address = 0;
+	contents [n++] = (char*) symbols;
+	if (object) {
+		table [n].type = SECTION_RELOCATIONS;
+		table [n].length = n_relocations * sizeof (ImageRelocation);
+		table [n].address = 0;
+		contents [n++] = (char*) relocations;
+	}
+	table [n].type = SECTION_LINES;
+	table [n].length = n_lines * sizeof (ImageLine);
+	table [n].address = 0;
+	contents [n++] = (char*) lines;
+	table [n].type = SECTION_STRINGS;
+	table [n].length = strings_length;
+	table [n].address = 0;
+	contents [n++] = strings;
+
+	//------------------------------
+	// Only sections that can be mapped
+	// need to be on page boundaries.
+	//
+	uint32_t offset = sizeof (ImageHeader) + n * sizeof (ImageSection);
+	for (i = 0; i < n; i++) {
+		table [i].packed = 0;
+		if (pack) {
+			if (table [i].type == SECTION_LINES) {
+				uint32_t k;
+				for (k = n_lines; k > 1; k--) {
+					lines [k - 1].address -= lines [k - 2].address;
+					lines [k - 1].line -= lines [k - 2].line;
+				}
+			}
+			char *packed = pack_section (contents [i], table [i].length, &table [i].packed);
+			printf ("Section %lu packed from %lu to %lu bytes.\n",
+				(unsigned long) table [i].type, (unsigned long) table [i].length,
+				(unsigned long) table [i].packed);
+			if (table [i].type <= SECTION_DATA)
+				free (contents [i]);
+			contents [i] = packed;
+		}
+
+		uint32_t align = table [i].type <= SECTION_DATA && !pack && !object ? IMAGE_PAGE : 4;
+		offset = (offset + align - 1) & ~(align - 1);
+		table [i].offset = offset;
+		offset += pack ? table [i].packed : table [i].length;
+	}
+
+	ImageHeader header = { object ? MAGIC_OBJECT : MAGIC_V2, IMAGE_VERSION, n, entry };
+	fwrite (&header, 1, sizeof (header), ouf);
+	fwrite (table, sizeof (ImageSection), n, ouf);
+
+	for (i = 0; i < n; i++) {
+		write_padding (ouf, table [i].offset);
+		fwrite (contents [i], 1, pack ? table [i].packed : table [i].length, ouf);
+		if (pack || table [i].type <= SECTION_DATA)
+			free (contents [i]);
+	}
+
+	free (strings);
+	free (symbols);
+}
 
+//-----------------------------------------------------------------------------
+// Name:	reset
+// Purpose:	Forgets the last module, before another is assembled.
+//-----------------------------------------------------------------------------
+
+static void
+reset (void)
+{
+	int i;
+	for (i = 0; i < n_labels; i++)
+		free (labels [i]);
+	n_labels = 0;
+	free_index (&label_index);
+	for (i = 0; i < n_externals; i++)
+		free (externals [i]);
+	n_externals = 0;
+	free_index (&external_index);
+	n_relocations = 0;
+	n_lines = 0;
+
+	memset (sections, 0, sizeof (sections));
+	for (i = SECTION_TEXT; i <= SECTION_DATA; i++)
+		sections [i].align = 4;
+	entry = object ? NO_ENTRY : 0;
+	in_switch = false;
+	n_pairs = 0;
+	pair_open = false;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	assemble
+// Purpose:	Assembles one source file into an image, or with -c into
+//		an object.
+//-----------------------------------------------------------------------------
+
+static void
+assemble (const char *inpath, const char *outpath)
+{
 	FILE *inf = fopen (inpath, "rb");
 	if (!inf) {
 		perror (ASSEMBLER_NAME);
 		exit (ERR_INFILE);
 	}
 
+	reset ();
+	source_path = inpath;
+
 	//----------------------------------------
 	// Pass 1: Determine addresses of labels.
 	//
 	puts ("Pass 1");
-	address = 0;
 	pass_number = 1;
-	process (inf, NULL);
+	process (inf);
 	fclose (inf);
 
+	//------------------------------
+	// Now that their lengths are known,
+	// place rodata and data in VM memory
+	// and move their labels there. In an
+	// object that is left to the linker.
+	//
+	int i;
+	for (i = SECTION_TEXT; i <= SECTION_DATA; i++)
+		sections [i].length = sections [i].address;
+	if (!object) {
+		sections [SECTION_RODATA].base = IMAGE_DATA_BASE;
+		sections [SECTION_DATA].base = IMAGE_DATA_BASE +
+			((sections [SECTION_RODATA].length + IMAGE_PAGE - 1) & ~(IMAGE_PAGE - 1));
+		for (i = 0; i < n_labels; i++)
+			label_addresses [i] += sections [label_sections [i]].base;
+	}
+
 	inf = fopen (inpath, "rb");
 	if (!inf) {
 		perror (ASSEMBLER_NAME);
@@ -1258,24 +2290,531 @@ main (int argc, const char **argv)
 		perror (ASSEMBLER_NAME);
 		exit (ERR_OUTFILE);
 	}
+	for (i = SECTION_TEXT; i <= SECTION_DATA; i++) {
+		sections [i].file = tmpfile ();
+		if (!sections [i].file) {
+			perror (ASSEMBLER_NAME);
+			exit (ERR_OUTFILE);
+		}
+	}
+
+	pass_number = 2;
+	n_pairs = 0;
+	pair_open = false;
+	process (inf);
+	fclose (inf);
+	for (i = SECTION_TEXT; i <= SECTION_DATA; i++)
+		if (sections [i].address - sections [i].base != sections [i].length)
+			error ("Pass 2 did not end where pass 1 did.");
+	write_image (ouf, inpath);
+	if (fclose (ouf)) {
+		perror (ASSEMBLER_NAME);
+		exit (ERR_OUTFILE);
+	}
+	for (i = SECTION_TEXT; i <= SECTION_DATA; i++)
+		fclose (sections [i].file);
+
+	if (dense)
+		printf ("\n%lu instructions paired, program is %lu bytes.\n",
+			(unsigned long) n_pairs * 2,
+			(unsigned long) sections [SECTION_TEXT].length);
+}
 
-	// Write magic number.
-	static uint32_t magic = MAGIC;
-	fwrite (&magic, 1, 4, ouf);
+//------------------------------
+// An object being linked. Its
+// sections point into file.
+//
+typedef struct {
+	const char *path;
+	char *file;
+	ImageHeader header;
+	char *contents [SECTION_RELOCATIONS + 1];
+	uint32_t lengths [SECTION_RELOCATIONS + 1];
+	uint32_t align [SECTION_DATA + 1];
+	uint32_t base [SECTION_DATA + 1];	// Where its sections go.
+	int *symbol_labels;			// Each symbol as a label, or -1.
+} Module;
+
+static void
+bad_object (const char *path, const char *why)
+{
+	fprintf (stderr, "Error: %s: %s\n", path, why);
+	exit (ERR_INFILE);
+}
 
-	uint32_t sizes [4];
-	sizes[0] = address;
-	sizes[1] = constants_length;
-	sizes[2] = 0;
-	sizes[3] = 0;
-	// Write section lengths.
-	fwrite (sizes, 1, 16, ouf);
+//-----------------------------------------------------------------------------
+// Name:	read_object
+// Purpose:	Reads all of an object and finds its sections.
+//-----------------------------------------------------------------------------
 
-	// Write program bytes.
-	address = 0;
+static void
+read_object (const char *path, Module *module)
+{
+	FILE *f = fopen (path, "rb");
+	if (!f) {
+		perror (ASSEMBLER_NAME);
+		exit (ERR_INFILE);
+	}
+	fseek (f, 0, SEEK_END);
+	long size = ftell (f);
+	rewind (f);
+	if (size < (long) sizeof (ImageHeader))
+		bad_object (path, "Not an object.");
+	char *file = malloc (size + 1);
+	if (!file)
+		error ("Out of memory.");
+	if (fread (file, 1, size, f) != size)
+		bad_object (path, "Cannot read it.");
+	fclose (f);
+
+	memset (module, 0, sizeof (Module));
+	module->path = path;
+	module->file = file;
+	memcpy (&module->header, file, sizeof (ImageHeader));
+	if (module->header.magic != MAGIC_OBJECT)
+		bad_object (path, "Not an object.");
+	if (module->header.version != IMAGE_VERSION)
+		bad_object (path, "Made by another version of rasm.");
+	if (module->header.n_sections > MAX_IMAGE_SECTIONS
+	    || sizeof (ImageHeader) + module->header.n_sections * sizeof (ImageSection) > size)
+		bad_object (path, "Bad section table.");
+
+	int i;
+	for (i = SECTION_TEXT; i <= SECTION_DATA; i++)
+		module->align [i] = 4;
+	for (i = 0; i < module->header.n_sections; i++) {
+		ImageSection section;
+		memcpy (&section, file + sizeof (ImageHeader) + i * sizeof (ImageSection),
+			sizeof (section));
+		if (section.offset > size || section.length > size - section.offset)
+			bad_object (path, "Section runs off the end.");
+		if (section.packed)
+			bad_object (path, "Objects are not compressed.");
+		if (section.type < SECTION_TEXT || section.type > SECTION_RELOCATIONS)
+			continue;
+		module->contents [section.type] = file + section.offset;
+		module->lengths [section.type] = section.length;
+		if (section.type != SECTION_TEXT && section.type <= SECTION_DATA && section.address) {
+			if (section.address & (section.address - 1) || section.address > IMAGE_PAGE)
+				bad_object (path, "Bad section alignment.");
+			module->align [section.type] = section.address;
+		}
+	}
+
+	if (module->lengths [SECTION_TEXT] & 3
+	    || module->lengths [SECTION_SYMBOLS] % sizeof (ImageSymbol)
+	    || module->lengths [SECTION_LINES] % sizeof (ImageLine)
+	    || module->lengths [SECTION_RELOCATIONS] % sizeof (ImageRelocation)
+	    || !module->lengths [SECTION_STRINGS]
+	    || module->contents [SECTION_STRINGS] [module->lengths [SECTION_STRINGS] - 1])
+		bad_object (path, "Bad section length.");
+	if (module->header.entry != NO_ENTRY
+	    && module->header.entry >= module->lengths [SECTION_TEXT])
+		bad_object (path, "Bad entry.");
+}
+
+//-----------------------------------------------------------------------------
+// Name:	link_objects
+// Purpose:	Puts objects together into an image. Each module's sections
+//		follow those of the modules before it; the labels it uses
+//		from the others must be exported by exactly one of them.
+//-----------------------------------------------------------------------------
+
+static void
+link_objects (const char *outpath, const char **paths, int n_modules)
+{
+	Module *modules = calloc (n_modules, sizeof (Module));
+	if (!modules)
+		error ("Out of memory.");
+
+	object = false;
+	reset ();
 	pass_number = 2;
-	process (inf, ouf);
 
-	return 0;
+	//------------------------------
+	// Lay out the sections of every
+	// module.
+	//
+	uint32_t at [SECTION_DATA + 1] = { 0 };
+	uint32_t names_length = 1;
+	int i, j;
+	for (i = 0; i < n_modules; i++) {
+		Module *module = &modules [i];
+		read_object (paths [i], module);
+		for (j = SECTION_TEXT; j <= SECTION_DATA; j++) {
+			uint32_t align = module->align [j];
+			at [j] = (at [j] + align - 1) & ~(align - 1);
+			module->base [j] = at [j];
+			at [j] += module->lengths [j];
+			if (at [j] < module->lengths [j])
+				error ("Program is too large.");
+		}
+		names_length += strlen (module->contents [SECTION_STRINGS]) + 1;
+	}
+	for (j = SECTION_TEXT; j <= SECTION_DATA; j++)
+		sections [j].length = at [j];
+	sections [SECTION_RODATA].base = IMAGE_DATA_BASE;
+	sections [SECTION_DATA].base = IMAGE_DATA_BASE +
+		((sections [SECTION_RODATA].length + IMAGE_PAGE - 1) & ~(IMAGE_PAGE - 1));
+
+	//------------------------------
+	// Every label defined goes into
+	// the image's symbols; exported
+	// ones are also indexed by name.
+	//
+	NameIndex global_index = { NULL, 0, 0 };
+	for (i = 0; i < n_modules; i++) {
+		Module *module = &modules [i];
+		const ImageSymbol *symbols = (const ImageSymbol*) module->contents [SECTION_SYMBOLS];
+		uint32_t n_symbols = module->lengths [SECTION_SYMBOLS] / sizeof (ImageSymbol);
+		const char *strings = module->contents [SECTION_STRINGS];
+		uint32_t k;
+
+		module->symbol_labels = malloc ((n_symbols + 1) * sizeof (int));
+		if (!module->symbol_labels)
+			error ("Out of memory.");
+		for (k = 0; k < n_symbols; k++) {
+			ImageSymbol symbol;
+			memcpy (&symbol, &symbols [k], sizeof (symbol));
+			int section = symbol.section & ~SYMBOL_GLOBAL;
+			if (symbol.name >= module->lengths [SECTION_STRINGS]
+			    || section > SECTION_DATA
+			    || (section != SYMBOL_UNDEFINED && symbol.address > module->lengths [section]))
+				bad_object (module->path, "Bad symbol.");
+			if (section == SYMBOL_UNDEFINED) {
+				module->symbol_labels [k] = -1;
+				continue;
+			}
+
+			const char *name = strings + symbol.name;
+			bool global = symbol.section & SYMBOL_GLOBAL;
+			if (global && find_name (&global_index, labels, name) >= 0) {
+				fprintf (stderr, "Error: %s: Label \"%s\" is exported by two modules.\n",
+					 module->path, name);
+				exit (ERR_UNKNOWN_LABEL);
+			}
+			define_label (name, sections [section].base + module->base [section] + symbol.address,
+				      section, global);
+			module->symbol_labels [k] = n_labels - 1;
+			if (global)
+				index_name (&global_index, labels, n_labels - 1);
+		}
+	}
+
+	//------------------------------
+	// Fill in the words that refer to
+	// other modules, and take the entry
+	// and lines.
+	//
+	bool have_entry = false;
+	for (i = 0; i < n_modules; i++) {
+		Module *module = &modules [i];
+		const ImageRelocation *relocations = (const ImageRelocation*) module->contents [SECTION_RELOCATIONS];
+		uint32_t n = module->lengths [SECTION_RELOCATIONS] / sizeof (ImageRelocation);
+		uint32_t n_symbols = module->lengths [SECTION_SYMBOLS] / sizeof (ImageSymbol);
+		uint32_t k;
+
+		for (k = 0; k < n; k++) {
+			ImageRelocation relocation;
+			memcpy (&relocation, &relocations [k], sizeof (relocation));
+			if (relocation.section < SECTION_TEXT || relocation.section > SECTION_DATA
+			    || relocation.address > module->lengths [relocation.section]
+			    || module->lengths [relocation.section] - relocation.address < 4
+			    || relocation.symbol >= n_symbols
+			    || (relocation.type != RELOCATION_RELATIVE
+				&& relocation.type != RELOCATION_ABSOLUTE))
+				bad_object (module->path, "Bad relocation.");
+
+			int label = module->symbol_labels [relocation.symbol];
+			if (label < 0) {
+				ImageSymbol symbol;
+				memcpy (&symbol, module->contents [SECTION_SYMBOLS]
+					+ relocation.symbol * sizeof (ImageSymbol), sizeof (symbol));
+				const char *name = module->contents [SECTION_STRINGS] + symbol.name;
+				label = find_name (&global_index, labels, name);
+				if (label < 0) {
+					fprintf (stderr, "Error: %s: No module exports \"%s\".\n",
+						 module->path, name);
+					exit (ERR_UNKNOWN_LABEL);
+				}
+			}
+
+			char *word = module->contents [relocation.section] + relocation.address;
+			uint32_t place = sections [relocation.section].base
+				+ module->base [relocation.section] + relocation.address;
+			uint32_t value;
+			memcpy (&value, word, 4);
+			if (relocation.type == RELOCATION_RELATIVE)
+				value += label_addresses [label] - place;
+			else if (label_sections [label] != SECTION_TEXT)
+				value += label_addresses [label];
+			else {
+				fprintf (stderr, "Error: %s: \"%s\" is not a rodata or data label.\n",
+					 module->path, labels [label]);
+				exit (ERR_UNKNOWN_LABEL);
+			}
+			memcpy (word, &value, 4);
+		}
+
+		if (module->header.entry != NO_ENTRY) {
+			if (have_entry)
+				bad_object (module->path, "Another module has the entry.");
+			entry = module->base [SECTION_TEXT] + module->header.entry;
+			have_entry = true;
+		}
+
+		const ImageLine *module_lines = (const ImageLine*) module->contents [SECTION_LINES];
+		n = module->lengths [SECTION_LINES] / sizeof (ImageLine);
+		for (k = 0; k < n; k++) {
+			ImageLine line;
+			memcpy (&line, &module_lines [k], sizeof (line));
+			add_line (module->base [SECTION_TEXT] + line.address, line.line);
+		}
+	}
+
+	//------------------------------
+	// The sections go out through the
+	// same temporary files as when
+	// assembling.
+	//
+	for (j = SECTION_TEXT; j <= SECTION_DATA; j++) {
+		sections [j].file = tmpfile ();
+		if (!sections [j].file) {
+			perror (ASSEMBLER_NAME);
+			exit (ERR_OUTFILE);
+		}
+		for (i = 0; i < n_modules; i++) {
+			write_padding (sections [j].file, modules [i].base [j]);
+			fwrite (modules [i].contents [j], 1, modules [i].lengths [j], sections [j].file);
+		}
+		write_padding (sections [j].file, sections [j].length);
+	}
+
+	// The source names, for the strings.
+	char *names = calloc (1, names_length);
+	if (!names)
+		error ("Out of memory.");
+	for (i = 0; i < n_modules; i++) {
+		if (i)
+			strcat (names, " ");
+		strcat (names, modules [i].contents [SECTION_STRINGS]);
+	}
+
+	FILE *ouf = fopen (outpath, "wb");
+	if (!ouf) {
+		perror (ASSEMBLER_NAME);
+		exit (ERR_OUTFILE);
+	}
+	write_image (ouf, names);
+	if (fclose (ouf)) {
+		perror (ASSEMBLER_NAME);
+		exit (ERR_OUTFILE);
+	}
+
+	printf ("Linked %d modules, program is %lu bytes.\n", n_modules,
+		(unsigned long) sections [SECTION_TEXT].length);
+
+	for (j = SECTION_TEXT; j <= SECTION_DATA; j++)
+		fclose (sections [j].file);
+	for (i = 0; i < n_modules; i++) {
+		free (modules [i].file);
+		free (modules [i].symbol_labels);
+	}
+	free (modules);
+	free (names);
+	free_index (&global_index);
 }
 
+//-----------------------------------------------------------------------------
+// Name:	hash_file
+// Purpose:	Folds the contents of a file into a 64-bit FNV-1a hash.
+//-----------------------------------------------------------------------------
+
+static uint64_t
+hash_file (uint64_t hash, const char *path)
+{
+	FILE *f = fopen (path, "rb");
+	if (!f) {
+		perror (path);
+		exit (ERR_INFILE);
+	}
+
+	char buffer [65536];
+	size_t n;
+	while ((n = fread (buffer, 1, sizeof (buffer), f)) > 0) {
+		size_t i;
+		for (i = 0; i < n; i++)
+			hash = (hash ^ (unsigned char) buffer [i]) * 1099511628211ull;
+	}
+	fclose (f);
+	return hash;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	hash_source
+// Purpose:	Identifies what an object made from a source file would
+//		hold: the file's path and contents, those of the files it
+//		includes with incbin, the options that change the code, and
+//		the version of rasm.
+// Returns:	A 64-bit FNV-1a hash.
+//-----------------------------------------------------------------------------
+
+static uint64_t
+hash_source (const char *inpath)
+{
+	uint64_t hash = 14695981039346656037ull;
+	char line [MAX_LINELEN];
+	snprintf (line, sizeof (line), "%s %s %d", RELEASE, inpath, dense);
+	const char *p;
+	for (p = line; *p; p++)
+		hash = (hash ^ (unsigned char) *p) * 1099511628211ull;
+
+	hash = hash_file (hash, inpath);
+
+	FILE *f = fopen (inpath, "rb");
+	if (!f) {
+		perror (ASSEMBLER_NAME);
+		exit (ERR_INFILE);
+	}
+	char *words [MAX_WORDS];
+	while (EOF != readline (f, line, 255)) {
+		int n_words = break_line_into_words (line, words);
+		int first = n_words && strchr (words[0], ':') ? 1 : 0;
+		if (n_words < first + 2 || strcasecmp ("incbin", words [first]))
+			continue;
+		parse_string (words [first + 1]);
+		char *path = included_path (inpath, words [first + 1]);
+		hash = hash_file (hash, path);
+		free (path);
+	}
+	fclose (f);
+	return hash;
+}
+
+//-----------------------------------------------------------------------------
+// Name:	build
+// Purpose:	Assembles each source file that has changed into an object
+//		in the cache, then links them all. The cache is the directory
+//		$RASM_CACHE, or .rasm-cache.
+//-----------------------------------------------------------------------------
+
+static void
+build (const char *outpath, const char **inpaths, int n_modules)
+{
+	const char *cache = getenv ("RASM_CACHE");
+	if (!cache || !*cache)
+		cache = ".rasm-cache";
+	mkdir (cache, 0777);
+
+	const char **paths = calloc (n_modules, sizeof (char*));
+	if (!paths)
+		error ("Out of memory.");
+
+	int i, n_assembled = 0;
+	for (i = 0; i < n_modules; i++) {
+		uint64_t hash = hash_source (inpaths [i]);
+		size_t length = strlen (cache) + 40;
+		char *path = malloc (length);
+		if (!path)
+			error ("Out of memory.");
+		snprintf (path, length, "%s/%08lx%08lx.o", cache,
+			  (unsigned long) (hash >> 32), (unsigned long) (hash & 0xffffffff));
+		paths [i] = path;
+
+		if (!access (path, R_OK)) {
+			printf ("%s is unchanged.\n", inpaths [i]);
+			continue;
+		}
+
+		//------------------------------
+		// Renamed into place only once
+		// complete, so that an interrupted
+		// build leaves nothing half written.
+		//
+		char *temporary = malloc (length + 16);
+		if (!temporary)
+			error ("Out of memory.");
+		snprintf (temporary, length + 16, "%s.%lu", path, (unsigned long) getpid ());
+		printf ("Assembling %s.\n", inpaths [i]);
+		object = true;
+		assemble (inpaths [i], temporary);
+		if (rename (temporary, path)) {
+			perror (ASSEMBLER_NAME);
+			exit (ERR_OUTFILE);
+		}
+		free (temporary);
+		n_assembled++;
+	}
+
+	link_objects (outpath, paths, n_modules);
+	printf ("%d of %d modules assembled.\n", n_assembled, n_modules);
+
+	for (i = 0; i < n_modules; i++)
+		free ((char*) paths [i]);
+	free (paths);
+}
+
+int
+main (int argc, const char **argv)
+{
+	enum { ASSEMBLE, LINK, BUILD } mode = ASSEMBLE;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp (argv[1], "--dense"))
+			dense = true;
+		else if (!strcmp (argv[1], "--compress"))
+			compress = true;
+		else if (!strcmp (argv[1], "-c"))
+			object = true;
+		else if (!strcmp (argv[1], "--link"))
+			mode = LINK;
+		else if (!strcmp (argv[1], "--build"))
+			mode = BUILD;
+		else
+			usage ();
+		argc--;
+		argv++;
+	}
+	if (mode == ASSEMBLE ? argc < 2 || argc > 3 : argc < 3 || object)
+		usage ();
+
+        printf ("This is "ASSEMBLER_NAME" version "RELEASE".\n");
+        printf ("Copyright (C) 2012-2013 by Zack T Smith.\n\n");
+        printf ("This software is covered by the GNU Public License.\n");
+        printf ("It is provided AS-IS, use at your own risk.\n");
+        printf ("See the file COPYING for more information.\n\n");
+        fflush (stdout);
+
+	if (mode == LINK) {
+		link_objects (argv[1], argv + 2, argc - 2);
+		return 0;
+	}
+	if (mode == BUILD) {
+		build (argv[1], argv + 2, argc - 2);
+		return 0;
+	}
+
+	const char *inpath = argv[1];
+	const char *outpath = argc == 3 ? argv[2] : "out.dat";
+
+	//------------------------------
+	// An object is named after its
+	// source file by default.
+	//
+	char *object_path = NULL;
+	if (object && argc == 2) {
+		object_path = malloc (strlen (inpath) + 3);
+		if (!object_path)
+			error ("Out of memory.");
+		strcpy (object_path, inpath);
+		char *dot = strrchr (object_path, '.');
+		if (dot && !strchr (dot, '/'))
+			*dot = 0;
+		strcat (object_path, ".o");
+		outpath = object_path;
+	}
+
+	assemble (inpath, outpath);
+	free (object_path);
+	return 0;
+}
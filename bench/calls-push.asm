@@ -0,0 +1,44 @@
+; Call-heavy benchmark: each call saves and restores 16 registers
+; one at a time. Compare with calls-pushm.asm.
+	mov r1 0
+	mov r2 2000000
+top:
+	call work
+	decjnz r2 top
+	exit
+
+work:
+	push r10
+	push r11
+	push r12
+	push r13
+	push r14
+	push r15
+	push r16
+	push r17
+	push r18
+	push r19
+	push r20
+	push r21
+	push r22
+	push r23
+	push r24
+	push r25
+	add r1 1
+	pop r25
+	pop r24
+	pop r23
+	pop r22
+	pop r21
+	pop r20
+	pop r19
+	pop r18
+	pop r17
+	pop r16
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop r11
+	pop r10
+	ret
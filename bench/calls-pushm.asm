@@ -0,0 +1,14 @@
+; Call-heavy benchmark: as calls-push.asm, but saving and restoring
+; the 16 registers with pushm/popm.
+	mov r1 0
+	mov r2 2000000
+top:
+	call work
+	decjnz r2 top
+	exit
+
+work:
+	pushm r10 r25
+	add r1 1
+	popm r10 r25
+	ret
@@ -0,0 +1,12 @@
+; Checksum benchmark: CRC32C of 10M 32-bit words, plus the number of
+; set bits in them. The CRC ends up in r1, the bit count in r4.
+	mov r1 -1
+	mov r4 0
+	mov r2 10000000
+top:
+	crc32c r1 r2
+	popcnt r3 r2
+	add r4 r3
+	decjnz r2 top
+	not r1
+	exit
@@ -0,0 +1,26 @@
+; Hash loop made of short-form instructions on r1-r15. Assemble it
+; with and without rasm --dense to compare program size and speed.
+	mov r1 1
+	mov r2 0
+	mov r9 2000000
+top:
+	mov r3 r1
+	shl r3 5
+	add r1 r3
+	mov r4 r1
+	shr r4 7
+	xor r1 r4
+	store32 r1 r2
+	load32 r5 r2
+	add r5 3
+	mul r5 r1
+	sub r1 r5
+	and r6 r1
+	or r6 r5
+	sar r6 2
+	mov r7 9
+	add r1 r6
+	add r2 4
+	and r2 r8
+	decjnz r9 top
+	exit
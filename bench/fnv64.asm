@@ -0,0 +1,14 @@
+; 64-bit FNV-1a over the low byte of a counter, 10M rounds.
+; The hash is in r10:r11 and the prime in r12:r13.
+	mov r10 0x84222325
+	mov r11 0xcbf29ce4
+	mov r12 0x1b3
+	mov r13 0x100
+	mov r2 10000000
+top:
+	mov r3 r2
+	and r3 255
+	xor r10 r3
+	mul64 r10 r12
+	decjnz r2 top
+	exit
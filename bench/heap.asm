@@ -0,0 +1,48 @@
+; Heap benchmark: builds and frees a 1000-node linked list 100 times,
+; then grows an array a word at a time to 100000 words with realloc.
+; The list sum ends up in r1, the first and last words in r8 and r9.
+	mov r20 100
+	mov r3 8
+outer:
+	mov r10 0
+	mov r2 1000
+build:
+	alloc r4 r3
+	store32 r10 r4		; Next.
+	mov r5 r4
+	add r5 4
+	store32 r2 r5		; Value.
+	mov r10 r4
+	decjnz r2 build
+
+	mov r1 0
+	mov r2 1000
+walk:
+	mov r5 r10
+	add r5 4
+	load32 r6 r5
+	add r1 r6
+	load32 r7 r10
+	free r10
+	mov r10 r7
+	decjnz r2 walk
+	decjnz r20 outer
+
+	mov r11 0
+	mov r12 0
+	mov r13 100000
+grow:
+	add r12 1
+	mov r14 r12
+	shl r14 2
+	realloc r11 r14
+	mov r15 r11
+	add r15 r14
+	sub r15 4
+	store32 r12 r15
+	decjnz r13 grow
+
+	load32 r8 r11
+	load32 r9 r15
+	free r11
+	exit
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Compares cold-cache load times of a large generated image, stored as is
+# and compressed. Run from the top directory after building rasm and ravm.
+# Before each load the image is dropped from the page cache: all of it
+# when run as root, else just the image's pages through GNU dd. Where
+# neither works the loads are warm and only compare decoding, which the
+# script says.
+
+ASM=/tmp/ravm-load.asm
+
+# Generated code repeats a few patterns with different registers.
+awk 'BEGIN {
+	print "\tmov r2 1"
+	print "top:"
+	for (i = 0; i < 50000; i++) {
+		a = 10 + i % 11; b = 3 + i % 7; c = 21 + i % 10
+		if (i % 3 == 0)
+			printf "\tmov r%d r%d\n\tadd r%d %d\n\txor r%d r%d\n", a, b, a, i % 16, c, a
+		else if (i % 3 == 1)
+			printf "\tload32 r%d r%d\n\tadd r%d r%d\n\tstore32 r%d r%d\n", a, b, a, c, a, b
+		else
+			printf "\tmov r%d %d\n\tand r%d r%d\n\tor r%d r%d\n", a, 1000 * (i % 97), a, c, c, a
+	}
+	print "\tdecjnz r2 top"
+	print "\texit"
+}' > $ASM
+
+./rasm $ASM /tmp/ravm-plain.dat > /dev/null || exit 1
+./rasm --compress $ASM /tmp/ravm-packed.dat > /dev/null || exit 1
+ls -l /tmp/ravm-plain.dat /tmp/ravm-packed.dat
+
+# Drops the cached pages of the file given.
+uncache () {
+	sync
+	if [ "$(id -u)" = 0 ] && echo 3 > /proc/sys/vm/drop_caches 2> /dev/null; then
+		return 0
+	fi
+	dd if="$1" iflag=nocache count=0 status=none 2> /dev/null
+}
+
+if uncache /tmp/ravm-plain.dat; then
+	echo "Cold cache."
+else
+	echo "Could not drop the page cache; these are warm loads, comparing decoding only."
+fi
+
+for f in plain packed; do
+	echo "$f:"
+	for i in 1 2 3 4 5; do
+		uncache /tmp/ravm-$f.dat
+		./ravm --load-time /tmp/ravm-$f.dat | grep Loaded
+	done
+done
+rm -f $ASM /tmp/ravm-plain.dat /tmp/ravm-packed.dat
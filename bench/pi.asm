@@ -0,0 +1,31 @@
+; Numeric benchmark: pi by the midpoint rule on 4/(1+x*x) with 10M
+; steps in double precision. r1 ends up as pi * 1000000.
+	mov r2 10000000
+	cvtsi2d f1 r2		; n
+	mov r3 1
+	cvtsi2d f2 r3		; 1.0
+	fmov f3 f2
+	fdivd f3 f1		; h = 1/n
+	mov r3 4
+	cvtsi2d f4 r3		; 4.0
+	mov r3 2
+	cvtsi2d f5 r3
+	fmov f6 f3
+	fdivd f6 f5		; x = h/2
+	mov r3 0
+	cvtsi2d f7 r3		; sum
+top:
+	fmov f8 f6
+	fmuld f8 f6
+	faddd f8 f2
+	fmov f9 f4
+	fdivd f9 f8
+	faddd f7 f9
+	faddd f6 f3
+	decjnz r2 top
+	fmuld f7 f3
+	mov r3 1000000
+	cvtsi2d f10 r3
+	fmuld f7 f10
+	cvtd2si r1 f7
+	exit
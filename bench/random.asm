@@ -0,0 +1,24 @@
+; Random access benchmark: loads and stores of 20M random words in a
+; 256 MB array. With 4 KB pages nearly every one misses the TLB.
+; Needs --memory 256 or more; bench/tlb.sh compares page sizes.
+	mov r1 12345		; xorshift32 state.
+	mov r2 20000000
+	mov r6 0x0ffffffc	; Word addresses below 256 MB.
+top:
+	mov r3 r1
+	shl r3 13
+	xor r1 r3
+	mov r3 r1
+	shr r3 17
+	xor r1 r3
+	mov r3 r1
+	shl r3 5
+	xor r1 r3
+	mov r3 r1
+	and r3 r6
+	load32 r4 r3
+	add r4 r2
+	store32 r4 r3
+	add r5 r4
+	decjnz r2 top
+	exit
@@ -0,0 +1,13 @@
+#!/bin/sh
+# Compares random access to a large VM memory with 4 KB pages, with
+# transparent huge pages and with reserved huge pages. Reserved ones need
+# /proc/sys/vm/nr_hugepages set, or ravm falls back to asking for
+# transparent ones. Run from the top directory after building rasm and ravm.
+
+./rasm bench/random.asm /tmp/ravm-random.dat > /dev/null || exit 1
+
+for pages in "" --huge-pages --hugetlb; do
+	echo "${pages:-4 KB pages}:"
+	./ravm --memory 256 $pages --perf-counters /tmp/ravm-random.dat | grep "TLB\|MIPS"
+done
+rm -f /tmp/ravm-random.dat
@@ -0,0 +1,387 @@
+/*============================================================================
+  libravm, an embeddable RAVM.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// Call graph profiler. With it on, a VM runs under InterpretCounting,
+// which tells callgraph_call of every call and callgraph_return of every
+// return. They keep a shadow stack of frames, each noting the time and
+// instruction count at entry, and what its callees took.
+//
+// When a frame ends, what it took is charged to its function and to the
+// edge from its caller. Exclusive cost leaves out the callees. Inclusive
+// cost is only charged by the outermost activation, so that recursion is
+// not counted twice.
+//
+// A frame is known by the stack slot holding its return address. A
+// return pops any frames above its own, and a call any whose slot it
+// reuses, so a program that abandons frames does not confuse it.
+//---------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "libravm.h"
+
+#define MAX_FRAMES (STACKSIZE / 4 + 1)	// Every return address, and the top.
+#define TOP 0xffffffff			// The function the program starts in.
+#define NONE 0xfffffffe			// The caller of a function's own totals.
+
+typedef struct {
+	uint32_t function;	// Program offset.
+	char *slot;		// Where its return address is.
+	uint64_t time;		// At entry.
+	uint64_t instructions;
+	uint64_t child_time;
+	uint64_t child_instructions;
+} Frame;
+
+typedef struct {
+	uint32_t caller;	// NONE for a function's own totals.
+	uint32_t callee;
+	bool used;
+	uint32_t active;	// Frames on the shadow stack.
+	uint64_t calls;
+	uint64_t inclusive_time;
+	uint64_t inclusive_instructions;
+	uint64_t exclusive_time;
+	uint64_t exclusive_instructions;
+} Cost;
+
+typedef struct CallGraph {
+	Frame frames [MAX_FRAMES];
+	uint32_t n_frames;
+	Cost *costs;		// Open hash.
+	uint32_t n_costs;
+	uint32_t size;		// A power of 2.
+	bool running;
+} CallGraph;
+
+//----------------------------------------------------------------------------
+// Name:	nanoseconds
+//----------------------------------------------------------------------------
+static uint64_t
+nanoseconds ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//----------------------------------------------------------------------------
+// Name:	find_cost
+// Purpose:	Finds the totals for a function or an edge, making them if
+//		need be.
+// Returns:	NULL if out of memory.
+//----------------------------------------------------------------------------
+static Cost *
+find_cost (CallGraph *graph, uint32_t caller, uint32_t callee)
+{
+	if (2 * (graph->n_costs + 1) > graph->size) {
+		uint32_t size = graph->size ? 2 * graph->size : 256;
+		Cost *costs = calloc (size, sizeof (Cost));
+		if (!costs)
+			return NULL;
+		uint32_t i;
+		for (i = 0; i < graph->size; i++) {
+			Cost *cost = &graph->costs [i];
+			if (!cost->used)
+				continue;
+			uint32_t j = (cost->caller * 31 + cost->callee) & (size - 1);
+			while (costs [j].used)
+				j = (j + 1) & (size - 1);
+			costs [j] = *cost;
+		}
+		free (graph->costs);
+		graph->costs = costs;
+		graph->size = size;
+	}
+
+	uint32_t i = (caller * 31 + callee) & (graph->size - 1);
+	for (;;) {
+		Cost *cost = &graph->costs [i];
+		if (!cost->used) {
+			cost->used = true;
+			cost->caller = caller;
+			cost->callee = callee;
+			graph->n_costs++;
+			return cost;
+		}
+		if (cost->caller == caller && cost->callee == callee)
+			return cost;
+		i = (i + 1) & (graph->size - 1);
+	}
+}
+
+//----------------------------------------------------------------------------
+// Name:	charge
+// Purpose:	Adds what a frame took to a function's or an edge's totals.
+//----------------------------------------------------------------------------
+static void
+charge (Cost *cost, uint64_t time, uint64_t instructions,
+	uint64_t child_time, uint64_t child_instructions)
+{
+	if (!cost)
+		return;
+	if (cost->active)
+		cost->active--;
+	if (!cost->active) {
+		cost->inclusive_time += time;
+		cost->inclusive_instructions += instructions;
+	}
+	cost->exclusive_time += time - child_time;
+	cost->exclusive_instructions += instructions - child_instructions;
+}
+
+//----------------------------------------------------------------------------
+// Name:	pop_frame
+// Purpose:	Ends the innermost frame.
+//----------------------------------------------------------------------------
+static void
+pop_frame (CallGraph *graph, uint64_t now, uint64_t instructions)
+{
+	Frame *frame = &graph->frames [--graph->n_frames];
+	uint64_t time = now - frame->time;
+	uint64_t count = instructions - frame->instructions;
+	uint32_t caller = NONE;
+
+	if (graph->n_frames) {
+		Frame *parent = frame - 1;
+		parent->child_time += time;
+		parent->child_instructions += count;
+		caller = parent->function;
+	}
+	charge (find_cost (graph, NONE, frame->function), time, count,
+		frame->child_time, frame->child_instructions);
+	if (caller != NONE)
+		charge (find_cost (graph, caller, frame->function), time, count,
+			frame->child_time, frame->child_instructions);
+}
+
+//----------------------------------------------------------------------------
+// Name:	push_frame
+//----------------------------------------------------------------------------
+static void
+push_frame (CallGraph *graph, uint32_t function, char *slot,
+	    uint64_t now, uint64_t instructions)
+{
+	if (graph->n_frames == MAX_FRAMES)
+		return;
+
+	Cost *cost = find_cost (graph, NONE, function);
+	if (cost) {
+		cost->calls++;
+		cost->active++;
+	}
+	if (graph->n_frames) {
+		cost = find_cost (graph, graph->frames [graph->n_frames - 1].function, function);
+		if (cost) {
+			cost->calls++;
+			cost->active++;
+		}
+	}
+
+	Frame *frame = &graph->frames [graph->n_frames++];
+	frame->function = function;
+	frame->slot = slot;
+	frame->time = now;
+	frame->instructions = instructions;
+	frame->child_time = 0;
+	frame->child_instructions = 0;
+}
+
+//----------------------------------------------------------------------------
+// Name:	callgraph_call
+// Purpose:	Called by InterpretCounting once a call has pushed its
+//		return address at slot and ip is the callee.
+//----------------------------------------------------------------------------
+void
+callgraph_call (VM *vm, char *ip, char *slot)
+{
+	CallGraph *graph = vm->callgraph;
+	if (!graph || !graph->running)
+		return;
+
+	uint64_t now = nanoseconds ();
+	while (graph->n_frames && graph->frames [graph->n_frames - 1].slot <= slot)
+		pop_frame (graph, now, vm->instructions);
+	push_frame (graph, ip - vm->program_start, slot, now, vm->instructions);
+}
+
+//----------------------------------------------------------------------------
+// Name:	callgraph_return
+// Purpose:	Called by InterpretCounting as a return is about to pop its
+//		return address from slot.
+//----------------------------------------------------------------------------
+void
+callgraph_return (VM *vm, char *ip, char *slot)
+{
+	CallGraph *graph = vm->callgraph;
+	if (!graph || !graph->running)
+		return;
+
+	uint64_t now = nanoseconds ();
+	while (graph->n_frames && graph->frames [graph->n_frames - 1].slot < slot)
+		pop_frame (graph, now, vm->instructions);
+	if (graph->n_frames && graph->frames [graph->n_frames - 1].slot == slot)
+		pop_frame (graph, now, vm->instructions);
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_callgraph_start
+// Purpose:	Starts profiling calls. What runs before the first of them
+//		is charged to the top, which is never returned from.
+//----------------------------------------------------------------------------
+int
+ravm_callgraph_start (VM *vm)
+{
+	if (!vm)
+		return RESULT_INVALID_PARAM;
+	if (!vm->callgraph) {
+		vm->callgraph = calloc (1, sizeof (CallGraph));
+		if (!vm->callgraph)
+			return RESULT_NO_MEMORY;
+	}
+	CallGraph *graph = vm->callgraph;
+	if (graph->running)
+		return RESULT_OK;
+
+	vm->count_instructions = 1;
+	graph->running = true;
+	push_frame (graph, TOP, (char*) UINTPTR_MAX, nanoseconds (), vm->instructions);
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_callgraph_stop
+// Purpose:	Ends every frame still open, so that what they took so far
+//		is charged.
+//----------------------------------------------------------------------------
+void
+ravm_callgraph_stop (VM *vm)
+{
+	if (!vm || !vm->callgraph || !vm->callgraph->running)
+		return;
+	CallGraph *graph = vm->callgraph;
+	uint64_t now = nanoseconds ();
+	while (graph->n_frames)
+		pop_frame (graph, now, vm->instructions);
+	graph->running = false;
+}
+
+//----------------------------------------------------------------------------
+// Name:	compare_costs
+// Purpose:	Functions first, then edges, each by inclusive instructions.
+//----------------------------------------------------------------------------
+static int
+compare_costs (const void *a, const void *b)
+{
+	const Cost *x = *(Cost* const*) a;
+	const Cost *y = *(Cost* const*) b;
+	if ((x->caller == NONE) != (y->caller == NONE))
+		return x->caller == NONE ? -1 : 1;
+	if (x->inclusive_instructions != y->inclusive_instructions)
+		return x->inclusive_instructions > y->inclusive_instructions ? -1 : 1;
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+// Name:	function_name
+//----------------------------------------------------------------------------
+static const char *
+function_name (VM *vm, uint32_t function, char *buffer, size_t size)
+{
+	uint32_t offset = 0;
+	const char *name = function == TOP ? "(top)" : ravm_symbol_at (vm, function, &offset);
+	if (!name)
+		snprintf (buffer, size, "0x%x", function);
+	else if (offset)
+		snprintf (buffer, size, "%s+%u", name, offset);
+	else
+		snprintf (buffer, size, "%s", name);
+	return buffer;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_callgraph_write
+// Purpose:	Writes the inclusive and exclusive cost of each function,
+//		then of each call edge, the most expensive first. Times are
+//		in microseconds.
+//----------------------------------------------------------------------------
+int
+ravm_callgraph_write (VM *vm, FILE *f)
+{
+	if (!vm || !f || !vm->callgraph || vm->callgraph->running)
+		return RESULT_INVALID_PARAM;
+	CallGraph *graph = vm->callgraph;
+
+	Cost **sorted = malloc ((graph->n_costs + 1) * sizeof (Cost*));
+	if (!sorted)
+		return RESULT_NO_MEMORY;
+	uint32_t i, n = 0;
+	for (i = 0; i < graph->size; i++)
+		if (graph->costs [i].calls)
+			sorted [n++] = &graph->costs [i];
+	qsort (sorted, n, sizeof (Cost*), compare_costs);
+
+	bool edges = false;
+	fprintf (f, "%-32s%10s%16s%16s%12s%12s\n", "Function", "Calls",
+		 "Instructions", "Exclusive", "Time", "Exclusive");
+	for (i = 0; i < n; i++) {
+		Cost *cost = sorted [i];
+		char name [256], caller [128], callee [128];
+		if (cost->caller == NONE)
+			function_name (vm, cost->callee, name, sizeof (name));
+		else {
+			if (!edges) {
+				fprintf (f, "\n%-32s%10s%16s%16s%12s%12s\n", "Caller -> callee", "Calls",
+					 "Instructions", "Exclusive", "Time", "Exclusive");
+				edges = true;
+			}
+			snprintf (name, sizeof (name), "%s -> %s",
+				  function_name (vm, cost->caller, caller, sizeof (caller)),
+				  function_name (vm, cost->callee, callee, sizeof (callee)));
+		}
+		fprintf (f, "%-32s%10llu%16llu%16llu%12.0f%12.0f\n", name,
+			 (unsigned long long) cost->calls,
+			 (unsigned long long) cost->inclusive_instructions,
+			 (unsigned long long) cost->exclusive_instructions,
+			 cost->inclusive_time / 1000.0, cost->exclusive_time / 1000.0);
+	}
+
+	free (sorted);
+	return ferror (f) ? RESULT_IO_ERROR : RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	callgraph_free
+//----------------------------------------------------------------------------
+void
+callgraph_free (VM *vm)
+{
+	if (!vm->callgraph)
+		return;
+	free (vm->callgraph->costs);
+	free (vm->callgraph);
+	vm->callgraph = NULL;
+}
@@ -30,13 +30,14 @@
 // 0.7 ZS	RYVM 832.
 // 0.8 ZS	Settled on RYVM 832, renamed RAVM.
 // 0.9 ZS	Added concept of a callout for I/O, also a constants area.
+// 0.10		VM state moved into a context. Fuel metering, yielding.
 //---------------------------------------------------------------------------
 
 #ifndef _DEFS_H
 #define _DEFS_H
 
 #define PROGRAM_NAME "ravm"
-#define RELEASE "0.9"
+#define RELEASE "0.10"
 
 #ifndef bool
 typedef char bool;
@@ -50,18 +51,199 @@ enum { true = 1, false = 0 };
 #define MINIMUM_MEMORY_MB 1
 #define MAXIMUM_MEMORY_MB 3800	/* System-dependent */
 
+#define STACKSIZE 1024
+#define FUEL_SLICE (1 << 24)
+#define FP_REGISTERS 16
+
+// cpu_features bits.
+#define CPU_DETECTED (1 << 31)
+#define CPU_POPCNT 1
+#define CPU_LZCNT 2
+#define CPU_TZCNT 4
+#define CPU_CRC32 8
+
+// huge_pages, for VM memory.
+#define HUGE_PAGES_NONE 0
+#define HUGE_PAGES_ADVISE 1	// Transparent huge pages, where the host has them.
+#define HUGE_PAGES_RESERVE 2	// From the host's pool, else as for ADVISE.
+#define HUGE_PAGE_SIZE (2 << 20)
+
 typedef uint32_t (Callout) (uint32_t, uint32_t, uint32_t);
 
-extern int Interpret (void *program_start, 
-			void *memory_start, 
-			void *stack_start, 
-			void *program_end, 
-			void *memory_end, 
-			void *stack_end,
-			Callout *callout,
-			uint32_t data_start, /* VM pointer */
-			uint32_t data_length
-			);
+struct VM;
+typedef void *(TraceCompiler) (struct VM *, char *);
+typedef int (Native) (struct VM *);
+typedef int (HeapOp) (struct VM *, uint32_t, unsigned, unsigned);
+
+// What heap_op is to do.
+#define HEAP_ALLOC 0
+#define HEAP_FREE 1
+#define HEAP_REALLOC 2
+
+#define HOT_SLOTS 64		// Must be a power of 2.
+#define HOT_THRESHOLD 100
+
+//----------------------------------------------------------------------------
+// The complete state of one VM instance. Interpret keeps nothing of
+// its own between calls, so one thread can take turns running many.
+//
+// NOTE: The layout is mirrored by the VM_* offsets in interpreter-x86.asm.
+// The registers must come first, since the interpreter addresses the
+// other fields relative to them.
+//----------------------------------------------------------------------------
+typedef struct VM {
+	uint32_t registers [256];
+	char *program_start;
+	char *program_end;
+	char *memory_start;
+	char *memory_end;
+	char *stack_start;
+	char *stack_end;
+	Callout *callout;
+	uint32_t constants_start;	/* VM pointer */
+	uint32_t constants_length;
+	uint32_t fuel;		// Taken branches, calls and returns left.
+	char *ip;		// Where to resume. NULL = start from the top.
+	char *sp;
+
+	//------------------------------
+	// Asynchronous callouts: instead of
+	// calling the callout function, the
+	// interpreter returns the request with
+	// RESULT_CALLOUT_PENDING. The host sets
+	// callout_result and calls Interpret
+	// again, which puts it in the register.
+	//
+	uint32_t async_callouts;
+	uint32_t callout_pending;
+	uint32_t callout_which;
+	uint32_t callout_param1;
+	uint32_t callout_param2;
+	uint32_t callout_register;
+	uint32_t callout_result;
+
+	uint32_t memory_size;	// Bytes below the data section.
+
+	//------------------------------
+	// Hot loops. Taken branches count
+	// down per target; at zero the
+	// trace compiler is called. NULL
+	// turns compilation off.
+	//
+	TraceCompiler *trace_compiler;
+	char *trace_exit;	// Where traces go back to. Set by Interpret.
+	char *trace_exit_taken;
+	char *trace_yield;
+	char *trace_fault;
+	char *trace_arena;
+	uint32_t trace_arena_used;
+	char *hot_ip [HOT_SLOTS];
+	void *hot_code [HOT_SLOTS];
+	uint32_t hot_count [HOT_SLOTS];
+
+	// Floating point registers. Single
+	// precision uses the first 4 bytes.
+	double fregs [FP_REGISTERS];
+
+	// Host instructions the bit opcodes
+	// may use. Interpret fills this in
+	// when it is 0; clearing bits but
+	// leaving CPU_DETECTED forces the
+	// fallbacks.
+	uint32_t cpu_features;
+
+	uint32_t entry;		// Where the program starts.
+
+	//------------------------------
+	// Symbols and line numbers from
+	// a version 2 image, for tools.
+	// NULL when it had none.
+	//
+	struct ImageSymbol *symbols;
+	uint32_t n_symbols;
+	struct ImageLine *lines;
+	uint32_t n_lines;
+	char *strings;
+	uint32_t strings_length;
+
+	// Native code from ravm-aot, run
+	// instead of Interpret when set.
+	Native *native;
+	void *native_library;
+
+	//------------------------------
+	// With count_instructions set, ravm_run
+	// uses InterpretCounting, which adds
+	// each VM instruction it runs to
+	// instructions. It runs neither traces
+	// nor native code.
+	//
+	uint32_t count_instructions;
+	uint64_t instructions;
+
+	// Samples from ravm_profile_start.
+	struct Profile *profile;
+
+	// Totals from ravm_metrics_start.
+	struct Metering *metrics;
+
+	// Set by ravm_callgraph_start. The
+	// counting interpreter then reports
+	// calls and returns.
+	struct CallGraph *callgraph;
+
+	//------------------------------
+	// VM memory is mapped when a program
+	// is loaded, and only takes up host
+	// memory as it is touched. Set
+	// huge_pages before loading.
+	//
+	uint32_t huge_pages;
+	uint32_t memory_mapped;	// Bytes at memory_start, or at arena.
+
+	//------------------------------
+	// Stores below writable_start fault.
+	// It is past the rodata of a version 2
+	// image, which is mapped from the file
+	// where it can be, so that every VM
+	// running the image shares one copy.
+	//
+	char *writable_start;
+
+	//------------------------------
+	// The heap for alloc, free and
+	// realloc is the VM memory from
+	// heap_start to heap_end, past what
+	// the image uses. Its bookkeeping is
+	// made on first use, and kept out of
+	// VM memory. heap_op is for native
+	// code to call.
+	//
+	uint32_t heap_start;	/* VM pointer */
+	uint32_t heap_end;
+	struct Heap *heap;
+	HeapOp *heap_op;
+
+	//------------------------------
+	// Between programs the memory stays
+	// mapped, as the arena, for the next
+	// one to reuse. Only what the last
+	// program could reach is cleared, and
+	// only the pages it touched cost
+	// anything to clear.
+	//
+	char *arena;
+	uint32_t arena_dirty;	// Bytes the last program could reach.
+	uint32_t arena_shared;	// Bytes of those that may be mapped from its image.
+	uint32_t arena_huge_pages;	// What it was mapped with.
+} VM;
+
+extern int Interpret (VM *vm);
+extern int InterpretCounting (VM *vm);
+extern int InterpretUnfueled (VM *vm);
+extern int InterpretUntraced (VM *vm);
+extern int InterpretUnfueledUntraced (VM *vm);
+
 enum {
 	RESULT_OK = 0,
 	RESULT_PROGRAM_BOUNDS = 1,	// Instruction pointer went out of bounds.
@@ -72,6 +254,21 @@ enum {
 	RESULT_INVALID_ALLOCA_PARAM = 6,
 	RESULT_DIVIDE_BY_ZERO = 7,
 	RESULT_CALLOUT_IMPOSSIBLE = 8,
+	RESULT_YIELD = 9,		// Out of fuel. Call Interpret again to resume.
+	RESULT_CALLOUT_PENDING = 10,	// Asynchronous callout awaits its result.
+
+	// Loader and library errors.
+	RESULT_NO_MEMORY = 11,
+	RESULT_BAD_MAGIC = 12,
+	RESULT_TRUNCATED = 13,
+	RESULT_BAD_IMAGE = 14,		// Section lengths are zero or excessive.
+	RESULT_IO_ERROR = 15,
+	RESULT_INVALID_PARAM = 16,
+	RESULT_NOT_LOADED = 17,
+	RESULT_BAD_SWITCH = 18,		// A switch table is out of bounds.
+	RESULT_BAD_VERSION = 19,	// Image format is too new.
+	RESULT_BAD_NATIVE = 20,		// Native code is not for this program.
+	RESULT_BAD_FREE = 21,		// Freed or resized what is not a heap block.
 };
 
 #endif
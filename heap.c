@@ -0,0 +1,391 @@
+/*============================================================================
+  libravm, an embeddable RAVM.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// The VM heap, behind the alloc, free and realloc instructions. It hands
+// out VM memory from heap_start to the end, in pages.
+//
+// - A block of up to SMALL_LIMIT bytes comes from a slab: a page cut
+//   into objects of one size class, a multiple of 16 bytes. Each class
+//   keeps a list of its slabs with free objects, so finding one is a
+//   look at the first slab's bitmap.
+// - A bigger block is a run of whole pages, taken first fit from the
+//   free runs, or else from the top. Freed runs are merged with free
+//   neighbours, and given back to the top when they reach it.
+//
+// Nothing is kept in VM memory: every page has a HeapPage on the host,
+// so a program that writes where it should not cannot break the heap,
+// and a bad free or realloc is caught. Each VM has its own heap, and a
+// VM only runs on one thread at a time, so nothing is locked.
+//---------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libravm.h"
+
+#define HEAP_PAGE 4096
+#define QUANTUM 16
+#define SMALL_CLASSES 64
+#define SMALL_LIMIT (QUANTUM * SMALL_CLASSES)
+#define NO_PAGE 0xffffffff
+
+enum {
+	PAGE_FREE,		// In a free run.
+	PAGE_SLAB,
+	PAGE_RUN,		// The first page of a run.
+	PAGE_INSIDE,		// The rest of one.
+};
+
+typedef struct {
+	uint8_t kind;
+	uint8_t size_class;	// Of a slab.
+	uint16_t used;		// Objects in use in a slab.
+	uint32_t pages;		// Length of a run, or at both ends of a free run.
+	uint32_t next;		// Slabs of a class with free objects,
+	uint32_t prev;		// or free runs.
+	uint32_t free [HEAP_PAGE / QUANTUM / 32];	// Of a slab, a bit per object.
+} HeapPage;
+
+typedef struct Heap {
+	uint32_t base;		// VM address of the first page.
+	uint32_t n_pages;
+	uint32_t top;		// Pages from here up have not been used.
+	uint32_t free_runs;
+	uint32_t partial [SMALL_CLASSES];
+	HeapPage *pages;
+} Heap;
+
+//----------------------------------------------------------------------------
+// Name:	heap_create
+// Returns:	NULL if out of memory.
+//----------------------------------------------------------------------------
+static Heap *
+heap_create (VM *vm)
+{
+	Heap *heap = calloc (1, sizeof (Heap));
+	if (!heap)
+		return NULL;
+	heap->base = vm->heap_start;
+	heap->n_pages = (vm->heap_end - vm->heap_start) / HEAP_PAGE;
+	heap->pages = calloc (heap->n_pages + 1, sizeof (HeapPage));
+	if (!heap->pages) {
+		free (heap);
+		return NULL;
+	}
+	heap->free_runs = NO_PAGE;
+	memset (heap->partial, 0xff, sizeof (heap->partial));
+	return heap;
+}
+
+//----------------------------------------------------------------------------
+// Name:	list_insert / list_remove
+// Purpose:	Put a page on and take it off a list through next and prev.
+//----------------------------------------------------------------------------
+static void
+list_insert (Heap *heap, uint32_t *list, uint32_t p)
+{
+	heap->pages [p].prev = NO_PAGE;
+	heap->pages [p].next = *list;
+	if (*list != NO_PAGE)
+		heap->pages [*list].prev = p;
+	*list = p;
+}
+
+static void
+list_remove (Heap *heap, uint32_t *list, uint32_t p)
+{
+	HeapPage *page = &heap->pages [p];
+	if (page->prev != NO_PAGE)
+		heap->pages [page->prev].next = page->next;
+	else
+		*list = page->next;
+	if (page->next != NO_PAGE)
+		heap->pages [page->next].prev = page->prev;
+}
+
+//----------------------------------------------------------------------------
+// Name:	mark
+// Purpose:	Sets the kind of pages p up to p + n.
+//----------------------------------------------------------------------------
+static void
+mark (Heap *heap, uint32_t p, uint32_t n, uint8_t kind)
+{
+	while (n--)
+		heap->pages [p++].kind = kind;
+}
+
+//----------------------------------------------------------------------------
+// Name:	add_free_run
+// Purpose:	Records that pages p up to p + n are free.
+//----------------------------------------------------------------------------
+static void
+add_free_run (Heap *heap, uint32_t p, uint32_t n)
+{
+	heap->pages [p].pages = n;
+	heap->pages [p + n - 1].pages = n;
+	list_insert (heap, &heap->free_runs, p);
+}
+
+//----------------------------------------------------------------------------
+// Name:	take_pages
+// Purpose:	Finds n free pages in a row, and marks the first kind.
+// Returns:	The first, or NO_PAGE if there is no room.
+//----------------------------------------------------------------------------
+static uint32_t
+take_pages (Heap *heap, uint32_t n, uint8_t kind)
+{
+	uint32_t p;
+	for (p = heap->free_runs; p != NO_PAGE; p = heap->pages [p].next)
+		if (heap->pages [p].pages >= n)
+			break;
+
+	if (p != NO_PAGE) {
+		uint32_t length = heap->pages [p].pages;
+		list_remove (heap, &heap->free_runs, p);
+		if (length > n)
+			add_free_run (heap, p + n, length - n);
+	} else {
+		if (n > heap->n_pages - heap->top)
+			return NO_PAGE;
+		p = heap->top;
+		heap->top += n;
+	}
+
+	heap->pages [p].kind = kind;
+	heap->pages [p].pages = n;
+	mark (heap, p + 1, n - 1, PAGE_INSIDE);
+	return p;
+}
+
+//----------------------------------------------------------------------------
+// Name:	release_pages
+// Purpose:	Frees pages p up to p + n, merging them with free runs on
+//		either side.
+//----------------------------------------------------------------------------
+static void
+release_pages (Heap *heap, uint32_t p, uint32_t n)
+{
+	mark (heap, p, n, PAGE_FREE);
+
+	uint32_t after = p + n;
+	if (after < heap->top && heap->pages [after].kind == PAGE_FREE) {
+		n += heap->pages [after].pages;
+		list_remove (heap, &heap->free_runs, after);
+	}
+	if (p && heap->pages [p - 1].kind == PAGE_FREE) {
+		uint32_t before = p - heap->pages [p - 1].pages;
+		n += heap->pages [before].pages;
+		list_remove (heap, &heap->free_runs, before);
+		p = before;
+	}
+
+	if (p + n == heap->top)
+		heap->top = p;
+	else
+		add_free_run (heap, p, n);
+}
+
+//----------------------------------------------------------------------------
+// Name:	objects_per_slab
+//----------------------------------------------------------------------------
+static inline uint32_t
+objects_per_slab (uint32_t size_class)
+{
+	return HEAP_PAGE / (QUANTUM * (size_class + 1));
+}
+
+//----------------------------------------------------------------------------
+// Name:	usable_size
+// Purpose:	Gives the size of the block heap_alloc would hand out.
+//----------------------------------------------------------------------------
+static inline uint32_t
+usable_size (uint32_t size)
+{
+	if (size > SMALL_LIMIT)
+		return (size + HEAP_PAGE - 1) & ~(HEAP_PAGE - 1);
+	return size ? (size + QUANTUM - 1) & ~(QUANTUM - 1) : QUANTUM;
+}
+
+//----------------------------------------------------------------------------
+// Name:	heap_alloc
+// Returns:	The VM address of a block of size bytes, or 0 if there is
+//		no room.
+//----------------------------------------------------------------------------
+static uint32_t
+heap_alloc (Heap *heap, uint32_t size)
+{
+	if (size > SMALL_LIMIT) {
+		if (size > heap->n_pages * HEAP_PAGE)
+			return 0;
+		uint32_t p = take_pages (heap, (size + HEAP_PAGE - 1) / HEAP_PAGE, PAGE_RUN);
+		return p == NO_PAGE ? 0 : heap->base + p * HEAP_PAGE;
+	}
+
+	uint32_t size_class = size ? (size - 1) / QUANTUM : 0;
+	uint32_t n = objects_per_slab (size_class);
+	uint32_t p = heap->partial [size_class];
+	if (p == NO_PAGE) {
+		if ((p = take_pages (heap, 1, PAGE_SLAB)) == NO_PAGE)
+			return 0;
+		HeapPage *slab = &heap->pages [p];
+		slab->size_class = size_class;
+		slab->used = 0;
+		memset (slab->free, 0, sizeof (slab->free));
+		uint32_t i;
+		for (i = 0; i < n; i++)
+			slab->free [i / 32] |= 1u << (i % 32);
+		list_insert (heap, &heap->partial [size_class], p);
+	}
+
+	HeapPage *slab = &heap->pages [p];
+	uint32_t w = 0;
+	while (!slab->free [w])
+		w++;
+	uint32_t i = 32 * w + __builtin_ctz (slab->free [w]);
+	slab->free [w] &= slab->free [w] - 1;
+	if (++slab->used == n)
+		list_remove (heap, &heap->partial [size_class], p);
+	return heap->base + p * HEAP_PAGE + i * QUANTUM * (size_class + 1);
+}
+
+//----------------------------------------------------------------------------
+// Name:	block_size
+// Purpose:	Checks that address is a block in use.
+// Returns:	Its usable size, or 0 if it is not one.
+//----------------------------------------------------------------------------
+static uint32_t
+block_size (Heap *heap, uint32_t address)
+{
+	uint32_t offset = address - heap->base;
+	uint32_t p = offset / HEAP_PAGE;
+	if (address < heap->base || p >= heap->top)
+		return 0;
+
+	HeapPage *page = &heap->pages [p];
+	offset %= HEAP_PAGE;
+	if (page->kind == PAGE_RUN)
+		return offset ? 0 : page->pages * HEAP_PAGE;
+	if (page->kind != PAGE_SLAB)
+		return 0;
+
+	uint32_t size = QUANTUM * (page->size_class + 1);
+	uint32_t i = offset / size;
+	if (offset % size || i >= objects_per_slab (page->size_class)
+	    || page->free [i / 32] & (1u << (i % 32)))
+		return 0;
+	return size;
+}
+
+//----------------------------------------------------------------------------
+// Name:	heap_release
+// Purpose:	Frees a block that block_size has checked.
+//----------------------------------------------------------------------------
+static void
+heap_release (Heap *heap, uint32_t address)
+{
+	uint32_t offset = address - heap->base;
+	uint32_t p = offset / HEAP_PAGE;
+	HeapPage *page = &heap->pages [p];
+
+	if (page->kind == PAGE_RUN) {
+		release_pages (heap, p, page->pages);
+		return;
+	}
+
+	uint32_t size_class = page->size_class;
+	uint32_t i = offset % HEAP_PAGE / (QUANTUM * (size_class + 1));
+	page->free [i / 32] |= 1u << (i % 32);
+	if (page->used-- == objects_per_slab (size_class))
+		list_insert (heap, &heap->partial [size_class], p);
+
+	// An empty slab goes back to the
+	// pages, unless it is the only one
+	// its class has room in.
+	else if (!page->used && (page->next != NO_PAGE || page->prev != NO_PAGE)) {
+		list_remove (heap, &heap->partial [size_class], p);
+		release_pages (heap, p, 1);
+	}
+}
+
+//----------------------------------------------------------------------------
+// Name:	heap_op
+// Purpose:	Runs alloc, free or realloc for the interpreter or native
+//		code, on registers d and s:
+//		  alloc rD rS	rD = a block of rS bytes, or 0
+//		  free rD	frees the block at rD, if it is not 0
+//		  realloc rD rS	rD = the block at rD resized to rS bytes,
+//				or 0 leaving it as it was
+// Returns:	RESULT_BAD_FREE if rD is not 0 or a block in use.
+//----------------------------------------------------------------------------
+int
+heap_op (VM *vm, uint32_t op, unsigned d, unsigned s)
+{
+	Heap *heap = vm->heap;
+	if (!heap && !(heap = vm->heap = heap_create (vm)))
+		return RESULT_NO_MEMORY;
+
+	uint32_t *r = vm->registers;
+	uint32_t address = r [d];
+	uint32_t size;
+
+	if (op == HEAP_ALLOC || (op == HEAP_REALLOC && !address)) {
+		r [d] = heap_alloc (heap, r [s]);
+		return RESULT_OK;
+	}
+	if (op == HEAP_FREE && !address)
+		return RESULT_OK;
+	if (!(size = block_size (heap, address)))
+		return RESULT_BAD_FREE;
+	if (op == HEAP_FREE) {
+		heap_release (heap, address);
+		return RESULT_OK;
+	}
+
+	// The block does if the new size
+	// would get one the same size.
+	uint32_t wanted = r [s];
+	if (usable_size (wanted) == size)
+		return RESULT_OK;
+
+	uint32_t moved = heap_alloc (heap, wanted);
+	if (moved) {
+		memcpy (vm->memory_start + moved, vm->memory_start + address,
+			wanted < size ? wanted : size);
+		heap_release (heap, address);
+	}
+	r [d] = moved;
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	heap_free
+// Purpose:	Drops the heap, with the memory it was in.
+//----------------------------------------------------------------------------
+void
+heap_free (VM *vm)
+{
+	if (vm->heap)
+		free (vm->heap->pages);
+	free (vm->heap);
+	vm->heap = NULL;
+}
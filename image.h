@@ -0,0 +1,132 @@
+/*============================================================================
+  RAVM, a RISC-approximating virtual machine that fits in the L1 cache.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+
+//---------------------------------------------------------------------------
+// Version 2 images. Version 1 is MAGIC followed by the program and data
+// lengths, two unused words, then the program and the data.
+//
+// Version 2 starts with an ImageHeader and a table of ImageSections.
+// Text, rodata and data start on IMAGE_PAGE boundaries in the file, and
+// rodata and data on the same boundaries in VM memory, so that they can
+// be mapped straight in. The other sections are 4-byte aligned.
+//
+// Text addresses are offsets into the program; rodata and data addresses
+// are VM pointers.
+//
+// A section may be compressed, in which case it is stored as a series of
+// ImageChunks, each followed by its bytes, and cannot be mapped. Chunks
+// are compressed independently so that they can be expanded while the
+// rest is still being read. A compressed line table is delta coded
+// first: each ImageLine is stored less the one before it.
+//
+// An object, made by rasm -c, has the same layout with MAGIC_OBJECT.
+// Every section starts at address 0, the address of rodata and data
+// being the alignment they need instead, and entry is NO_ENTRY unless
+// the module has one. Its symbols include the labels it uses but does
+// not define, and a table of ImageRelocations says where those are
+// used. The linker puts objects together into an image; line numbers
+// in a linked image are within the module each address came from.
+//---------------------------------------------------------------------------
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include <stdint.h>
+
+#include "defs.h"
+
+#define MAGIC_V2 (0xf17472fe)
+#define MAGIC_OBJECT (0xf1747ffe)
+#define IMAGE_VERSION 2
+#define IMAGE_PAGE 4096
+#define IMAGE_DATA_BASE 0x1000		// VM address of the first of rodata, data.
+#define MAX_IMAGE_SECTIONS 16
+#define NO_ENTRY 0xffffffff
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_sections;
+	uint32_t entry;			// Text address to start at.
+} ImageHeader;
+
+enum {
+	SECTION_TEXT = 1,
+	SECTION_RODATA = 2,
+	SECTION_DATA = 3,
+	SECTION_SYMBOLS = 4,		// ImageSymbols.
+	SECTION_LINES = 5,		// ImageLines, by increasing address.
+	SECTION_STRINGS = 6,		// NUL-terminated; the source file name first.
+	SECTION_RELOCATIONS = 7,	// ImageRelocations, objects only.
+};
+
+typedef struct {
+	uint32_t type;
+	uint32_t offset;		// In the file.
+	uint32_t length;
+	uint32_t address;		// Where it goes; 0 for tables.
+	uint32_t packed;		// Bytes stored if compressed, else 0.
+} ImageSection;
+
+#define LZ_CHUNK 65536
+
+typedef struct {
+	uint32_t length;		// At most LZ_CHUNK.
+	uint32_t packed;		// Equal to length if stored as is.
+} ImageChunk;
+
+typedef struct ImageSymbol {
+	uint32_t name;			// Offset into the strings.
+	uint32_t section;		// SECTION_TEXT, _RODATA or _DATA.
+	uint32_t address;
+} ImageSymbol;
+
+// In objects only.
+#define SYMBOL_UNDEFINED 0		// The section of a label used but not defined.
+#define SYMBOL_GLOBAL 0x100		// Or'd into the section of one that is exported.
+
+enum {
+	// The word holds an addend; the linker adds the
+	// address of the symbol less that of the word.
+	RELOCATION_RELATIVE = 1,
+	// The linker adds the address of the symbol,
+	// which must be in rodata or data.
+	RELOCATION_ABSOLUTE = 2,
+};
+
+typedef struct ImageRelocation {
+	uint32_t section;		// Where the word is.
+	uint32_t address;
+	uint32_t symbol;		// Index into the symbols.
+	uint32_t type;
+} ImageRelocation;
+
+typedef struct ImageLine {
+	uint32_t address;		// Text address of the first instruction
+	uint32_t line;			// assembled from this source line.
+} ImageLine;
+
+// lz.c
+extern uint32_t lz_compress (const void *source, uint32_t length, void *dest);
+extern bool lz_decompress (const void *source, uint32_t packed, void *dest, uint32_t length);
+
+#endif
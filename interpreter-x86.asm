@@ -22,7 +22,59 @@
 bits	32
 cpu	ia64
 
+;-----------------------------------------------------------------------------
+; Assembled with -DCOUNTING this becomes InterpretCounting, which adds every
+; VM instruction it runs to VM_INSTRUCTIONS. It keeps the count in xmm7, with
+; 1 in each half of xmm6, and runs no traces since they would not be counted.
+; Synchronous callouts go through metered_callout, which times them, and
+; calls and returns are reported to the call graph profiler.
+;-----------------------------------------------------------------------------
+%ifdef COUNTING
+%define _Interpret _InterpretCounting
+%define _InterpretCode _InterpretCountingCode
+%define _InterpretCodeEnd _InterpretCountingCodeEnd
+%endif
+
+;-----------------------------------------------------------------------------
+; Assembled with -DUNFUELED this becomes InterpretUnfueled, which uses no fuel
+; on taken branches, calls and returns. ravm_run uses it to run a program
+; until it is done. Compiled traces still use fuel, so it can return
+; RESULT_YIELD all the same.
+;
+; Assembled with -DNOTRACE this becomes InterpretUntraced, which keeps no
+; hot counts and runs no traces, for a VM without a trace compiler. With
+; -DUNFUELED as well it is InterpretUnfueledUntraced. ravm_run picks
+; whichever fits each run.
+;
+; There is no build without memory bounds checks. VM memory has no guard
+; region to catch a stray access in its place, so it would not be safe for
+; any program. Nor is there one without profiling, which takes samples
+; from a signal handler and costs the loop nothing.
+;-----------------------------------------------------------------------------
+%ifdef UNFUELED
+%define _Interpret _InterpretUnfueled
+%define _InterpretCode _InterpretUnfueledCode
+%define _InterpretCodeEnd _InterpretUnfueledCodeEnd
+%endif
+
+%ifdef NOTRACE
+%define _Interpret _InterpretUntraced
+%define _InterpretCode _InterpretUntracedCode
+%define _InterpretCodeEnd _InterpretUntracedCodeEnd
+%ifdef UNFUELED
+%define _Interpret _InterpretUnfueledUntraced
+%define _InterpretCode _InterpretUnfueledUntracedCode
+%define _InterpretCodeEnd _InterpretUnfueledUntracedCodeEnd
+%endif
+%endif
+
+%ifdef COUNTING
+%define NOTRACE
+%endif
+
 global	_Interpret
+global	_InterpretCode		; Where the code lies, for the profiler.
+global	_InterpretCodeEnd
 
 extern	_putchar
 extern	_printf
@@ -30,6 +82,12 @@ extern	_puts
 extern	_fflush
 extern	_malloc
 extern	_free
+extern	_heap_op
+%ifdef COUNTING
+extern	_metered_callout
+extern	_callgraph_call
+extern	_callgraph_return
+%endif
 
 %define RESULT_OK 0
 %define RESULT_PROGRAM_BOUNDS 1 ; Instruction pointer went out of bounds.
@@ -40,11 +98,63 @@ extern	_free
 %define RESULT_INVALID_ALLOCA_PARAM 6 
 %define RESULT_DIVIDE_BY_ZERO 7
 %define RESULT_CALLOUT_IMPOSSIBLE 8
+%define RESULT_YIELD 9
+%define RESULT_CALLOUT_PENDING 10
+
+; Offsets into the VM context, see defs.h.
+%define VM_PROGRAM_START (256*4)
+%define VM_PROGRAM_END (VM_PROGRAM_START+4)
+%define VM_MEMORY_START (VM_PROGRAM_START+8)
+%define VM_MEMORY_END (VM_PROGRAM_START+12)
+%define VM_STACK_START (VM_PROGRAM_START+16)
+%define VM_STACK_END (VM_PROGRAM_START+20)
+%define VM_CALLOUT (VM_PROGRAM_START+24)
+%define VM_CONSTANTS_START (VM_PROGRAM_START+28)
+%define VM_CONSTANTS_LENGTH (VM_PROGRAM_START+32)
+%define VM_FUEL (VM_PROGRAM_START+36)
+%define VM_IP (VM_PROGRAM_START+40)
+%define VM_SP (VM_PROGRAM_START+44)
+%define VM_ASYNC_CALLOUTS (VM_PROGRAM_START+48)
+%define VM_CALLOUT_PENDING (VM_PROGRAM_START+52)
+%define VM_CALLOUT_WHICH (VM_PROGRAM_START+56)
+%define VM_CALLOUT_PARAM1 (VM_PROGRAM_START+60)
+%define VM_CALLOUT_PARAM2 (VM_PROGRAM_START+64)
+%define VM_CALLOUT_REGISTER (VM_PROGRAM_START+68)
+%define VM_CALLOUT_RESULT (VM_PROGRAM_START+72)
+%define VM_TRACE_COMPILER (VM_PROGRAM_START+80)
+%define VM_TRACE_EXIT (VM_PROGRAM_START+84)
+%define VM_TRACE_EXIT_TAKEN (VM_PROGRAM_START+88)
+%define VM_TRACE_YIELD (VM_PROGRAM_START+92)
+%define VM_TRACE_FAULT (VM_PROGRAM_START+96)
+%define VM_HOT_IP (VM_PROGRAM_START+108)
+%define VM_HOT_CODE (VM_HOT_IP+4*HOT_SLOTS)
+%define VM_HOT_COUNT (VM_HOT_CODE+4*HOT_SLOTS)
+%define VM_FREGS (VM_HOT_COUNT+4*HOT_SLOTS)
+%define VM_CPU_FEATURES (VM_FREGS+8*16)
+%define VM_ENTRY (VM_CPU_FEATURES+4)
+%define VM_INSTRUCTIONS (VM_ENTRY+40)	; Past the symbols and native code.
+%define VM_CALLGRAPH (VM_INSTRUCTIONS+16)
+%define VM_WRITABLE_START (VM_CALLGRAPH+12)
+
+; What heap_op is to do.
+%define HEAP_ALLOC 0
+%define HEAP_FREE 1
+%define HEAP_REALLOC 2
+
+%define CPU_DETECTED 0x80000000
+%define CPU_POPCNT 1
+%define CPU_LZCNT 2
+%define CPU_TZCNT 4
+%define CPU_CRC32 8
+
+%define HOT_SLOTS 64
+%define HOT_THRESHOLD 100
 
 %define DEST eax
 %define DESTWORD ax
 %define DESTBYTE al
 %define DESTREG ebx
+%define DESTREGBYTE bl
 %define SRCREG ecx	; Must keep as ECX for shift instructions!
 %define SRCREGBYTE cl 	; Must keep as ECX for shift instructions!
 %define REGS ebp
@@ -59,29 +169,152 @@ extern	_free
 ;-----------------------------------------------------------------------------
 
 %macro MEMORY_BOUNDS_CHECK 1
-	cmp %1, [memory_start]  
+	cmp %1, [REGS + VM_MEMORY_START]  
 	jb error_memory_bounds 
-	cmp %1, [memory_end] 
+	cmp %1, [REGS + VM_MEMORY_END] 
 	jae error_memory_bounds
 %endmacro
 
+; Stores check against writable_start instead, below which memory is
+; read-only. It is never below memory_start.
+%macro WRITE_BOUNDS_CHECK 1
+	cmp %1, [REGS + VM_WRITABLE_START]
+	jb error_memory_bounds
+	cmp %1, [REGS + VM_MEMORY_END]
+	jae error_memory_bounds
+%endmacro
+
+; Leaves in TEMP the host address of SRC + the disp32 that follows
+; the instruction, checked by %1.
+%macro DISP_ADDRESS 1
+	mov TEMP, [REGS + 4*SRCREG]
+	add TEMP, [REGIP]
+	add REGIP, 4
+	add TEMP, [REGS + VM_MEMORY_START]
+	%1 TEMP
+%endmacro
+
+; Leaves in TEMP the host address of SRC + the register in byte 2
+; times %1, the access size, checked by %2.
+%macro INDEXED_ADDRESS 2
+	movzx TEMP, byte [REGIP - 2]
+	mov TEMP, [REGS + 4*TEMP]
+	lea TEMP, [%1*TEMP]
+	add TEMP, [REGS + 4*SRCREG]
+	add TEMP, [REGS + VM_MEMORY_START]
+	%2 TEMP
+%endmacro
+
 %macro PROGRAM_BOUNDS_CHECK 0
-	cmp REGIP, dword [program_start]
+	cmp REGIP, dword [REGS + VM_PROGRAM_START]
 	jb error_program_bounds
-	cmp REGIP, dword [program_end]
+	cmp REGIP, dword [REGS + VM_PROGRAM_END]
 	jae error_program_bounds
 %endmacro
 
+; Moves a register index to the high half of its pair, without touching
+; the flags. r255 pairs with r0.
+%macro PAIR_HIGH 2
+	lea %1, [%1 + 1]
+	movzx %1, %2
+%endmacro
+
+; Floating point register operands are byte 0 and byte 1, modulo 16.
+%macro FP_OP 2		; SSE instruction, movss or movsd
+	and DESTREG, 15
+	and SRCREG, 15
+	%2 xmm0, [REGS + VM_FREGS + 8*DESTREG]
+	%1 xmm0, [REGS + VM_FREGS + 8*SRCREG]
+	%2 [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+%endmacro
+
+%macro FP_CMP 2		; ucomiss or ucomisd, movss or movsd
+	movzx TEMP, byte [REGIP - 2]
+	and TEMP, 15
+	and SRCREG, 15
+	%2 xmm0, [REGS + VM_FREGS + 8*SRCREG]
+	%1 xmm0, [REGS + VM_FREGS + 8*TEMP]
+	mov DEST, 0
+	jp %%unordered
+	seta DESTBYTE
+	jae %%done
+	mov DEST, -1
+	jmp %%done
+%%unordered:
+	mov DEST, 2
+%%done:
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+%endmacro
+
+%macro FUEL_CHECK 0
+%ifndef UNFUELED
+	sub dword [REGS + VM_FUEL], 1
+	jb out_of_fuel
+%endif
+%endmacro
+
+%macro COUNT 0
+%ifdef COUNTING
+	paddq xmm7, xmm6
+%endif
+%endmacro
+
+; Leaves flags and all but xmm6 and xmm7 alone.
+%macro LOAD_COUNT 0
+%ifdef COUNTING
+	movq xmm7, [REGS + VM_INSTRUCTIONS]
+	pcmpeqd xmm6, xmm6
+	psrlq xmm6, 63
+%endif
+%endmacro
+
+%macro SAVE_COUNT 0
+%ifdef COUNTING
+	movq [REGS + VM_INSTRUCTIONS], xmm7
+%endif
+%endmacro
+
+; InterpretCounting tells the call graph profiler, if there is one, of
+; each call and return. %1 is callgraph_call or callgraph_return.
+%macro CALL_GRAPH 1
+%ifdef COUNTING
+	test dword [REGS + VM_CALLGRAPH], 0xffffffff
+	jz %%done
+	push dword 0
+	push dword 0		; Five words keep the stack 16-byte aligned.
+	push REGSP
+	push REGIP
+	push REGS
+	CALL_HOST _%1
+	add esp, 5*4
+%%done:
+%endif
+%endmacro
+
+; C may use the count's registers. While it runs, the profiler finds
+; where the VM is in the context.
+%macro CALL_HOST 1
+	mov [REGS + VM_IP], REGIP
+	mov [REGS + VM_SP], REGSP
+	SAVE_COUNT
+	call %1
+	LOAD_COUNT
+%endmacro
+
 %macro STACK_BOUNDS_CHECK 0
-	cmp REGIP, dword [stack_start]	
+	cmp REGIP, dword [REGS + VM_STACK_START]	
 	jl error_stack_bounds
-	cmp REGIP, dword [stack_end]
+	cmp REGIP, dword [REGS + VM_STACK_END]
 	jge error_stack_bounds
 %endmacro
 
 ;-----------------------------------------------------------------------------
 	section .text
 
+_InterpretCode:
+
 ;-----------------------------------------------------------------------------
 
 error_callout_impossible:
@@ -120,13 +353,10 @@ error_stack_overflow:
 op_exit:
 	xor eax, eax
 done:
-	mov [save_eax], eax
-
-%if 0
-	push dword [registers]
-	call _free
-	add esp, 4
-%endif
+	; Keep where we stopped, so that a yield can be resumed.
+	mov [REGS + VM_IP], REGIP
+	mov [REGS + VM_SP], REGSP
+	SAVE_COUNT
 
 	pop ebp
 	pop edi
@@ -134,70 +364,25 @@ done:
 	pop edx
 	pop ecx
 	pop ebx
-
-	push ebx
-	push ecx
-	push edx
-	push esi
-	push edi
-	push ebp
-	push string
-	call _puts
-	add esp, 4
-	pop ebp
-	pop edi
-	pop esi
-	pop edx
-	pop ecx
-	pop ebx
-
-	mov eax, [save_eax]
 	ret
 
+out_of_fuel:
+	mov dword [REGS + VM_FUEL], 0
+	mov eax, RESULT_YIELD
+	jmp done
+
 ;------------------------------------------------------------------------------
 ; Name:         Interpret
 ; Purpose:      Run some RISC bytecode.
 ; Params:       
-;               [esp+4] = ptr to start of program bytes
-;               [esp+8] = ptr to start of memory bytes
-;               [esp+12] = ptr to start of stack bytes
-;               [esp+16] = ptr to end of program bytes
-;               [esp+20] = ptr to end of memory bytes
-;               [esp+24] = ptr to end of stack bytes
-;               [esp+28] = ptr to callout function
-;               [esp+32] = ptr to constants area
-;               [esp+36] = ptr to end of constants area
+;               [esp+4] = ptr to the VM context
+; Returns:	RESULT_YIELD when the fuel ran out, or RESULT_CALLOUT_PENDING
+;		when an asynchronous callout was made. Calling Interpret
+;		again with the same context then carries on from there.
 ;------------------------------------------------------------------------------
 
         align 32
 _Interpret:
-        ;----------------------------------------
-        ; Save memory regions to more convenient
-        ; locations than on the stack.
-        ;
-        mov eax, [esp+4]
-        mov [program_start], eax
-        mov eax, [esp+16]
-        mov [program_end], eax
-
-        mov eax, [esp+8]
-        mov [memory_start], eax
-        mov eax, [esp+20]
-        mov [memory_end], eax
-
-        mov eax, [esp+12]
-        mov [stack_start], eax
-        mov eax, [esp+24]
-        mov [stack_end], eax
-
-        mov eax, [esp+28]
-        mov [callout_function], eax
-
-        mov eax, [esp+32]
-        mov [constants_start], eax
-        mov eax, [esp+36]
-        mov [constants_end], eax
-
 	push ebx
 	push ecx
 	push edx
@@ -205,15 +390,39 @@ _Interpret:
 	push edi
 	push ebp
 
-%if 0
-	push dword 256*4
-	call _malloc
-	add esp, 4
-	mov REGS, eax
-	mov dword [registers], eax
-%endif
-	mov REGS, registers
+	;----------------------------------------
+	; The context begins with the registers,
+	; the rest of it is reached from REGS.
+	;
+	mov REGS, [esp+28]
+	LOAD_COUNT
+
+	; Where compiled traces come back to.
+	mov dword [REGS + VM_TRACE_EXIT], mainloop
+	mov dword [REGS + VM_TRACE_EXIT_TAKEN], mainloop_full_check
+	mov dword [REGS + VM_TRACE_YIELD], out_of_fuel
+	mov dword [REGS + VM_TRACE_FAULT], error_memory_bounds
+
+	test dword [REGS + VM_CPU_FEATURES], 0xffffffff
+	jnz .L2
+	call detect_cpu
+.L2:
+
+	mov REGIP, [REGS + VM_IP]
+	test REGIP, REGIP
+	jz .L0
+	mov REGSP, [REGS + VM_SP]
+
+	; Deliver the result of a suspended callout.
+	test dword [REGS + VM_CALLOUT_PENDING], 0xffffffff
+	jz mainloop_bounds_check
+	mov dword [REGS + VM_CALLOUT_PENDING], 0
+	mov eax, [REGS + VM_CALLOUT_REGISTER]
+	mov edx, [REGS + VM_CALLOUT_RESULT]
+	mov [REGS + eax*4], edx
+	jmp mainloop_bounds_check
 
+.L0:
 	; Fill the registers with increasing numbers.
 	xor eax, eax
 .L1
@@ -222,14 +431,85 @@ _Interpret:
 	cmp eax, 256
 	jb .L1
 
-	mov REGSP, [stack_end]
-	mov REGIP, [program_start]
+	mov REGSP, [REGS + VM_STACK_END]
+	mov REGIP, [REGS + VM_PROGRAM_START]
+	add REGIP, [REGS + VM_ENTRY]
 	jmp mainloop_post_check
 
+hot_miss:
+	mov [REGS + VM_HOT_IP + 4*edx], REGIP
+	mov dword [REGS + VM_HOT_CODE + 4*edx], 0
+	mov dword [REGS + VM_HOT_COUNT + 4*edx], HOT_THRESHOLD
+	jmp mainloop_bounds_check
+
+hot_trip:
+	; Only try once.
+	mov dword [REGS + VM_HOT_COUNT + 4*edx], 0xffffffff
+	mov eax, [REGS + VM_TRACE_COMPILER]
+	test eax, eax
+	jz mainloop_bounds_check
+
+	push edx
+	sub esp, 8		; Keeps the stack 16-byte aligned for Mac OS/X.
+	push REGIP
+	push REGS
+	CALL_HOST eax
+	add esp, 16
+	pop edx
+
+	mov [REGS + VM_HOT_CODE + 4*edx], eax
+	test eax, eax
+	jz mainloop_bounds_check
+	jmp eax
+
+;------------------------------------------------------------------------------
+; Name:		detect_cpu
+; Purpose:	Sets VM_CPU_FEATURES for the bit manipulation opcodes.
+;		Trashes eax, ebx, ecx, edx, esi, edi.
+;------------------------------------------------------------------------------
+detect_cpu:
+	mov edi, CPU_DETECTED
+
+	xor eax, eax
+	cpuid
+	mov esi, eax		; Highest basic leaf.
+
+	mov eax, 1
+	cpuid
+	test ecx, 1 << 23
+	jz .L1
+	or edi, CPU_POPCNT
+.L1:
+	test ecx, 1 << 20	; SSE4.2
+	jz .L2
+	or edi, CPU_CRC32
+.L2:
+	cmp esi, 7
+	jb .L3
+	mov eax, 7
+	xor ecx, ecx
+	cpuid
+	test ebx, 1 << 3	; BMI1
+	jz .L3
+	or edi, CPU_TZCNT
+.L3:
+	mov eax, 0x80000000
+	cpuid
+	cmp eax, 0x80000001
+	jb .L4
+	mov eax, 0x80000001
+	cpuid
+	test ecx, 1 << 5	; ABM
+	jz .L4
+	or edi, CPU_LZCNT
+.L4:
+	mov [REGS + VM_CPU_FEATURES], edi
+	ret
+
 do_near_branch:
 	movsx SRCREG, SRCREGBYTE
 	add REGIP, SRCREG
-	jmp mainloop_post_check
+	jmp mainloop_full_check
 
 dont_branch:
 	add REGIP, 4
@@ -238,14 +518,42 @@ dont_branch:
 do_branch:
 	add REGIP, dword [REGIP]
 	
+	;----------------------------------------
+	; Every taken branch, call and return
+	; comes through here, so fuel is only
+	; counted once per basic block.
+	;
 mainloop_full_check:
-        cmp REGIP, dword [program_start]
+	FUEL_CHECK
+
+%ifndef NOTRACE
+	;----------------------------------------
+	; Count down per branch target, and when
+	; one gets hot have it compiled. After
+	; that, run the compiled code instead.
+	;
+	mov edx, REGIP
+	shr edx, 2
+	and edx, HOT_SLOTS-1
+	cmp REGIP, [REGS + VM_HOT_IP + 4*edx]
+	jne hot_miss
+	mov eax, [REGS + VM_HOT_CODE + 4*edx]
+	test eax, eax
+	jz .L0
+	jmp eax
+.L0:
+	sub dword [REGS + VM_HOT_COUNT + 4*edx], 1
+	jz hot_trip
+%endif
+mainloop_bounds_check:
+        cmp REGIP, dword [REGS + VM_PROGRAM_START]
 	jb error_program_bounds
 mainloop:
-        cmp REGIP, dword [program_end]
+        cmp REGIP, dword [REGS + VM_PROGRAM_END]
         jae error_program_bounds
 
 mainloop_post_check:
+	COUNT
 	mov eax, [REGIP]
 	add REGIP, 4
 	mov edx, eax		; now get the opcode
@@ -269,7 +577,7 @@ mainloop_post_check:
 	push edx
 	push REGIP
 	push dword printopcode_string
-	call _printf	; ESP is 16 byte aligned
+	CALL_HOST _printf	; ESP is 16 byte aligned
 	add esp, 12
 
 	pop ebp
@@ -327,7 +635,7 @@ op_decjnz_near:
 	mov dword [4*DESTREG + REGS], DEST
 	jz mainloop
 	sub REGIP, SRCREG
-	jmp mainloop
+	jmp mainloop_full_check
 
 op_decjnz:
 	mov SRCREG, 4
@@ -704,6 +1012,35 @@ op_jump_near:
 	add REGIP, TEMP
         jmp mainloop_full_check
 
+;------------------------------------------------------------------------------
+; switch rI is followed by a count N and N offsets, each relative to the
+; first. An index of N or more falls through past the table. The tables
+; are checked when the program is loaded, but only those that decode from
+; the start, so a jump into the middle of an instruction could still find
+; one that is not. The table and the target are checked again here.
+;------------------------------------------------------------------------------
+op_switch:
+	mov SRCREG, [REGS + VM_PROGRAM_END]
+	sub SRCREG, REGIP
+	jbe error_program_bounds
+	shr SRCREG, 2		; Words left, the count's among them.
+	jz error_program_bounds
+	mov TEMP, [REGIP]
+	add REGIP, 4
+	dec SRCREG
+	cmp TEMP, SRCREG
+	ja error_program_bounds
+	cmp DEST, TEMP
+	jae .L1
+	add REGIP, [REGIP + 4*DEST]
+	test REGIP, 3
+	jnz error_program_bounds
+	PROGRAM_BOUNDS_CHECK
+	jmp mainloop_full_check
+.L1:
+	lea REGIP, [REGIP + 4*TEMP]
+	jmp mainloop
+
 op_jump:
         mov SRCREG, [REGIP]
         add REGIP, SRCREG	; This is the address of the routine being called.
@@ -712,26 +1049,28 @@ op_jump:
 ; XX Need to add call table-indirect instruction.
 op_call_register_indirect:	; (As opposed to memory indirect etc.)
         sub REGSP, 4
-        cmp REGSP, dword [stack_start]
+        cmp REGSP, dword [REGS + VM_STACK_START]
         jb error_stack_overflow
 	mov [REGSP], REGIP
         mov REGIP, DEST	; This is the absolute address of the routine being called.
+	CALL_GRAPH callgraph_call
         jmp mainloop_full_check
 
 op_call:
 op_call_relative:
         sub REGSP, 4
-        cmp REGSP, dword [stack_start]
+        cmp REGSP, dword [REGS + VM_STACK_START]
         jb error_stack_overflow
 	lea DESTREG, [REGIP + 4]
 	mov [REGSP], DESTREG
         add REGIP, [REGIP]  ; This is the address of the routine being called.
+	CALL_GRAPH callgraph_call
         jmp mainloop_full_check
 
 op_jump_relative_near:
 	movsx SRCREG, SRCREGBYTE
         sub REGSP, 4
-        cmp REGSP, dword [stack_start]
+        cmp REGSP, dword [REGS + VM_STACK_START]
         jb error_stack_overflow
         mov [REGSP], REGIP
 	add REGIP, SRCREG
@@ -739,23 +1078,26 @@ op_jump_relative_near:
 
 op_call_relative_near_forward:
         sub REGSP, 4
-        cmp REGSP, dword [stack_start]
+        cmp REGSP, dword [REGS + VM_STACK_START]
         jb error_stack_overflow
         mov [REGSP], REGIP
 	add REGIP, SRCREG
+	CALL_GRAPH callgraph_call
         jmp mainloop_full_check
 
 op_call_relative_near_backward:
         sub REGSP, 4
-        cmp REGSP, dword [stack_start]
+        cmp REGSP, dword [REGS + VM_STACK_START]
         jb error_stack_overflow
         mov [REGSP], REGIP
 	sub REGIP, SRCREG
+	CALL_GRAPH callgraph_call
         jmp mainloop_full_check
 
 op_ret:
-        cmp REGSP, dword [stack_end]
+        cmp REGSP, dword [REGS + VM_STACK_END]
         jae error_stack_underflow
+	CALL_GRAPH callgraph_return
         mov REGIP, [REGSP]
         add REGSP, 4
         jmp mainloop_full_check
@@ -790,7 +1132,7 @@ op_alloca:
 	test ecx, 3
 	jnz error_invalid_alloca_value
 	sub REGSP, ecx
-        cmp REGSP, dword [stack_start]
+        cmp REGSP, dword [REGS + VM_STACK_START]
         jb error_stack_overflow
 	jmp mainloop
 	
@@ -800,28 +1142,472 @@ op_drop:
 	test ecx, 3
 	jnz error_invalid_alloca_value
 	add REGSP, ecx
-        cmp REGSP, dword [stack_end]
+        cmp REGSP, dword [REGS + VM_STACK_END]
         ja error_stack_underflow	; OK to be >= stack_end.
 	jmp mainloop
 
 op_push:
 	sub REGSP, 4
-        cmp REGSP, dword [stack_start]
+        cmp REGSP, dword [REGS + VM_STACK_START]
         jb error_stack_overflow
 	mov [REGSP], eax
 	jmp mainloop
 
 op_pop:
-        cmp REGSP, dword [stack_end]
+        cmp REGSP, dword [REGS + VM_STACK_END]
         jae error_stack_underflow
 	mov eax, dword [REGSP]
 	mov dword [REGS + 4*DESTREG], eax
 	add REGSP, 4
 	jmp mainloop
 
+;------------------------------------------------------------------------------
+; pushm/popm move the registers DESTREG..SRCREG to or from the stack with
+; one bounds check. The layout is the same as pushing them one at a time
+; in increasing order.
+;------------------------------------------------------------------------------
+op_pushm:
+	mov TEMP, SRCREG
+	sub TEMP, DESTREG
+	jb error_stack_overflow
+	lea TEMP, [4*TEMP + 4]		; Bytes to push.
+	sub REGSP, TEMP
+        cmp REGSP, dword [REGS + VM_STACK_START]
+        jb error_stack_overflow
+.L1:
+	mov eax, [REGS + 4*DESTREG]
+	mov [REGSP + TEMP - 4], eax
+	inc DESTREG
+	sub TEMP, 4
+	jnz .L1
+	jmp mainloop
+
+op_popm:
+	mov TEMP, SRCREG
+	sub TEMP, DESTREG
+	jb error_stack_underflow
+	lea TEMP, [4*TEMP + 4]		; Bytes to pop.
+	lea eax, [REGSP + TEMP]
+        cmp eax, dword [REGS + VM_STACK_END]
+        ja error_stack_underflow
+.L1:
+	mov eax, [REGSP]
+	mov [REGS + 4*SRCREG], eax
+	dec SRCREG
+	add REGSP, 4
+	sub TEMP, 4
+	jnz .L1
+	jmp mainloop
+
+;------------------------------------------------------------------------------
+; 64-bit math. A 64-bit value lives in a register pair, low half in rN and
+; high half in rN+1. mulw/imulw widen a 32-bit multiply into the pair.
+;------------------------------------------------------------------------------
+op_add64:
+	mov TEMP, [REGS + 4*SRCREG]
+	PAIR_HIGH SRCREG, SRCREGBYTE
+	mov SRCREG, [REGS + 4*SRCREG]
+	add DEST, TEMP
+	mov [REGS + 4*DESTREG], DEST
+	PAIR_HIGH DESTREG, DESTREGBYTE
+	adc [REGS + 4*DESTREG], SRCREG
+	jmp mainloop
+
+op_sub64:
+	mov TEMP, [REGS + 4*SRCREG]
+	PAIR_HIGH SRCREG, SRCREGBYTE
+	mov SRCREG, [REGS + 4*SRCREG]
+	sub DEST, TEMP
+	mov [REGS + 4*DESTREG], DEST
+	PAIR_HIGH DESTREG, DESTREGBYTE
+	sbb [REGS + 4*DESTREG], SRCREG
+	jmp mainloop
+
+op_mul64:
+	; Low 64 bits of the product:
+	; lo*lo + ((lo*hi + hi*lo) << 32)
+	push DESTREG
+	PAIR_HIGH DESTREG, DESTREGBYTE
+	mov TEMP, [REGS + 4*SRCREG]
+	PAIR_HIGH SRCREG, SRCREGBYTE
+	mov SRCREG, [REGS + 4*SRCREG]
+	imul SRCREG, DEST
+	push SRCREG
+	mov SRCREG, [REGS + 4*DESTREG]
+	imul SRCREG, TEMP
+	add [esp], SRCREG
+	mul TEMP
+	pop SRCREG
+	add TEMP, SRCREG
+	mov [REGS + 4*DESTREG], TEMP
+	pop DESTREG
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_mulw:
+	mul dword [REGS + 4*SRCREG]
+	mov [REGS + 4*DESTREG], DEST
+	PAIR_HIGH DESTREG, DESTREGBYTE
+	mov [REGS + 4*DESTREG], TEMP
+	jmp mainloop
+
+op_imulw:
+	imul dword [REGS + 4*SRCREG]
+	mov [REGS + 4*DESTREG], DEST
+	PAIR_HIGH DESTREG, DESTREGBYTE
+	mov [REGS + 4*DESTREG], TEMP
+	jmp mainloop
+
+	; Shifts take the count from the source
+	; register, or the imm8 forms from byte 1.
+	; Only the low 6 bits of it are used.
+op_shl64:
+	mov SRCREG, [REGS + 4*SRCREG]
+op_shl64_imm8:
+	push DESTREG
+	PAIR_HIGH DESTREG, DESTREGBYTE
+	mov TEMP, [REGS + 4*DESTREG]
+	shld TEMP, DEST, cl
+	shl DEST, cl
+	test cl, 32
+	jz .L1
+	mov TEMP, DEST
+	xor DEST, DEST
+.L1:
+	mov [REGS + 4*DESTREG], TEMP
+	pop DESTREG
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_shr64:
+	mov SRCREG, [REGS + 4*SRCREG]
+op_shr64_imm8:
+	push DESTREG
+	PAIR_HIGH DESTREG, DESTREGBYTE
+	mov TEMP, [REGS + 4*DESTREG]
+	shrd DEST, TEMP, cl
+	shr TEMP, cl
+	test cl, 32
+	jz .L1
+	mov DEST, TEMP
+	xor TEMP, TEMP
+.L1:
+	mov [REGS + 4*DESTREG], TEMP
+	pop DESTREG
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_sar64:
+	mov SRCREG, [REGS + 4*SRCREG]
+op_sar64_imm8:
+	push DESTREG
+	PAIR_HIGH DESTREG, DESTREGBYTE
+	mov TEMP, [REGS + 4*DESTREG]
+	shrd DEST, TEMP, cl
+	sar TEMP, cl
+	test cl, 32
+	jz .L1
+	mov DEST, TEMP
+	sar TEMP, 31
+.L1:
+	mov [REGS + 4*DESTREG], TEMP
+	pop DESTREG
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+	; cmp64 rX rA rB sets rX to -1, 0 or 1
+	; as A is less than, equal to or greater
+	; than B. B is in byte 2.
+op_cmp64:
+	movzx TEMP, byte [REGIP - 2]
+	mov DEST, [REGS + 4*SRCREG]
+	sub DEST, [REGS + 4*TEMP]
+	PAIR_HIGH SRCREG, SRCREGBYTE
+	PAIR_HIGH TEMP, TEMPBYTE
+	mov SRCREG, [REGS + 4*SRCREG]
+	sbb SRCREG, [REGS + 4*TEMP]
+	jl .L1
+	or DEST, SRCREG
+	setnz DESTBYTE
+	movzx DEST, DESTBYTE
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+.L1:
+	mov dword [REGS + 4*DESTREG], -1
+	jmp mainloop
+
+op_cmpu64:
+	movzx TEMP, byte [REGIP - 2]
+	mov DEST, [REGS + 4*SRCREG]
+	sub DEST, [REGS + 4*TEMP]
+	PAIR_HIGH SRCREG, SRCREGBYTE
+	PAIR_HIGH TEMP, TEMPBYTE
+	mov SRCREG, [REGS + 4*SRCREG]
+	sbb SRCREG, [REGS + 4*TEMP]
+	jb .L1
+	or DEST, SRCREG
+	setnz DESTBYTE
+	movzx DEST, DESTBYTE
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+.L1:
+	mov dword [REGS + 4*DESTREG], -1
+	jmp mainloop
+
+;------------------------------------------------------------------------------
+; Floating point, done with SSE2 scalar instructions on the FP registers
+; in the context. Integer operands are ordinary VM registers.
+;------------------------------------------------------------------------------
+op_fadds:
+	FP_OP addss, movss
+
+op_faddd:
+	FP_OP addsd, movsd
+
+op_fsubs:
+	FP_OP subss, movss
+
+op_fsubd:
+	FP_OP subsd, movsd
+
+op_fmuls:
+	FP_OP mulss, movss
+
+op_fmuld:
+	FP_OP mulsd, movsd
+
+op_fdivs:
+	FP_OP divss, movss
+
+op_fdivd:
+	FP_OP divsd, movsd
+
+op_fsqrts:
+	and DESTREG, 15
+	and SRCREG, 15
+	sqrtss xmm0, [REGS + VM_FREGS + 8*SRCREG]
+	movss [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+op_fsqrtd:
+	and DESTREG, 15
+	and SRCREG, 15
+	sqrtsd xmm0, [REGS + VM_FREGS + 8*SRCREG]
+	movsd [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+	; fcmp rX fA fB sets rX to -1, 0 or 1
+	; as A is less than, equal to or greater
+	; than B, or 2 if either is a NaN.
+op_fcmps:
+	FP_CMP ucomiss, movss
+
+op_fcmpd:
+	FP_CMP ucomisd, movsd
+
+op_cvtsi2s:
+	and DESTREG, 15
+	cvtsi2ss xmm0, dword [REGS + 4*SRCREG]
+	movss [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+op_cvtsi2d:
+	and DESTREG, 15
+	cvtsi2sd xmm0, dword [REGS + 4*SRCREG]
+	movsd [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+op_cvts2si:	; Truncates.
+	and SRCREG, 15
+	cvttss2si DEST, [REGS + VM_FREGS + 8*SRCREG]
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_cvtd2si:	; Truncates.
+	and SRCREG, 15
+	cvttsd2si DEST, [REGS + VM_FREGS + 8*SRCREG]
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_cvts2d:
+	and DESTREG, 15
+	and SRCREG, 15
+	cvtss2sd xmm0, [REGS + VM_FREGS + 8*SRCREG]
+	movsd [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+op_cvtd2s:
+	and DESTREG, 15
+	and SRCREG, 15
+	cvtsd2ss xmm0, [REGS + VM_FREGS + 8*SRCREG]
+	movss [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+	; Loads and stores take the address from
+	; the integer register in byte 1.
+op_floads:
+	and DESTREG, 15
+	mov TEMP, [REGS + 4*SRCREG]
+	add TEMP, [REGS + VM_MEMORY_START]
+	MEMORY_BOUNDS_CHECK TEMP
+	movss xmm0, [TEMP]
+	movss [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+op_floadd:
+	and DESTREG, 15
+	mov TEMP, [REGS + 4*SRCREG]
+	add TEMP, [REGS + VM_MEMORY_START]
+	MEMORY_BOUNDS_CHECK TEMP
+	movsd xmm0, [TEMP]
+	movsd [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+op_fstores:
+	and DESTREG, 15
+	mov TEMP, [REGS + 4*SRCREG]
+	add TEMP, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK TEMP
+	movss xmm0, [REGS + VM_FREGS + 8*DESTREG]
+	movss [TEMP], xmm0
+	jmp mainloop
+
+op_fstored:
+	and DESTREG, 15
+	mov TEMP, [REGS + 4*SRCREG]
+	add TEMP, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK TEMP
+	movsd xmm0, [REGS + VM_FREGS + 8*DESTREG]
+	movsd [TEMP], xmm0
+	jmp mainloop
+
+op_fmov:
+	and DESTREG, 15
+	and SRCREG, 15
+	movsd xmm0, [REGS + VM_FREGS + 8*SRCREG]
+	movsd [REGS + VM_FREGS + 8*DESTREG], xmm0
+	jmp mainloop
+
+;------------------------------------------------------------------------------
+; Bit manipulation. Where the host instruction may be missing there is a
+; fallback, chosen by VM_CPU_FEATURES.
+;------------------------------------------------------------------------------
+op_popcnt:
+	mov DEST, [REGS + 4*SRCREG]
+	test dword [REGS + VM_CPU_FEATURES], CPU_POPCNT
+	jz .L1
+	popcnt DEST, DEST
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+.L1:
+	mov TEMP, DEST
+	shr TEMP, 1
+	and TEMP, 0x55555555
+	sub DEST, TEMP
+	mov TEMP, DEST
+	shr TEMP, 2
+	and DEST, 0x33333333
+	and TEMP, 0x33333333
+	add DEST, TEMP
+	mov TEMP, DEST
+	shr TEMP, 4
+	add DEST, TEMP
+	and DEST, 0x0f0f0f0f
+	imul DEST, DEST, 0x01010101
+	shr DEST, 24
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_lzcnt:
+	mov DEST, [REGS + 4*SRCREG]
+	test dword [REGS + VM_CPU_FEATURES], CPU_LZCNT
+	jz .L1
+	lzcnt DEST, DEST
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+.L1:
+	bsr TEMP, DEST
+	mov DEST, 32
+	jz .L2
+	mov DEST, TEMP
+	xor DEST, 31
+.L2:
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_tzcnt:
+	mov DEST, [REGS + 4*SRCREG]
+	test dword [REGS + VM_CPU_FEATURES], CPU_TZCNT
+	jz .L1
+	tzcnt DEST, DEST
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+.L1:
+	bsf TEMP, DEST
+	mov DEST, 32
+	jz .L2
+	mov DEST, TEMP
+.L2:
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_bswap:
+	bswap DEST
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_rol:
+	mov SRCREG, [REGS + 4*SRCREG]
+op_rol_imm8:
+	rol DEST, cl
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_ror:
+	mov SRCREG, [REGS + 4*SRCREG]
+op_ror_imm8:
+	ror DEST, cl
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+	; crc32c rD rS folds the 4 bytes of rS
+	; into the CRC in rD, crc32c8 just the
+	; low byte. No inversion is done.
+op_crc32c:
+	test dword [REGS + VM_CPU_FEATURES], CPU_CRC32
+	jz .L1
+	crc32 DEST, dword [REGS + 4*SRCREG]
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+.L1:
+	xor DEST, [REGS + 4*SRCREG]
+	mov SRCREG, 32
+	jmp crc32c_bits
+
+op_crc32c8:
+	test dword [REGS + VM_CPU_FEATURES], CPU_CRC32
+	jz .L1
+	crc32 DEST, byte [REGS + 4*SRCREG]
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+.L1:
+	movzx TEMP, byte [REGS + 4*SRCREG]
+	xor DEST, TEMP
+	mov SRCREG, 8
+
+crc32c_bits:
+	shr DEST, 1
+	jnc .L1
+	xor DEST, 0x82f63b78
+.L1:
+	dec SRCREG
+	jnz crc32c_bits
+	mov [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
 op_get_stack_relative:
 	lea TEMP, [REGSP + 4*SRCREG]
-        cmp TEMP, dword [stack_end]
+        cmp TEMP, dword [REGS + VM_STACK_END]
         jae error_stack_underflow
 	mov DEST, [TEMP]
 	mov dword [REGS + 4*DESTREG], DEST
@@ -829,14 +1615,14 @@ op_get_stack_relative:
 
 op_put_stack_relative:
 	lea TEMP, [REGSP + 4*SRCREG]
-        cmp TEMP, dword [stack_end]
+        cmp TEMP, dword [REGS + VM_STACK_END]
         jae error_stack_underflow
 	mov [TEMP], DEST
 	jmp mainloop
 
 op_load32:
 	mov TEMP, [REGS + 4*SRCREG]
-	add TEMP, [memory_start]
+	add TEMP, [REGS + VM_MEMORY_START]
 	MEMORY_BOUNDS_CHECK TEMP
 	mov DEST, [TEMP]
 	mov dword [REGS + 4*DESTREG], DEST
@@ -844,7 +1630,7 @@ op_load32:
 
 op_load16_unsigned:
 	mov TEMP, [REGS + 4*SRCREG]
-	add TEMP, [memory_start]
+	add TEMP, [REGS + VM_MEMORY_START]
 	MEMORY_BOUNDS_CHECK TEMP
 	movzx DEST, word [TEMP]
 	mov dword [REGS + 4*DESTREG], DEST
@@ -852,7 +1638,7 @@ op_load16_unsigned:
 
 op_load16_signed:
 	mov TEMP, [REGS + 4*SRCREG]
-	add TEMP, [memory_start]
+	add TEMP, [REGS + VM_MEMORY_START]
 	MEMORY_BOUNDS_CHECK TEMP
 	movsx DEST, word [TEMP]
 	mov dword [REGS + 4*DESTREG], DEST
@@ -860,7 +1646,7 @@ op_load16_signed:
 
 op_load8_unsigned:
 	mov TEMP, [REGS + 4*SRCREG]
-	add TEMP, [memory_start]
+	add TEMP, [REGS + VM_MEMORY_START]
 	MEMORY_BOUNDS_CHECK TEMP
 	movzx DEST, byte [TEMP]
 	mov dword [REGS + 4*DESTREG], DEST
@@ -868,18 +1654,226 @@ op_load8_unsigned:
 
 op_load8_signed:
 	mov TEMP, [REGS + 4*SRCREG]
-	add TEMP, [memory_start]
+	add TEMP, [REGS + VM_MEMORY_START]
 	MEMORY_BOUNDS_CHECK TEMP
 	movsx DEST, byte [TEMP]
 	mov dword [REGS + 4*DESTREG], DEST
 	jmp mainloop
 
+;------------------------------------------------------------------------------
+; Loads and stores addressed by base + disp32, and base + index * size.
+;------------------------------------------------------------------------------
+op_load32_disp:
+	DISP_ADDRESS MEMORY_BOUNDS_CHECK
+	mov DEST, [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_load16_unsigned_disp:
+	DISP_ADDRESS MEMORY_BOUNDS_CHECK
+	movzx DEST, word [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_load16_signed_disp:
+	DISP_ADDRESS MEMORY_BOUNDS_CHECK
+	movsx DEST, word [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_load8_unsigned_disp:
+	DISP_ADDRESS MEMORY_BOUNDS_CHECK
+	movzx DEST, byte [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_load8_signed_disp:
+	DISP_ADDRESS MEMORY_BOUNDS_CHECK
+	movsx DEST, byte [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_store32_disp:
+	DISP_ADDRESS WRITE_BOUNDS_CHECK
+	mov dword [TEMP], DEST
+	jmp mainloop
+
+op_store16_disp:
+	DISP_ADDRESS WRITE_BOUNDS_CHECK
+	mov word [TEMP], DESTWORD
+	jmp mainloop
+
+op_store8_disp:
+	DISP_ADDRESS WRITE_BOUNDS_CHECK
+	mov byte [TEMP], DESTBYTE
+	jmp mainloop
+
+op_load32_indexed:
+	INDEXED_ADDRESS 4, MEMORY_BOUNDS_CHECK
+	mov DEST, [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_load16_unsigned_indexed:
+	INDEXED_ADDRESS 2, MEMORY_BOUNDS_CHECK
+	movzx DEST, word [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_load16_signed_indexed:
+	INDEXED_ADDRESS 2, MEMORY_BOUNDS_CHECK
+	movsx DEST, word [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_load8_unsigned_indexed:
+	INDEXED_ADDRESS 1, MEMORY_BOUNDS_CHECK
+	movzx DEST, byte [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_load8_signed_indexed:
+	INDEXED_ADDRESS 1, MEMORY_BOUNDS_CHECK
+	movsx DEST, byte [TEMP]
+	mov dword [REGS + 4*DESTREG], DEST
+	jmp mainloop
+
+op_store32_indexed:
+	INDEXED_ADDRESS 4, WRITE_BOUNDS_CHECK
+	mov dword [TEMP], DEST
+	jmp mainloop
+
+op_store16_indexed:
+	INDEXED_ADDRESS 2, WRITE_BOUNDS_CHECK
+	mov word [TEMP], DESTWORD
+	jmp mainloop
+
+op_store8_indexed:
+	INDEXED_ADDRESS 1, WRITE_BOUNDS_CHECK
+	mov byte [TEMP], DESTBYTE
+	jmp mainloop
+
+;------------------------------------------------------------------------------
+; op_pair runs the two short forms packed into the low 24 bits of its word:
+; bytes 0 and 1 hold their registers, byte 2 their short opcodes. Each half
+; has its own copy of the short handlers, so that each has its own indirect
+; jump to predict. The handlers may only use eax, ebx and ecx.
+;------------------------------------------------------------------------------
+
+; Runs the second short form of the pair.
+%macro PAIR_SECOND 0
+	COUNT
+	mov DESTREG, TEMP
+	and DESTREG, 15
+	mov SRCREG, TEMP
+	shr SRCREG, 4
+	movzx eax, byte [REGIP - 2]
+	shr eax, 4
+	jmp [second_short_handlers + 4*eax]
+%endmacro
+
+%macro PAIR_DONE 0
+	jmp mainloop
+%endmacro
+
+%macro SHORT_ALU 2
+	mov eax, [REGS + 4*DESTREG]
+	%1 eax, [REGS + 4*SRCREG]
+	mov [REGS + 4*DESTREG], eax
+	%2
+%endmacro
+
+%macro SHORT_HANDLERS 2	; Label prefix, what to do after.
+%1_mov:
+	mov eax, [REGS + 4*SRCREG]
+	mov [REGS + 4*DESTREG], eax
+	%2
+%1_add:
+	SHORT_ALU add, %2
+%1_sub:
+	SHORT_ALU sub, %2
+%1_and:
+	SHORT_ALU and, %2
+%1_or:
+	SHORT_ALU or, %2
+%1_xor:
+	SHORT_ALU xor, %2
+%1_mul:
+	SHORT_ALU imul, %2
+%1_add_imm:
+	add [REGS + 4*DESTREG], SRCREG
+	%2
+%1_sub_imm:
+	sub [REGS + 4*DESTREG], SRCREG
+	%2
+%1_shl_imm:
+	shl dword [REGS + 4*DESTREG], cl
+	%2
+%1_shr_imm:
+	shr dword [REGS + 4*DESTREG], cl
+	%2
+%1_sar_imm:
+	sar dword [REGS + 4*DESTREG], cl
+	%2
+%1_mov_imm:
+	mov [REGS + 4*DESTREG], SRCREG
+	%2
+%1_load32:
+	mov eax, [REGS + 4*SRCREG]
+	add eax, [REGS + VM_MEMORY_START]
+	MEMORY_BOUNDS_CHECK eax
+	mov eax, [eax]
+	mov [REGS + 4*DESTREG], eax
+	%2
+%1_store32:
+	mov eax, [REGS + 4*SRCREG]
+	add eax, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK eax
+	mov ecx, [REGS + 4*DESTREG]
+	mov [eax], ecx
+	%2
+%endmacro
+
+%macro SHORT_TABLE 2	; Label prefix, what a nop does.
+	dd %1_mov
+	dd %1_add
+	dd %1_sub
+	dd %1_and
+	dd %1_or
+	dd %1_xor
+	dd %1_mul
+	dd %1_add_imm
+	dd %1_sub_imm
+	dd %1_shl_imm
+	dd %1_shr_imm
+	dd %1_sar_imm
+	dd %1_mov_imm
+	dd %1_load32
+	dd %1_store32
+	dd %2
+%endmacro
+
+op_pair:
+	mov TEMP, SRCREG	; Byte 1 holds dest and src of the second.
+	mov SRCREG, DESTREG
+	and DESTREG, 15
+	shr SRCREG, 4
+	movzx eax, byte [REGIP - 2]
+	and eax, 15
+	jmp [first_short_handlers + 4*eax]
+
+pair_second:
+	PAIR_SECOND
+
+	SHORT_HANDLERS first, PAIR_SECOND
+	SHORT_HANDLERS second, PAIR_DONE
+
 op_write_memory32:
 	mov DEST, [REGIP]
 	mov TEMP, [REGIP+4]
 	add REGIP, 8
-	add DEST, [memory_start]
-	MEMORY_BOUNDS_CHECK DEST
+	add DEST, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK DEST
 	mov [DEST], TEMP
 	jmp mainloop
 
@@ -887,37 +1881,37 @@ op_write_memory16:
 	mov DEST, [REGIP]
 	mov TEMP, [REGIP+4]
 	add REGIP, 8
-	add DEST, [memory_start]
-	MEMORY_BOUNDS_CHECK DEST
+	add DEST, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK DEST
 	mov word [DEST], TEMPWORD
 	jmp mainloop
 
 op_write_memory8:	; Note! imm8 is stored in SRCREG.
 	mov DEST, [REGIP]
 	add REGIP, 4
-	add DEST, [memory_start]
-	MEMORY_BOUNDS_CHECK DEST
+	add DEST, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK DEST
 	mov byte [DEST], SRCREGBYTE
 	jmp mainloop
 
 op_store32:	; Note! Stores DEST into address given in SRC.
 	mov TEMP, [REGS + 4*SRCREG]
-	add TEMP, [memory_start]
-	MEMORY_BOUNDS_CHECK TEMP
+	add TEMP, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK TEMP
 	mov dword [TEMP], DEST
 	jmp mainloop
 
 op_store16:	; Note! Stores DEST into address given in SRC.
 	mov TEMP, [REGS + 4*SRCREG]
-	add TEMP, [memory_start]
-	MEMORY_BOUNDS_CHECK TEMP
+	add TEMP, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK TEMP
 	mov word [TEMP], DESTWORD
 	jmp mainloop
 
 op_store8:	; Note! Stores DEST into address given in SRC.
 	mov TEMP, [REGS + 4*SRCREG]
-	add TEMP, [memory_start]
-	MEMORY_BOUNDS_CHECK TEMP
+	add TEMP, [REGS + VM_MEMORY_START]
+	WRITE_BOUNDS_CHECK TEMP
 	mov byte [TEMP], DESTBYTE
 	jmp mainloop
 
@@ -985,7 +1979,7 @@ op_dump:
 	push eax
 
 	push dword regdump_string_line
-	call _printf	; ESP is 16 byte aligned.
+	CALL_HOST _printf	; ESP is 16 byte aligned.
 	add esp, 20*4
 
 	pop eax
@@ -1031,11 +2025,11 @@ dump:
 	push dword [save_ebx]
 	push dword [save_eax]
 	push dword x86_regdump_string
-	call _printf	; ESP is 16 byte aligned.
+	CALL_HOST _printf	; ESP is 16 byte aligned.
 	add esp, 9*4
 
 	push dword 0
-	call _fflush
+	CALL_HOST _fflush
 	add esp, 4
 %endif
 
@@ -1062,7 +2056,7 @@ builtin_putchar:
 	push EBP
 
 	push EAX
-	call _putchar
+	CALL_HOST _putchar
 	add ESP, 4
 
 	pop EBP
@@ -1074,9 +2068,6 @@ builtin_putchar:
 	ret
 
 op_callout:
-	test dword [callout_function], 0xffffffff
-	jz error_callout_impossible
-
 	; Get function number.
 	sub REGIP, 2
 	movzx TEMP, byte [REGIP]
@@ -1085,17 +2076,76 @@ op_callout:
 	; Get 2nd param.
 	mov SRCREG, [SRCREG*4 + REGS]
 
+	test dword [REGS + VM_ASYNC_CALLOUTS], 0xffffffff
+	jnz .L1
+
+	test dword [REGS + VM_CALLOUT], 0xffffffff
+	jz error_callout_impossible
+
 	; DEST is the parameter.
 	; SRCREG is the function.
+%ifdef COUNTING
+	; Timed, for the metrics.
+	push dword 0
+	push SRCREG
+	push DEST
+	push TEMP
+	push REGS
+	CALL_HOST _metered_callout
+%else
 	push dword 0
 	push dword 0
 	push SRCREG
 	push DEST
 	push TEMP
-	call [callout_function]
+	CALL_HOST [REGS + VM_CALLOUT]
+%endif
 	add esp, 5*4
+
+	; The result replaces the parameter.
+	mov dword [4*DESTREG + REGS], eax
 	jmp mainloop
 
+	;----------------------------------------
+	; Asynchronous: hand the request to the
+	; host and suspend. The result is put in
+	; place when Interpret is called again.
+	;
+.L1:
+	mov [REGS + VM_CALLOUT_WHICH], TEMP
+	mov [REGS + VM_CALLOUT_PARAM1], DEST
+	mov [REGS + VM_CALLOUT_PARAM2], SRCREG
+	mov [REGS + VM_CALLOUT_REGISTER], DESTREG
+	mov dword [REGS + VM_CALLOUT_PENDING], 1
+	mov eax, RESULT_CALLOUT_PENDING
+	jmp done
+
+;------------------------------------------------------------------------------
+; The heap is kept by heap_op in heap.c. It is given the VM, what to do and
+; the two registers, and returns RESULT_OK to go on.
+;------------------------------------------------------------------------------
+%macro HEAP_OP 1
+	push dword 0
+	push SRCREG
+	push DESTREG
+	push dword %1
+	push REGS
+	CALL_HOST _heap_op
+	add esp, 5*4
+	test eax, eax
+	jnz done
+	jmp mainloop
+%endmacro
+
+op_alloc:
+	HEAP_OP HEAP_ALLOC
+
+op_free:
+	HEAP_OP HEAP_FREE
+
+op_realloc:
+	HEAP_OP HEAP_REALLOC
+
 op_putchar:
 	push dword 0
 	push dword 0
@@ -1107,7 +2157,7 @@ op_putchar:
 	push EBP
 
 	push eax
-	call _putchar	; ESP is aligned.
+	CALL_HOST _putchar	; ESP is aligned.
 	add esp, 4
 
 	pop EBP
@@ -1129,7 +2179,7 @@ op_putchar:
 op_print:
 call dump
 	mov TEMP, DEST
-	add TEMP, [memory_start]
+	add TEMP, [REGS + VM_MEMORY_START]
 .L0:
 	MEMORY_BOUNDS_CHECK TEMP
 
@@ -1147,7 +2197,7 @@ call dump
 	push EDI
 	push EBP
 	push eax
-	call _putchar	; ESP is aligned.
+	CALL_HOST _putchar	; ESP is aligned.
 	add esp, 4
 	pop EBP
 	pop EDI
@@ -1210,7 +2260,7 @@ op_printhex:
 	push EBP
 
 	push dword hexstr
-	call _printf
+	CALL_HOST _printf
 	add esp, 4
 	
 	pop EBP
@@ -1223,6 +2273,8 @@ op_printhex:
 
 	jmp mainloop
 
+_InterpretCodeEnd:
+
 ;-----------------------------------------------------------------------------
 ; Data Section
 ;-----------------------------------------------------------------------------
@@ -1356,21 +2408,96 @@ opcode_handlers:
 	dd op_print
 	dd op_printhex
 
-	times 150 dd op_exit
-
-registers:	times 256 dd 0
-
-string:
-	db 'Done.', 10, 0
-
-memory_start    dd 0
-memory_end      dd 0
-stack_start     dd 0
-stack_end       dd 0
-program_start   dd 0
-program_end     dd 0
-constants_start   dd 0
-constants_end     dd 0
+	; Stack
+	dd op_pushm
+	dd op_popm
+
+	; 64-bit math on register pairs
+	dd op_add64
+	dd op_sub64
+	dd op_mul64
+	dd op_mulw
+	dd op_imulw
+	dd op_shl64
+	dd op_shr64
+	dd op_sar64
+	dd op_shl64_imm8
+	dd op_shr64_imm8
+	dd op_sar64_imm8
+	dd op_cmp64
+	dd op_cmpu64
+
+	; Floating point
+	dd op_fadds
+	dd op_faddd
+	dd op_fsubs
+	dd op_fsubd
+	dd op_fmuls
+	dd op_fmuld
+	dd op_fdivs
+	dd op_fdivd
+	dd op_fsqrts
+	dd op_fsqrtd
+	dd op_fcmps
+	dd op_fcmpd
+	dd op_cvtsi2s
+	dd op_cvtsi2d
+	dd op_cvts2si
+	dd op_cvtd2si
+	dd op_cvts2d
+	dd op_cvtd2s
+	dd op_floads
+	dd op_floadd
+	dd op_fstores
+	dd op_fstored
+	dd op_fmov
+
+	; Bit manipulation
+	dd op_popcnt
+	dd op_lzcnt
+	dd op_tzcnt
+	dd op_bswap
+	dd op_rol
+	dd op_ror
+	dd op_rol_imm8
+	dd op_ror_imm8
+	dd op_crc32c
+	dd op_crc32c8
+
+	; Branches
+	dd op_switch
+
+	; Addressing modes
+	dd op_load32_disp
+	dd op_load16_unsigned_disp
+	dd op_load16_signed_disp
+	dd op_load8_unsigned_disp
+	dd op_load8_signed_disp
+	dd op_store32_disp
+	dd op_store16_disp
+	dd op_store8_disp
+	dd op_load32_indexed
+	dd op_load16_unsigned_indexed
+	dd op_load16_signed_indexed
+	dd op_load8_unsigned_indexed
+	dd op_load8_signed_indexed
+	dd op_store32_indexed
+	dd op_store16_indexed
+	dd op_store8_indexed
+
+	; Compact encoding
+	dd op_pair
+	dd op_alloc
+	dd op_free
+	dd op_realloc
+
+	times 81 dd op_exit
+
+first_short_handlers:
+	SHORT_TABLE first, pair_second
+
+second_short_handlers:
+	SHORT_TABLE second, mainloop
 
 done_string:
 	db 'Done.', 10, 0
@@ -1395,8 +2522,6 @@ save_ebp        dd 0
 
 hexstr	times 12 db 0
 
-callout_function	dd 0
-
 print_hex32_string	db '%08lx', 0
 
 print_uint32_string	db '%lu', 0
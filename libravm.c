@@ -0,0 +1,1034 @@
+/*============================================================================
+  libravm, an embeddable RAVM.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libravm.h"
+#include "opcodes.h"
+#include "image.h"
+#include "native.h"
+
+//----------------------------------------------------------------------------
+// Images are read either from a buffer or from a file descriptor.
+//----------------------------------------------------------------------------
+typedef struct {
+	const char *buffer;
+	size_t length;
+	size_t position;
+	int fd;
+} Source;
+
+//----------------------------------------------------------------------------
+// Name:	source_read
+// Purpose:	Reads exactly n bytes from the image.
+//----------------------------------------------------------------------------
+static int
+source_read (Source *src, void *dest, size_t n)
+{
+	if (src->buffer) {
+		if (n > src->length - src->position)
+			return RESULT_TRUNCATED;
+		memcpy (dest, src->buffer + src->position, n);
+		src->position += n;
+		return RESULT_OK;
+	}
+
+	char *p = dest;
+	while (n) {
+		ssize_t k = read (src->fd, p, n);
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			return RESULT_IO_ERROR;
+		}
+		if (!k)
+			return RESULT_TRUNCATED;
+		p += k;
+		n -= k;
+	}
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	source_skip
+// Purpose:	Skips n bytes of the image.
+//----------------------------------------------------------------------------
+static int
+source_skip (Source *src, size_t n)
+{
+	char buffer [1024];
+	int result = RESULT_OK;
+
+	if (src->buffer) {
+		if (n > src->length - src->position)
+			return RESULT_TRUNCATED;
+		src->position += n;
+		return RESULT_OK;
+	}
+
+	while (n && !result) {
+		size_t k = n < sizeof (buffer) ? n : sizeof (buffer);
+		result = source_read (src, buffer, k);
+		n -= k;
+	}
+	return result;
+}
+
+//----------------------------------------------------------------------------
+// Name:	source_map
+// Purpose:	Maps n bytes of the image read-only at dest, a page boundary,
+//		so that every VM running it shares the host's copy. Reads
+//		them instead if the image is not a whole file it can map.
+//----------------------------------------------------------------------------
+static int
+source_map (Source *src, char *dest, size_t n)
+{
+	struct stat st;
+	long page = sysconf (_SC_PAGESIZE);
+	off_t here = src->buffer ? -1 : lseek (src->fd, 0, SEEK_CUR);
+
+	if (n && here >= 0 && page > 0 && !(IMAGE_PAGE % page) && !(here % page)
+	    && !((uintptr_t) dest % page) && !fstat (src->fd, &st)
+	    && st.st_size >= here + (off_t) n
+	    && mmap (dest, n, PROT_READ, MAP_SHARED | MAP_FIXED, src->fd, here) != MAP_FAILED)
+		return lseek (src->fd, n, SEEK_CUR) < 0 ? RESULT_IO_ERROR : RESULT_OK;
+
+	return source_read (src, dest, n);
+}
+
+//----------------------------------------------------------------------------
+// Name:	source_unpack
+// Purpose:	Reads a compressed section into dest, one chunk at a time,
+//		expanding each straight from the image when it is in memory.
+//----------------------------------------------------------------------------
+static int
+source_unpack (Source *src, char *dest, uint32_t length, uint32_t packed)
+{
+	char *buffer = NULL;
+	int result = RESULT_OK;
+
+	while (length && !result) {
+		ImageChunk chunk;
+		if (packed < sizeof (chunk)) {
+			result = RESULT_BAD_IMAGE;
+			break;
+		}
+		if ((result = source_read (src, &chunk, sizeof (chunk))))
+			break;
+		packed -= sizeof (chunk);
+		if (!chunk.length || chunk.length > LZ_CHUNK || chunk.length > length
+		    || chunk.packed > chunk.length || chunk.packed > packed) {
+			result = RESULT_BAD_IMAGE;
+			break;
+		}
+
+		if (chunk.packed == chunk.length)
+			result = source_read (src, dest, chunk.length);
+		else {
+			const char *in;
+			if (src->buffer) {
+				if (chunk.packed > src->length - src->position) {
+					result = RESULT_TRUNCATED;
+					break;
+				}
+				in = src->buffer + src->position;
+				src->position += chunk.packed;
+			} else {
+				if (!buffer && !(buffer = malloc (LZ_CHUNK))) {
+					result = RESULT_NO_MEMORY;
+					break;
+				}
+				if ((result = source_read (src, buffer, chunk.packed)))
+					break;
+				in = buffer;
+			}
+			if (!lz_decompress (in, chunk.packed, dest, chunk.length))
+				result = RESULT_BAD_IMAGE;
+		}
+		dest += chunk.length;
+		length -= chunk.length;
+		packed -= chunk.packed;
+	}
+	if (!result && packed)
+		result = RESULT_BAD_IMAGE;
+
+	free (buffer);
+	return result;
+}
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// Accesses are checked by their first byte,
+// so one may run this far past memory_end.
+#define MEMORY_SLACK 8
+
+//----------------------------------------------------------------------------
+// Name:	clear_arena
+// Purpose:	Zeroes what the last program could have written in the arena,
+//		and puts anonymous memory back where its rodata may have been
+//		mapped from its image. On Linux MADV_DONTNEED just drops the
+//		pages that were touched, and they come back zeroed.
+// Returns:	false if it could not.
+//----------------------------------------------------------------------------
+static bool
+clear_arena (VM *vm, char *arena)
+{
+	size_t remap = vm->arena_shared;
+#if defined(__linux__) && defined(MADV_DONTNEED)
+	if (madvise (arena, vm->arena_dirty, MADV_DONTNEED))
+		return false;
+#else
+	remap = vm->arena_dirty;
+#endif
+	return !remap || mmap (arena, remap, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANON | MAP_FIXED | MAP_NORESERVE,
+			       -1, 0) != MAP_FAILED;
+}
+
+//----------------------------------------------------------------------------
+// Name:	keep_arena
+// Purpose:	Keeps memory mapped for the next program, noting how much of
+//		it has to be cleared and how much of that may be mapped from
+//		an image.
+//----------------------------------------------------------------------------
+static void
+keep_arena (VM *vm, char *memory, uint32_t dirty, uint32_t shared)
+{
+	vm->arena = memory;
+	vm->arena_dirty = dirty;
+	vm->arena_shared = shared;
+}
+
+//----------------------------------------------------------------------------
+// Name:	map_memory
+// Purpose:	Reserves zeroed VM memory, reusing the arena if it is big
+//		enough and mapped the same way. The host only provides pages
+//		as they are touched. MEMORY_SLACK more is mapped, for accesses
+//		that straddle the end. For huge pages the mapping is rounded to
+//		and aligned on HUGE_PAGE_SIZE, so that they can back all of it.
+// Returns:	NULL if there is not the address space.
+//----------------------------------------------------------------------------
+static char *
+map_memory (VM *vm, uint32_t length)
+{
+	size_t size = (size_t) length + MEMORY_SLACK;
+	char *p;
+
+	if (vm->huge_pages != HUGE_PAGES_NONE)
+		size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+	if ((p = vm->arena)) {
+		vm->arena = NULL;
+		if (size <= vm->memory_mapped && vm->arena_huge_pages == vm->huge_pages
+		    && clear_arena (vm, p))
+			return p;
+		munmap (p, vm->memory_mapped);
+	}
+	vm->arena_huge_pages = vm->huge_pages;
+
+	if (vm->huge_pages == HUGE_PAGES_NONE) {
+		p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		vm->memory_mapped = size;
+		return p;
+	}
+
+#ifdef MAP_HUGETLB
+	if (vm->huge_pages == HUGE_PAGES_RESERVE) {
+		p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			vm->memory_mapped = size;
+			return p;
+		}
+	}
+#endif
+
+	// Map a huge page more than needed,
+	// then trim it to alignment.
+	p = mmap (NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	char *aligned = (char*) (((uintptr_t) p + HUGE_PAGE_SIZE - 1)
+				 & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+	if (aligned > p)
+		munmap (p, aligned - p);
+	munmap (aligned + size, p + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+	madvise (aligned, size, MADV_HUGEPAGE);
+#endif
+	vm->memory_mapped = size;
+	return aligned;
+}
+
+//----------------------------------------------------------------------------
+// Name:	unload_native
+//----------------------------------------------------------------------------
+static void
+unload_native (VM *vm)
+{
+	if (vm->native_library)
+		dlclose (vm->native_library);
+	vm->native = NULL;
+	vm->native_library = NULL;
+}
+
+//----------------------------------------------------------------------------
+// Name:	release
+// Purpose:	Frees the program of a loaded image, and any native code made
+//		from it. Its memory becomes the arena, and the stack is
+//		cleared, so that the next program sees nothing of it.
+//----------------------------------------------------------------------------
+static void
+release (VM *vm)
+{
+	unload_native (vm);
+	heap_free (vm);
+	free (vm->program_start);
+	if (vm->memory_start) {
+		// A failed load may not have got
+		// as far as setting writable_start.
+		uint32_t dirty = vm->memory_end - vm->memory_start + MEMORY_SLACK;
+		uint32_t shared = 0;
+		if (vm->writable_start)
+			shared = vm->writable_start - vm->memory_start;
+		keep_arena (vm, vm->memory_start, dirty, shared < dirty ? shared : dirty);
+		if (vm->metrics)
+			metrics_unload (vm);
+		else
+			memset (vm->stack_start, 0, STACKSIZE);
+	}
+	free (vm->symbols);
+	free (vm->lines);
+	free (vm->strings);
+	vm->program_start = vm->program_end = NULL;
+	vm->memory_start = vm->memory_end = NULL;
+	vm->writable_start = NULL;
+	vm->symbols = NULL;
+	vm->lines = NULL;
+	vm->strings = NULL;
+	vm->n_symbols = vm->n_lines = vm->strings_length = 0;
+	vm->entry = 0;
+	vm->ip = NULL;
+}
+
+//----------------------------------------------------------------------------
+// Name:	verify
+// Purpose:	Checks that every switch table lies within the program and
+//		points at instructions within it.
+//----------------------------------------------------------------------------
+static int
+verify (const char *program, uint32_t length)
+{
+	uint32_t offset = 0;
+	while (offset + 4 <= length) {
+		uint32_t op = *(uint32_t*) (program + offset) & 0xff000000;
+		if (op != OP_SWITCH) {
+			offset += instruction_length (op);
+			continue;
+		}
+
+		if (offset + 8 > length)
+			return RESULT_BAD_SWITCH;
+		uint32_t n = *(uint32_t*) (program + offset + 4);
+		uint32_t table = offset + 8;
+		if (n > (length - table) / 4)
+			return RESULT_BAD_SWITCH;
+
+		uint32_t i;
+		for (i = 0; i < n; i++) {
+			int64_t target = (int64_t) table + *(int32_t*) (program + table + 4*i);
+			if (target < 0 || target >= length || (target & 3))
+				return RESULT_BAD_SWITCH;
+		}
+		offset = table + 4*n;
+	}
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	load_v1
+// Purpose:	Reads the rest of a version 1 image, after the magic number.
+//----------------------------------------------------------------------------
+static int
+load_v1 (VM *vm, Source *src)
+{
+	int result;
+
+	//------------------------------
+	// Read the section sizes.
+	//
+	uint32_t sizes [4];
+	if ((result = source_read (src, sizes, 16)))
+		return result;
+	uint32_t program_length = sizes[0];
+	uint32_t data_length = sizes[1];
+	if (!program_length
+	    || program_length >= MAX_PROGRAM_LENGTH
+	    || data_length >= MAX_DATA_SECTION_LENGTH)
+		return RESULT_BAD_IMAGE;
+
+	release (vm);
+
+	char *program = malloc (program_length);
+	char *memory = map_memory (vm, vm->memory_size + data_length);
+	if (!program || !memory) {
+		free (program);
+		if (memory)
+			keep_arena (vm, memory, 0, 0);
+		return RESULT_NO_MEMORY;
+	}
+
+	//------------------------------
+	// Read program bytes, then the
+	// data section if any directly
+	// into VM memory.
+	//
+	if ((result = source_read (src, program, program_length))
+	    || (result = source_read (src, memory + vm->memory_size, data_length))
+	    || (result = verify (program, program_length))) {
+		free (program);
+		keep_arena (vm, memory, vm->memory_size + data_length, 0);
+		return result;
+	}
+
+	vm->program_start = program;
+	vm->program_end = program + program_length;
+	vm->memory_start = memory;
+	vm->memory_end = memory + vm->memory_size + data_length;
+	vm->writable_start = memory;
+	vm->heap_start = IMAGE_PAGE;	// So that no block is at 0.
+	vm->heap_end = vm->memory_size & ~(IMAGE_PAGE - 1);
+	vm->constants_start = vm->memory_size; /* data section location */
+	vm->constants_length = data_length;
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	load_v2
+// Purpose:	Reads the rest of a version 2 image, after the magic number.
+//		The sections are read in file order; unknown ones are skipped.
+//----------------------------------------------------------------------------
+static int
+load_v2 (VM *vm, Source *src)
+{
+	int result;
+	ImageHeader header;
+	ImageSection table [MAX_IMAGE_SECTIONS];
+
+	if ((result = source_read (src, &header.version, sizeof (header) - 4)))
+		return result;
+	if (header.version != IMAGE_VERSION)
+		return RESULT_BAD_VERSION;
+	if (!header.n_sections || header.n_sections > MAX_IMAGE_SECTIONS)
+		return RESULT_BAD_IMAGE;
+	if ((result = source_read (src, table, header.n_sections * sizeof (ImageSection))))
+		return result;
+
+	//------------------------------
+	// Check the layout before
+	// allocating anything.
+	//
+	uint32_t at = sizeof (header) + header.n_sections * sizeof (ImageSection);
+	uint32_t program_length = 0;
+	uint32_t memory_length = vm->memory_size;
+	uint32_t data_start = 0, data_end = 0;
+	uint32_t readonly_end = 0, writable_data = 0xffffffff;
+	uint32_t seen = 0;		// Debugging sections so far, by type.
+	uint32_t i;
+	for (i = 0; i < header.n_sections; i++) {
+		ImageSection *section = &table [i];
+		uint32_t stored = section->packed ? section->packed : section->length;
+		if (section->offset < at || section->offset + stored < section->offset)
+			return RESULT_BAD_IMAGE;
+		at = section->offset + stored;
+
+		switch (section->type) {
+		case SECTION_TEXT:
+			if (program_length || !section->length
+			    || section->length >= MAX_PROGRAM_LENGTH)
+				return RESULT_BAD_IMAGE;
+			program_length = section->length;
+			break;
+		case SECTION_RODATA:
+		case SECTION_DATA: {
+			uint32_t end = section->address + section->length;
+			if (section->address < IMAGE_DATA_BASE || end < section->address
+			    || end - IMAGE_DATA_BASE >= MAX_DATA_SECTION_LENGTH)
+				return RESULT_BAD_IMAGE;
+			if (!data_end || section->address < data_start)
+				data_start = section->address;
+			if (end > data_end)
+				data_end = end;
+			if (end > memory_length)
+				memory_length = end;
+
+			// Rodata is read-only to the end
+			// of its last page, and all of it
+			// must be below data.
+			if (section->type == SECTION_DATA) {
+				if (section->address < writable_data)
+					writable_data = section->address;
+			} else {
+				end = (end + IMAGE_PAGE - 1) & ~(IMAGE_PAGE - 1);
+				if (end > readonly_end)
+					readonly_end = end;
+			}
+			break;
+		}
+		case SECTION_SYMBOLS:
+		case SECTION_LINES:
+		case SECTION_STRINGS:
+			// One of each, or the first
+			// would be lost.
+			if (seen & (1 << section->type))
+				return RESULT_BAD_IMAGE;
+			seen |= 1 << section->type;
+			if (section->type == SECTION_SYMBOLS
+			    && section->length % sizeof (ImageSymbol))
+				return RESULT_BAD_IMAGE;
+			if (section->type == SECTION_LINES
+			    && section->length % sizeof (ImageLine))
+				return RESULT_BAD_IMAGE;
+			break;
+		}
+	}
+	if (!program_length || header.entry >= program_length || (header.entry & 3)
+	    || readonly_end > writable_data)
+		return RESULT_BAD_IMAGE;
+	if (readonly_end > memory_length)
+		memory_length = readonly_end;
+
+#ifdef POSIX_FADV_WILLNEED
+	// Have the rest read ahead while
+	// the sections are being expanded.
+	if (!src->buffer) {
+		off_t here = lseek (src->fd, 0, SEEK_CUR);
+		if (here >= 0)
+			posix_fadvise (src->fd, here, at - sizeof (header)
+				       - header.n_sections * sizeof (ImageSection),
+				       POSIX_FADV_WILLNEED);
+	}
+#endif
+
+	release (vm);
+
+	char *program = malloc (program_length);
+	char *memory = map_memory (vm, memory_length);
+	if (!program || !memory) {
+		free (program);
+		if (memory)
+			keep_arena (vm, memory, 0, 0);
+		return RESULT_NO_MEMORY;
+	}
+	vm->program_start = program;
+	vm->program_end = program + program_length;
+	vm->memory_start = memory;
+	vm->memory_end = memory + memory_length;
+	// Set now, so that if loading fails release
+	// knows where rodata may have been mapped.
+	vm->writable_start = memory + readonly_end;
+
+	//------------------------------
+	// Read the sections. On failure
+	// release frees whatever was read.
+	//
+	bool packed_lines = false;
+	at = sizeof (header) + header.n_sections * sizeof (ImageSection);
+	for (i = 0; i < header.n_sections && !result; i++) {
+		ImageSection *section = &table [i];
+		void *dest = NULL;
+		if ((result = source_skip (src, section->offset - at)))
+			break;
+		at = section->offset + (section->packed ? section->packed : section->length);
+
+		switch (section->type) {
+		case SECTION_TEXT:
+			dest = program;
+			break;
+		case SECTION_RODATA:
+		case SECTION_DATA:
+			dest = memory + section->address;
+			break;
+		case SECTION_SYMBOLS:
+			dest = vm->symbols = malloc (section->length + 1);
+			vm->n_symbols = section->length / sizeof (ImageSymbol);
+			break;
+		case SECTION_LINES:
+			dest = vm->lines = malloc (section->length + 1);
+			vm->n_lines = section->length / sizeof (ImageLine);
+			packed_lines = section->packed != 0;
+			break;
+		case SECTION_STRINGS:
+			dest = vm->strings = malloc (section->length + 1);
+			vm->strings_length = section->length;
+			break;
+		default:
+			result = source_skip (src, section->packed ? section->packed : section->length);
+			continue;
+		}
+		if (!dest)
+			result = RESULT_NO_MEMORY;
+		else if (section->packed)
+			result = source_unpack (src, dest, section->length, section->packed);
+		else if (section->type == SECTION_RODATA)
+			result = source_map (src, dest, section->length);
+		else
+			result = source_read (src, dest, section->length);
+	}
+	if (!result)
+		result = verify (program, program_length);
+
+	// Undo the delta coding of a
+	// compressed line table.
+	for (i = 1; i < vm->n_lines && packed_lines; i++) {
+		vm->lines [i].address += vm->lines [i - 1].address;
+		vm->lines [i].line += vm->lines [i - 1].line;
+	}
+
+	//------------------------------
+	// Symbol names must be in the
+	// strings.
+	//
+	for (i = 0; i < vm->n_symbols && !result; i++)
+		if (vm->symbols [i].name >= vm->strings_length)
+			result = RESULT_BAD_IMAGE;
+	if (vm->strings)
+		vm->strings [vm->strings_length] = 0;
+
+	if (result) {
+		release (vm);
+		return result;
+	}
+
+	vm->entry = header.entry;
+	vm->heap_start = data_end > readonly_end ? data_end : readonly_end;
+	if (vm->heap_start < IMAGE_DATA_BASE)
+		vm->heap_start = IMAGE_DATA_BASE;
+	vm->heap_start = (vm->heap_start + IMAGE_PAGE - 1) & ~(IMAGE_PAGE - 1);
+	vm->heap_end = memory_length & ~(IMAGE_PAGE - 1);
+	if (vm->heap_end < vm->heap_start)
+		vm->heap_end = vm->heap_start;
+	vm->constants_start = data_start;
+	vm->constants_length = data_end - data_start;
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	load
+// Purpose:	Reads an image of either version into a VM, replacing
+//		whatever it held.
+//----------------------------------------------------------------------------
+static int
+load (VM *vm, Source *src)
+{
+	int result;
+
+	if (!vm)
+		return RESULT_INVALID_PARAM;
+
+	//------------------------------
+	// Verify magic number present.
+	//
+	uint32_t magic = 0;
+	if ((result = source_read (src, &magic, 4)))
+		return result;
+	if (magic == MAGIC)
+		result = load_v1 (vm, src);
+	else if (magic == MAGIC_V2)
+		result = load_v2 (vm, src);
+	else
+		return RESULT_BAD_MAGIC;
+	if (result)
+		return result;
+
+	trace_flush (vm);
+	ravm_reset (vm);
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_create
+// Purpose:	Makes an empty VM with the given amount of memory.
+// Returns:	NULL if out of memory.
+//----------------------------------------------------------------------------
+VM *
+ravm_create (uint32_t memory_mb)
+{
+	if (memory_mb < MINIMUM_MEMORY_MB)
+		memory_mb = MINIMUM_MEMORY_MB;
+	else if (memory_mb > MAXIMUM_MEMORY_MB)
+		return NULL;
+
+	VM *vm = calloc (1, sizeof (VM));
+	if (!vm)
+		return NULL;
+
+	vm->stack_start = calloc (1, STACKSIZE);
+	if (!vm->stack_start) {
+		free (vm);
+		return NULL;
+	}
+	vm->stack_end = vm->stack_start + STACKSIZE;
+	vm->memory_size = memory_mb << 20;
+	vm->trace_compiler = trace_compile;
+	vm->heap_op = heap_op;
+	return vm;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_destroy
+//----------------------------------------------------------------------------
+void
+ravm_destroy (VM *vm)
+{
+	if (!vm)
+		return;
+	release (vm);
+	if (vm->arena)
+		munmap (vm->arena, vm->memory_mapped);
+	trace_free (vm);
+	profile_free (vm);
+	metrics_free (vm);
+	callgraph_free (vm);
+	free (vm->stack_start);
+	free (vm);
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_load
+// Purpose:	Loads an image that is already in memory.
+//----------------------------------------------------------------------------
+int
+ravm_load (VM *vm, const void *image, size_t length)
+{
+	if (!image)
+		return RESULT_INVALID_PARAM;
+
+	Source src = { image, length, 0, -1 };
+	return load (vm, &src);
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_load_fd
+// Purpose:	Loads an image from the current position of a file.
+//----------------------------------------------------------------------------
+int
+ravm_load_fd (VM *vm, int fd)
+{
+	if (fd < 0)
+		return RESULT_INVALID_PARAM;
+
+	Source src = { NULL, 0, 0, fd };
+	return load (vm, &src);
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_load_native
+// Purpose:	Attaches a shared object made by ravm-aot from the program
+//		that is loaded, to be run instead of the interpreter.
+//----------------------------------------------------------------------------
+int
+ravm_load_native (VM *vm, const char *path)
+{
+	if (!vm || !path)
+		return RESULT_INVALID_PARAM;
+	if (!vm->program_start)
+		return RESULT_NOT_LOADED;
+
+	void *library = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+	if (!library)
+		return RESULT_IO_ERROR;
+
+	Native *native = (Native*) dlsym (library, NATIVE_FUNCTION);
+	const uint32_t *length = dlsym (library, NATIVE_LENGTH);
+	const uint32_t *checksum = dlsym (library, NATIVE_CHECKSUM);
+	uint32_t program_length = vm->program_end - vm->program_start;
+	if (!native || !length || !checksum || *length != program_length
+	    || *checksum != native_checksum (vm->program_start, program_length)) {
+		dlclose (library);
+		return RESULT_BAD_NATIVE;
+	}
+
+	unload_native (vm);
+	vm->native = native;
+	vm->native_library = library;
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_reset
+// Purpose:	Makes the next run start the program from the top.
+//		VM memory is left as it is.
+//----------------------------------------------------------------------------
+void
+ravm_reset (VM *vm)
+{
+	vm->ip = NULL;
+	vm->sp = NULL;
+	vm->callout_pending = 0;
+}
+
+//----------------------------------------------------------------------------
+// Name:	run
+// Purpose:	Runs the native code if there is any, and the interpreter
+//		from wherever that gives up. Counting is left to the
+//		interpreter. The interpreter is the build that does no more
+//		than this run needs: without a fuel limit it need not use
+//		fuel, and without a trace compiler it need not count hot
+//		branch targets.
+//----------------------------------------------------------------------------
+static int
+run (VM *vm, bool fueled)
+{
+	if (vm->count_instructions)
+		return InterpretCounting (vm);
+	if (vm->native) {
+		int retval = vm->native (vm);
+		if (retval != NATIVE_INTERPRET)
+			return retval;
+	}
+	if (vm->trace_compiler)
+		return fueled ? Interpret (vm) : InterpretUnfueled (vm);
+	return fueled ? InterpretUntraced (vm) : InterpretUnfueledUntraced (vm);
+}
+
+//----------------------------------------------------------------------------
+// Name:	run_for
+// Purpose:	Runs on the given fuel if fueled, or else until the program
+//		ends, keeping the metrics if there are any.
+//----------------------------------------------------------------------------
+static int
+run_for (VM *vm, uint32_t fuel, bool fueled)
+{
+	if (!vm)
+		return RESULT_INVALID_PARAM;
+	if (!vm->program_start)
+		return RESULT_NOT_LOADED;
+
+	if (vm->metrics)
+		metrics_enter (vm);
+
+	int retval;
+	if (fueled) {
+		vm->fuel = fuel;
+		retval = run (vm, true);
+	}
+	else {
+		do {
+			vm->fuel = FUEL_SLICE;
+			retval = run (vm, false);
+		} while (retval == RESULT_YIELD);
+	}
+
+	if (vm->metrics)
+		metrics_leave (vm, retval);
+	return retval;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_run
+// Purpose:	Runs until the fuel is used up, or if it is 0, until the
+//		program ends. Pending callouts are returned either way.
+//----------------------------------------------------------------------------
+int
+ravm_run (VM *vm, uint32_t fuel)
+{
+	return run_for (vm, fuel, fuel != 0);
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_step
+// Purpose:	Runs up to and including the next taken branch. Each taken
+//		branch uses a unit of fuel and yields when there is none, so
+//		with none to start with, one basic block runs.
+//----------------------------------------------------------------------------
+int
+ravm_step (VM *vm)
+{
+	return run_for (vm, 0, true);
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_get_register
+//----------------------------------------------------------------------------
+int
+ravm_get_register (VM *vm, unsigned reg, uint32_t *value)
+{
+	if (!vm || !value || reg >= 256)
+		return RESULT_INVALID_PARAM;
+	*value = vm->registers [reg];
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_set_register
+//----------------------------------------------------------------------------
+int
+ravm_set_register (VM *vm, unsigned reg, uint32_t value)
+{
+	if (!vm || reg >= 256)
+		return RESULT_INVALID_PARAM;
+	vm->registers [reg] = value;
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	check_memory_range
+//----------------------------------------------------------------------------
+static int
+check_memory_range (VM *vm, uint32_t address, const void *buffer, uint32_t length)
+{
+	if (!vm || !buffer)
+		return RESULT_INVALID_PARAM;
+	if (!vm->memory_start)
+		return RESULT_NOT_LOADED;
+	if ((uint64_t) address + length > (uint64_t) (vm->memory_end - vm->memory_start))
+		return RESULT_MEMORY_BOUNDS;
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_read_memory
+// Purpose:	Copies out of VM memory, given a VM pointer.
+//----------------------------------------------------------------------------
+int
+ravm_read_memory (VM *vm, uint32_t address, void *buffer, uint32_t length)
+{
+	int result = check_memory_range (vm, address, buffer, length);
+	if (!result)
+		memcpy (buffer, vm->memory_start + address, length);
+	return result;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_write_memory
+// Purpose:	Copies into VM memory, given a VM pointer. Rodata can not
+//		be written.
+//----------------------------------------------------------------------------
+int
+ravm_write_memory (VM *vm, uint32_t address, const void *buffer, uint32_t length)
+{
+	int result = check_memory_range (vm, address, buffer, length);
+	// As for the program, memory below
+	// writable_start is read-only.
+	if (!result && vm->memory_start + address < vm->writable_start)
+		result = RESULT_MEMORY_BOUNDS;
+	if (!result)
+		memcpy (vm->memory_start + address, buffer, length);
+	return result;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_symbol_at
+// Purpose:	Finds the text label at or before a text address.
+// Returns:	Its name, or NULL if there is none. offset, if given, is
+//		set to how far past the label the address is.
+//----------------------------------------------------------------------------
+const char *
+ravm_symbol_at (VM *vm, uint32_t address, uint32_t *offset)
+{
+	const ImageSymbol *best = NULL;
+	uint32_t i;
+
+	if (!vm || !vm->symbols)
+		return NULL;
+	for (i = 0; i < vm->n_symbols; i++) {
+		const ImageSymbol *symbol = &vm->symbols [i];
+		if (symbol->section == SECTION_TEXT && symbol->address <= address
+		    && (!best || symbol->address > best->address))
+			best = symbol;
+	}
+	if (!best)
+		return NULL;
+	if (offset)
+		*offset = address - best->address;
+	return vm->strings + best->name;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_line_at
+// Purpose:	Finds the source line a text address was assembled from.
+// Returns:	The line number, or 0 if unknown.
+//----------------------------------------------------------------------------
+uint32_t
+ravm_line_at (VM *vm, uint32_t address)
+{
+	if (!vm || !vm->n_lines || address < vm->lines[0].address)
+		return 0;
+
+	// The last entry at or before the address.
+	uint32_t low = 0, high = vm->n_lines;
+	while (high - low > 1) {
+		uint32_t middle = (low + high) / 2;
+		if (vm->lines [middle].address <= address)
+			low = middle;
+		else
+			high = middle;
+	}
+	return vm->lines [low].line;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_strerror
+//----------------------------------------------------------------------------
+const char *
+ravm_strerror (int result)
+{
+	switch (result) {
+	case RESULT_OK: return "OK.";
+	case RESULT_PROGRAM_BOUNDS: return "Program ran out of bounds.";
+	case RESULT_MEMORY_BOUNDS: return "Memory access out of bounds.";
+	case RESULT_STACK_BOUNDS: return "Stack overflow or underflow.";
+	case RESULT_STACK_UNDERFLOW: return "Stack underflow.";
+	case RESULT_STACK_OVERFLOW: return "Stack overflow.";
+	case RESULT_INVALID_ALLOCA_PARAM: return "Invalid alloc parameter.";
+	case RESULT_DIVIDE_BY_ZERO: return "Divide by zero.";
+	case RESULT_CALLOUT_IMPOSSIBLE: return "Callout impossible.";
+	case RESULT_YIELD: return "Ran out of fuel.";
+	case RESULT_CALLOUT_PENDING: return "Callout pending.";
+	case RESULT_NO_MEMORY: return "Out of memory.";
+	case RESULT_BAD_MAGIC: return "Program has bad magic number.";
+	case RESULT_TRUNCATED: return "Executable truncated.";
+	case RESULT_BAD_IMAGE: return "Program or data section length is zero or excessive.";
+	case RESULT_IO_ERROR: return "Read error.";
+	case RESULT_INVALID_PARAM: return "Invalid parameter.";
+	case RESULT_NOT_LOADED: return "No program loaded.";
+	case RESULT_BAD_SWITCH: return "Switch table out of bounds.";
+	case RESULT_BAD_VERSION: return "Image format version is not supported.";
+	case RESULT_BAD_NATIVE: return "Native code was made from another program.";
+	case RESULT_BAD_FREE: return "Freed memory that was not allocated.";
+	}
+	return "Unknown error.";
+}
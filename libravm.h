@@ -0,0 +1,115 @@
+/*============================================================================
+  libravm, an embeddable RAVM.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+#ifndef _LIBRAVM_H
+#define _LIBRAVM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defs.h"
+
+//----------------------------------------------------------------------------
+// Every function returning int returns one of the RESULT_* codes.
+// Nothing here prints or exits; that is left to the caller.
+//
+// The callout function and async_callouts are set directly in the VM.
+//----------------------------------------------------------------------------
+
+extern VM *ravm_create (uint32_t memory_mb);
+extern void ravm_destroy (VM *vm);
+
+extern int ravm_load (VM *vm, const void *image, size_t length);
+extern int ravm_load_fd (VM *vm, int fd);
+extern void ravm_reset (VM *vm);
+
+// A shared object made by ravm-aot from the loaded program.
+extern int ravm_load_native (VM *vm, const char *path);
+
+extern int ravm_run (VM *vm, uint32_t fuel);	// fuel 0 = until done.
+extern int ravm_step (VM *vm);			// One basic block.
+
+extern int ravm_get_register (VM *vm, unsigned reg, uint32_t *value);
+extern int ravm_set_register (VM *vm, unsigned reg, uint32_t value);
+extern int ravm_read_memory (VM *vm, uint32_t address, void *buffer, uint32_t length);
+extern int ravm_write_memory (VM *vm, uint32_t address, const void *buffer, uint32_t length);
+
+extern const char *ravm_strerror (int result);
+
+// Version 2 images only. Addresses are offsets into the program.
+extern const char *ravm_symbol_at (VM *vm, uint32_t address, uint32_t *offset);
+extern uint32_t ravm_line_at (VM *vm, uint32_t address);
+
+// Sampling profiler, one VM at a time. Folded stacks, as for flame graphs.
+extern int ravm_profile_start (VM *vm, unsigned hz);
+extern void ravm_profile_stop (VM *vm);
+extern int ravm_profile_write (VM *vm, FILE *f, bool lines, uint32_t *dropped);
+
+// Totals kept by ravm_run once ravm_metrics_start has been called.
+// Times are in nanoseconds and sizes in bytes.
+#define METRICS_BUCKETS 40
+
+typedef struct Metrics {
+	uint64_t instructions;
+	uint32_t max_stack_depth;
+	uint64_t peak_memory;		// VM memory touched.
+	uint64_t callouts;		// Synchronous and asynchronous.
+	uint64_t callout_time;
+	uint64_t callout_latency [METRICS_BUCKETS];	// 2^i up to 2^(i+1).
+	uint64_t wall_time;		// In ravm_run.
+	uint64_t cpu_time;		// Of the process, while in ravm_run.
+} Metrics;
+
+extern int ravm_metrics_start (VM *vm);
+extern int ravm_metrics_read (VM *vm, Metrics *m);
+extern int ravm_metrics_write (VM *vm, FILE *f);	// As JSON.
+
+// Call graph profiler. Costs per function and per call edge, as text.
+extern int ravm_callgraph_start (VM *vm);
+extern void ravm_callgraph_stop (VM *vm);
+extern int ravm_callgraph_write (VM *vm, FILE *f);
+
+// trace.c
+extern void *trace_compile (VM *vm, char *head);
+extern void trace_flush (VM *vm);
+extern void trace_free (VM *vm);
+
+// profile.c
+extern void profile_free (VM *vm);
+
+// metrics.c
+extern void metrics_enter (VM *vm);
+extern void metrics_leave (VM *vm, int result);
+extern void metrics_unload (VM *vm);
+extern void metrics_free (VM *vm);
+extern uint32_t metered_callout (VM *vm, uint32_t which, uint32_t param1, uint32_t param2);
+
+// callgraph.c
+extern void callgraph_call (VM *vm, char *ip, char *slot);
+extern void callgraph_return (VM *vm, char *ip, char *slot);
+extern void callgraph_free (VM *vm);
+
+// heap.c
+extern int heap_op (VM *vm, uint32_t op, unsigned d, unsigned s);
+extern void heap_free (VM *vm);
+
+#endif
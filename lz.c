@@ -0,0 +1,228 @@
+/*============================================================================
+  RAVM, a RISC-approximating virtual machine that fits in the L1 cache.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// Compression for image sections, in the LZ4 block format:
+//
+// - A sequence is a token byte, whose high nibble is the number of
+//   literals and low nibble the match length less 4, then the literals,
+//   then a 16-bit little-endian offset back to the match.
+// - A nibble of 15 is continued by bytes that are added to it until one
+//   is not 255; the literal count follows the token, the match length
+//   follows the offset.
+// - The last sequence is only literals. Matches end at least
+//   LAST_LITERALS bytes before the end.
+//
+// Blocks are at most LZ_CHUNK bytes, so every offset fits.
+//---------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <string.h>
+
+#include "image.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12		// No match may start in the last 12 bytes.
+#define HASH_BITS 12
+
+static uint32_t
+read32 (const uint8_t *p)
+{
+	uint32_t v;
+	memcpy (&v, p, 4);
+	return v;
+}
+
+static unsigned
+hash (uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+//----------------------------------------------------------------------------
+// Name:	put_length
+// Purpose:	Writes the bytes that continue a length nibble of 15.
+// Returns:	The new output position, or NULL if it would not fit.
+//----------------------------------------------------------------------------
+static uint8_t *
+put_length (uint8_t *out, uint8_t *end, uint32_t n)
+{
+	for (; n >= 255; n -= 255) {
+		if (out == end)
+			return NULL;
+		*out++ = 255;
+	}
+	if (out == end)
+		return NULL;
+	*out++ = n;
+	return out;
+}
+
+//----------------------------------------------------------------------------
+// Name:	put_sequence
+// Purpose:	Writes literals and, if length is nonzero, a match.
+// Returns:	The new output position, or NULL if it would not fit.
+//----------------------------------------------------------------------------
+static uint8_t *
+put_sequence (uint8_t *out, uint8_t *end, const uint8_t *literals, uint32_t n_literals,
+	      uint32_t offset, uint32_t length)
+{
+	uint32_t match = length ? length - MIN_MATCH : 0;
+
+	if (out == end)
+		return NULL;
+	*out++ = (n_literals < 15 ? n_literals : 15) << 4 | (match < 15 ? match : 15);
+	if (n_literals >= 15 && !(out = put_length (out, end, n_literals - 15)))
+		return NULL;
+	if ((uint32_t) (end - out) < n_literals)
+		return NULL;
+	memcpy (out, literals, n_literals);
+	out += n_literals;
+
+	if (!length)
+		return out;
+	if (end - out < 2)
+		return NULL;
+	*out++ = offset & 255;
+	*out++ = offset >> 8;
+	if (match >= 15 && !(out = put_length (out, end, match - 15)))
+		return NULL;
+	return out;
+}
+
+//----------------------------------------------------------------------------
+// Name:	lz_compress
+// Purpose:	Compresses one block of up to LZ_CHUNK bytes, greedily.
+// Returns:	The compressed length, or 0 if it is not smaller.
+//----------------------------------------------------------------------------
+uint32_t
+lz_compress (const void *source, uint32_t length, void *dest)
+{
+	const uint8_t *in = source;
+	const uint8_t *p = in, *anchor = in;
+	const uint8_t *limit = in + (length > MATCH_LIMIT ? length - MATCH_LIMIT : 0);
+	uint8_t *out = dest, *end = out + length;
+	uint32_t table [1 << HASH_BITS];
+
+	memset (table, 0xff, sizeof (table));
+
+	while (p < limit) {
+		unsigned h = hash (read32 (p));
+		uint32_t candidate = table [h];
+		table [h] = p - in;
+		if (candidate == 0xffffffff || read32 (in + candidate) != read32 (p)) {
+			p++;
+			continue;
+		}
+
+		const uint8_t *match = in + candidate;
+		uint32_t n = MIN_MATCH;
+		while (p + n < in + length - LAST_LITERALS && p[n] == match[n])
+			n++;
+
+		if (!(out = put_sequence (out, end, anchor, p - anchor, p - match, n)))
+			return 0;
+		p += n;
+		anchor = p;
+	}
+
+	if (!(out = put_sequence (out, end, anchor, in + length - anchor, 0, 0))
+	    || out == end)
+		return 0;
+	return out - (uint8_t*) dest;
+}
+
+//----------------------------------------------------------------------------
+// Name:	get_length
+// Purpose:	Adds up the bytes continuing a length nibble of 15.
+// Returns:	false if the input runs out.
+//----------------------------------------------------------------------------
+static bool
+get_length (const uint8_t **in, const uint8_t *end, uint32_t *n)
+{
+	unsigned byte;
+	do {
+		if (*in == end)
+			return false;
+		byte = *(*in)++;
+		*n += byte;
+	} while (byte == 255);
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// Name:	lz_decompress
+// Purpose:	Expands a block made by lz_compress into exactly length bytes.
+//		Bad input is caught, never read or written past.
+// Returns:	false if the block is bad.
+//----------------------------------------------------------------------------
+bool
+lz_decompress (const void *source, uint32_t packed, void *dest, uint32_t length)
+{
+	const uint8_t *in = source, *in_end = in + packed;
+	uint8_t *out = dest, *out_end = out + length;
+
+	while (in < in_end) {
+		unsigned token = *in++;
+		uint32_t n = token >> 4;
+		if (n == 15 && !get_length (&in, in_end, &n))
+			return false;
+		if ((uint32_t) (in_end - in) < n || (uint32_t) (out_end - out) < n)
+			return false;
+		if (n <= 16 && in_end - in >= 16 && out_end - out >= 16)
+			memcpy (out, in, 16);	// Cheaper than an exact length.
+		else
+			memcpy (out, in, n);
+		in += n;
+		out += n;
+		if (in == in_end)
+			break;
+
+		if (in_end - in < 2)
+			return false;
+		uint32_t offset = in[0] | in[1] << 8;
+		in += 2;
+		n = (token & 15) + MIN_MATCH;
+		if ((token & 15) == 15 && !get_length (&in, in_end, &n))
+			return false;
+		if (!offset || offset > (uint32_t) (out - (uint8_t*) dest)
+		    || (uint32_t) (out_end - out) < n)
+			return false;
+
+		// A match may overlap its own output, so unless it is
+		// at least 8 back it goes byte by byte. Whole words may
+		// run past the match, so there must be room for that.
+		const uint8_t *match = out - offset;
+		if (offset >= 8 && (uint32_t) (out_end - out) >= n + 8) {
+			uint8_t *stop = out + n;
+			do {
+				memcpy (out, match, 8);
+				out += 8;
+				match += 8;
+			} while (out < stop);
+			out = stop;
+		} else
+			while (n--)
+				*out++ = *match++;
+	}
+	return out == out_end;
+}
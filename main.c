@@ -31,11 +31,29 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <wchar.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
-#include "defs.h"
+#include "libravm.h"
 
 static uint32_t permissions = 0;
 static uint32_t memory_size = MINIMUM_MEMORY_MB;
+static uint32_t huge_pages = HUGE_PAGES_NONE;
+static uint32_t fuel = 0;	// 0 = run until done.
+static bool traces = true;
+static bool async_callouts = false;	// Serve callouts between runs.
+static bool load_time = false;	// Report how long a cold load takes.
+static char *native = NULL;	// Shared object made by ravm-aot.
+static bool perf_counters = false;	// Report host counters per VM instruction.
+static char *profile = NULL;	// Where to write sampled stacks.
+static bool profile_lines = false;	// Name frames with line numbers too.
+static char *metrics = NULL;	// Where to write run metrics as JSON.
+static char *call_graph = NULL;	// Where to write costs per function.
+
+#define PROFILE_HZ 997	// Not in step with anything periodic.
 
 //----------------------------------------------------------------------------
 // Name:	error
@@ -74,6 +92,94 @@ unsigned long mytime ()
 #endif
 }
 
+//----------------------------------------------------------------------------
+// Hardware counters for --perf-counters, counted in user mode only while
+// the VM runs. Any the host lacks are left out.
+//----------------------------------------------------------------------------
+#ifdef __linux__
+#define CACHE_READ_MISSES(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+				  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+	int fd;
+} perf_events [] = {
+	{ "Host cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1 },
+	{ "Host instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1 },
+	{ "Branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1 },
+	{ "L1 data misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES (PERF_COUNT_HW_CACHE_L1D), -1 },
+	{ "L1 instruction misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES (PERF_COUNT_HW_CACHE_L1I), -1 },
+	{ "Data TLB misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES (PERF_COUNT_HW_CACHE_DTLB), -1 },
+};
+#define N_PERF_EVENTS (sizeof (perf_events) / sizeof (perf_events[0]))
+
+//----------------------------------------------------------------------------
+// Name:	perf_open
+// Returns:	How many counters could be opened.
+//----------------------------------------------------------------------------
+int
+perf_open ()
+{
+	int i, n = 0;
+	for (i = 0; i < N_PERF_EVENTS; i++) {
+		struct perf_event_attr attr;
+		memset (&attr, 0, sizeof (attr));
+		attr.size = sizeof (attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		perf_events[i].fd = syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf_events[i].fd >= 0)
+			n++;
+	}
+	return n;
+}
+
+void
+perf_enable (bool on)
+{
+	int i;
+	for (i = 0; i < N_PERF_EVENTS; i++)
+		if (perf_events[i].fd >= 0)
+			ioctl (perf_events[i].fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+//----------------------------------------------------------------------------
+// Name:	perf_report
+// Purpose:	Prints each counter next to how much of it one VM instruction
+//		took. Counters the kernel had to share are scaled up.
+//----------------------------------------------------------------------------
+void
+perf_report (uint64_t instructions)
+{
+	int i;
+	for (i = 0; i < N_PERF_EVENTS; i++) {
+		uint64_t values [3];	// Count, time enabled, time running.
+		if (perf_events[i].fd < 0)
+			continue;
+		ssize_t n = read (perf_events[i].fd, values, sizeof (values));
+		close (perf_events[i].fd);
+		perf_events[i].fd = -1;
+		if (n != sizeof (values))
+			continue;
+		if (values[2] && values[2] < values[1])
+			values[0] = (uint64_t) ((double) values[0] * values[1] / values[2]);
+		printf ("%-24s%14llu%12.3f per VM instruction\n", perf_events[i].name,
+			(unsigned long long) values[0],
+			instructions ? (double) values[0] / instructions : 0.0);
+	}
+}
+#else
+int perf_open () { return 0; }
+void perf_enable (bool on) { }
+void perf_report (uint64_t instructions) { }
+#endif
+
 //----------------------------------------------------------------------------
 // Name:	usage
 //----------------------------------------------------------------------------
@@ -102,6 +208,7 @@ callout_function (uint32_t which, uint32_t param1, uint32_t param2)
 	default:
 		printf ("Invalid callout %08x specified.\n", which);
 	}
+	return 0;
 }
 
 //----------------------------------------------------------------------------
@@ -110,7 +217,7 @@ callout_function (uint32_t which, uint32_t param1, uint32_t param2)
 int
 main (int argc, char **argv)
 {
-	int i, chunk_size;
+	int i;
 
 	permissions = 0;
 
@@ -125,12 +232,51 @@ main (int argc, char **argv)
 		if (!strcmp ("--help", s)) {
 			usage ();
 		}
-		else if (i != argc-1 && !strcmp ("--memory", s)) {
-			int mb = atoi (argv[i+1]);
+		else if (i < argc && !strcmp ("--memory", s)) {
+			int mb = atoi (argv[i++]);
 			if (mb < MINIMUM_MEMORY_MB)
 				mb = MINIMUM_MEMORY_MB;
 			else if (mb > MAXIMUM_MEMORY_MB) 
 				error ("Too much memory specified (units = megabytes).");
+			memory_size = mb;
+		}
+		else if (!strcmp ("--huge-pages", s)) {
+			huge_pages = HUGE_PAGES_ADVISE;
+		}
+		else if (!strcmp ("--hugetlb", s)) {
+			huge_pages = HUGE_PAGES_RESERVE;
+		}
+		else if (i < argc && !strcmp ("--fuel", s)) {
+			fuel = strtoul (argv[i++], NULL, 0);
+			if (!fuel)
+				error ("Fuel must be nonzero.");
+		}
+		else if (!strcmp ("--async-callouts", s)) {
+			async_callouts = true;
+		}
+		else if (!strcmp ("--no-traces", s)) {
+			traces = false;
+		}
+		else if (!strcmp ("--load-time", s)) {
+			load_time = true;
+		}
+		else if (i < argc && !strcmp ("--native", s)) {
+			native = argv [i++];
+		}
+		else if (!strcmp ("--perf-counters", s)) {
+			perf_counters = true;
+		}
+		else if (i < argc && !strcmp ("--profile", s)) {
+			profile = argv [i++];
+		}
+		else if (!strcmp ("--profile-lines", s)) {
+			profile_lines = true;
+		}
+		else if (i < argc && !strcmp ("--metrics", s)) {
+			metrics = argv [i++];
+		}
+		else if (i < argc && !strcmp ("--call-graph", s)) {
+			call_graph = argv [i++];
 		}
 		else {
 			if ('-' == *s)
@@ -149,96 +295,152 @@ main (int argc, char **argv)
 
 	if (!src) 
 		error ("No input file.");
+	if (perf_counters && native)
+		error ("--perf-counters measures the interpreter, not native code.");
+	if (profile && native)
+		error ("--profile samples the interpreter, not native code.");
+	if (metrics && native)
+		error ("--metrics measures the interpreter, not native code.");
+	if (call_graph && native)
+		error ("--call-graph measures the interpreter, not native code.");
 
-	struct stat st;
-	if (stat (src, &st)) {
+	int fd = open (src, O_RDONLY);
+	if (fd < 0) {
 		perror ("Input file");
 		return 1;
 	}
 
-	//------------------------------
-	// Get executable file length.
-	//
-	unsigned int size = st.st_size;
-	FILE *f = fopen (src, "rb");
-	if (!f) {
-		perror ("Open file");
-		return 2;
+	VM *vm = ravm_create (memory_size);
+	if (!vm) {
+		perror (PROGRAM_NAME);
+		return -4;
 	}
+	vm->huge_pages = huge_pages;
 
-	//------------------------------
-	// Verify magic number present.
+	//--------------------
+	// To time a cold load, drop the
+	// file's pages from the cache first.
+	// Only clean pages can be dropped.
 	//
-	static uint32_t magic = 0;
-	if (4 != fread (&magic, 1, 4, f)) {
-		error ("Executable truncated.");
+	unsigned long t0 = 0;
+	if (load_time) {
+#ifdef POSIX_FADV_DONTNEED
+		fdatasync (fd);
+		posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+		t0 = mytime ();
 	}
-	if (magic != MAGIC)
-		error ("Program has bad magic number.");
 
-	//------------------------------
-	// Read the section sizes.
-	//
-	static uint32_t sizes [4];
-	if (16 != fread (sizes, 1, 16, f)) {
-		error ("Executable truncated.");
-	}
-	uint32_t program_length = sizes[0];
-	uint32_t data_length = sizes[1];
-	uint32_t aux_length = sizes[2];
-	uint32_t aux2_length = sizes[3];
-	if (!program_length)
-		error ("Program length is zero.");
-	if (program_length >= MAX_PROGRAM_LENGTH) 
-		error ("Program length is excessive.");
-	if (data_length >= MAX_DATA_SECTION_LENGTH)
-		error ("Data section length is excessive.");
-
-	char *memory = malloc ((memory_size<<20) + data_length);
-	if (!memory) {
-		perror (PROGRAM_NAME);
-		return -4;
-	}
-	bzero (memory, memory_size<<20);
+	int retval = ravm_load_fd (vm, fd);
+	close (fd);
+	if (retval)
+		error ((char*) ravm_strerror (retval));
+	if (load_time)
+		printf ("Loaded in %lu microseconds.\n", mytime () - t0);
 
-	//------------------------------
-	// Read program bytes.
+	if (native && (retval = ravm_load_native (vm, native)))
+		error ((char*) ravm_strerror (retval));
+
+	vm->callout = callout_function;
+	vm->async_callouts = async_callouts;
+	if (!traces)
+		vm->trace_compiler = NULL;
+
+	//--------------------
+	// Counting VM instructions takes the
+	// interpreter that counts them, which
+	// runs no traces.
 	//
-	char *program = malloc (program_length);
-	if (program_length != fread (program, 1, program_length, f)) {
-		perror ("Read file");
-		return 3;
+	unsigned long run_time = 0;
+	if (perf_counters) {
+		vm->count_instructions = 1;
+		if (!perf_open ())
+			puts ("No hardware performance counters are available.");
 	}
 
-	//------------------------------
-	// Read data section if any
-	// directly into VM memory.
+	if (profile && (retval = ravm_profile_start (vm, PROFILE_HZ)))
+		error ((char*) ravm_strerror (retval));
+	if (metrics && (retval = ravm_metrics_start (vm)))
+		error ((char*) ravm_strerror (retval));
+	if (call_graph && (retval = ravm_callgraph_start (vm)))
+		error ((char*) ravm_strerror (retval));
+
+	//--------------------
+	// Run the program.
+	// An asynchronous callout returns here
+	// to be served, and the program is
+	// resumed with its result. Running out
+	// of fuel ends the run.
 	//
-	if (data_length) {
-		if (data_length != fread (memory + data_length, 1, data_length, f)) {
-			perror ("Read file");
-			return 3;
+	do {
+		if (perf_counters) {
+			t0 = mytime ();
+			perf_enable (true);
+		}
+		retval = ravm_run (vm, fuel);
+		if (perf_counters) {
+			perf_enable (false);
+			run_time += mytime () - t0;
+		}
+		if (retval == RESULT_CALLOUT_PENDING)
+			vm->callout_result = callout_function (vm->callout_which, 
+						vm->callout_param1, vm->callout_param2);
+	} while (retval == RESULT_CALLOUT_PENDING);
+
+	if (profile) {
+		ravm_profile_stop (vm);
+		FILE *f = fopen (profile, "w");
+		if (!f)
+			perror ("Profile");
+		else {
+			uint32_t dropped = 0;
+			int result = ravm_profile_write (vm, f, profile_lines, &dropped);
+			if (fclose (f) && !result)
+				result = RESULT_IO_ERROR;
+			if (result)
+				printf ("Profile: %s\n", ravm_strerror (result));
+			else if (dropped)
+				printf ("%u samples did not fit in the profile.\n", dropped);
 		}
 	}
 
-	fclose (f);
+	if (call_graph) {
+		ravm_callgraph_stop (vm);
+		FILE *f = fopen (call_graph, "w");
+		if (!f)
+			perror ("Call graph");
+		else {
+			int result = ravm_callgraph_write (vm, f);
+			if (fclose (f) && !result)
+				result = RESULT_IO_ERROR;
+			if (result)
+				printf ("Call graph: %s\n", ravm_strerror (result));
+		}
+	}
 
-#define STACKSIZE 1024
-	char *stack = malloc (STACKSIZE);
-	bzero (stack, STACKSIZE);
+	if (metrics) {
+		FILE *f = fopen (metrics, "w");
+		if (!f)
+			perror ("Metrics");
+		else {
+			int result = ravm_metrics_write (vm, f);
+			if (fclose (f) && !result)
+				result = RESULT_IO_ERROR;
+			if (result)
+				printf ("Metrics: %s\n", ravm_strerror (result));
+		}
+	}
 
-	//--------------------
-	// Run the program.
-	//
-	int retval = Interpret (program, memory, stack, 
-				program+size, memory+(memory_size<<20)+data_length, stack+STACKSIZE, 
-				callout_function,
-				memory_size << 20 /* data section location */, 
-				data_length);
+	if (perf_counters) {
+		fflush (stdout);
+		printf ("\n%-24s%14llu\n", "VM instructions",
+			(unsigned long long) vm->instructions);
+		if (run_time)
+			printf ("%-24s%14.1f\n", "VM MIPS", (double) vm->instructions / run_time);
+		perf_report (vm->instructions);
+	}
 
-	free (program);
-	free (memory);
-	free (stack);
+	ravm_destroy (vm);
 
 	//--------------------
 	// Interpret results.
@@ -248,39 +450,10 @@ main (int argc, char **argv)
 		printf ("Exit code %u.\n", retval & 0x7fff);
 		exit (retval);
 	}
-	else {
-		switch (retval) {
-			case RESULT_OK:
-				puts ("OK."); 
-				break;
-			case RESULT_PROGRAM_BOUNDS:
-				puts ("Program ran out of bounds."); 
-				break;
-			case RESULT_MEMORY_BOUNDS:
-				puts ("Memory access out of bounds."); 
-				break;
-			case RESULT_STACK_BOUNDS:
-				puts ("Stack overflow or underflow."); 
-				break;
-			case RESULT_STACK_UNDERFLOW:
-				puts ("Stack underflow."); 
-				break;
-			case RESULT_STACK_OVERFLOW:
-				puts ("Stack overflow."); 
-				break;
-			case RESULT_INVALID_ALLOCA_PARAM:
-				puts ("Invalid alloc parameter."); 
-				break;
-			case RESULT_DIVIDE_BY_ZERO:
-				puts ("Divide by zero."); 
-				break;
-			case RESULT_CALLOUT_IMPOSSIBLE:
-				puts ("Callout impossible."); 
-				break;
-
-			default: printf ("Unknown error %d.\n", retval);
-		}
-	}
+	else if (retval > RESULT_BAD_FREE)
+		printf ("Unknown error %d.\n", retval);
+	else
+		puts (ravm_strerror (retval));
 	
 	return -retval;
 }
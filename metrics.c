@@ -0,0 +1,290 @@
+/*============================================================================
+  libravm, an embeddable RAVM.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// Run metrics. Once ravm_metrics_start has been called on a VM, it runs
+// under InterpretCounting and ravm_run keeps its totals. A VM that never
+// asks for metrics pays nothing for them.
+//
+// - Instructions come from the counting interpreter.
+// - The deepest the stack went is found by painting the unused part of
+//   it and seeing how much of the paint is left.
+// - Synchronous callouts are timed by metered_callout, which the
+//   counting interpreter calls in place of the callout function.
+//   Asynchronous ones are timed from when ravm_run hands the request
+//   over to when the result is passed back in.
+// - Touched memory is the VM memory the host has pages for.
+//---------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libravm.h"
+
+#define STACK_PAINT 0xdeadbeef
+
+typedef struct Metering {
+	Metrics totals;
+	uint64_t callout_made;		// When the pending callout was handed over.
+	uint64_t wall_start;
+	uint64_t cpu_start;
+} Metering;
+
+//----------------------------------------------------------------------------
+// Name:	nanoseconds
+//----------------------------------------------------------------------------
+static uint64_t
+nanoseconds (clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime (clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//----------------------------------------------------------------------------
+// Name:	record_callout
+// Purpose:	Adds a callout to the count and the histogram. Bucket i
+//		holds latencies of 2^i up to 2^(i+1) nanoseconds.
+//----------------------------------------------------------------------------
+static void
+record_callout (Metrics *m, uint64_t latency)
+{
+	unsigned bucket = 0;
+	while (latency >> (bucket + 1) && bucket < METRICS_BUCKETS - 1)
+		bucket++;
+	m->callouts++;
+	m->callout_time += latency;
+	m->callout_latency [bucket]++;
+}
+
+//----------------------------------------------------------------------------
+// Name:	metered_callout
+// Purpose:	Called by InterpretCounting to make a synchronous callout.
+//----------------------------------------------------------------------------
+uint32_t
+metered_callout (VM *vm, uint32_t which, uint32_t param1, uint32_t param2)
+{
+	if (!vm->metrics)
+		return vm->callout (which, param1, param2);
+
+	uint64_t t0 = nanoseconds (CLOCK_MONOTONIC);
+	uint32_t result = vm->callout (which, param1, param2);
+	record_callout (&vm->metrics->totals, nanoseconds (CLOCK_MONOTONIC) - t0);
+	return result;
+}
+
+//----------------------------------------------------------------------------
+// Name:	paint_stack
+// Purpose:	Paints the stack below top, the part the program is not
+//		using.
+//----------------------------------------------------------------------------
+static void
+paint_stack (VM *vm, char *top)
+{
+	uint32_t *p = (uint32_t*) vm->stack_start;
+	while (p < (uint32_t*) top)
+		*p++ = STACK_PAINT;
+}
+
+//----------------------------------------------------------------------------
+// Name:	touched_memory
+// Purpose:	Counts the bytes of VM memory the host has pages for.
+//----------------------------------------------------------------------------
+static uint64_t
+touched_memory (VM *vm)
+{
+	if (!vm->memory_start)
+		return 0;
+
+	uintptr_t page = sysconf (_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) vm->memory_start & ~(page - 1);
+	uintptr_t end = ((uintptr_t) vm->memory_end + page - 1) & ~(page - 1);
+	size_t n = (end - start) / page;
+	unsigned char *resident = malloc (n);
+	if (!resident || mincore ((void*) start, end - start, (void*) resident)) {
+		free (resident);
+		return 0;
+	}
+
+	uint64_t bytes = 0;
+	size_t i;
+	for (i = 0; i < n; i++)
+		if (resident [i] & 1)
+			bytes += page;
+	free (resident);
+	return bytes;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_metrics_start
+// Purpose:	Starts keeping metrics for a VM. They add up until it is
+//		destroyed.
+//----------------------------------------------------------------------------
+int
+ravm_metrics_start (VM *vm)
+{
+	if (!vm)
+		return RESULT_INVALID_PARAM;
+	if (!vm->metrics) {
+		vm->metrics = calloc (1, sizeof (Metering));
+		if (!vm->metrics)
+			return RESULT_NO_MEMORY;
+	}
+	vm->count_instructions = 1;
+	paint_stack (vm, vm->ip ? vm->sp : vm->stack_end);
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	metrics_enter
+// Purpose:	Called by ravm_run as it starts.
+//----------------------------------------------------------------------------
+void
+metrics_enter (VM *vm)
+{
+	Metering *metering = vm->metrics;
+	metering->wall_start = nanoseconds (CLOCK_MONOTONIC);
+	metering->cpu_start = nanoseconds (CLOCK_PROCESS_CPUTIME_ID);
+	if (vm->callout_pending && metering->callout_made) {
+		record_callout (&metering->totals, metering->wall_start - metering->callout_made);
+		metering->callout_made = 0;
+	}
+}
+
+//----------------------------------------------------------------------------
+// Name:	metrics_leave
+// Purpose:	Called by ravm_run with what it is about to return.
+//----------------------------------------------------------------------------
+void
+metrics_leave (VM *vm, int result)
+{
+	Metering *metering = vm->metrics;
+	uint64_t now = nanoseconds (CLOCK_MONOTONIC);
+	metering->totals.wall_time += now - metering->wall_start;
+	metering->totals.cpu_time += nanoseconds (CLOCK_PROCESS_CPUTIME_ID) - metering->cpu_start;
+	if (result == RESULT_CALLOUT_PENDING)
+		metering->callout_made = now;
+	else if (result != RESULT_YIELD)
+		ravm_metrics_read (vm, NULL);	// Touched memory, before it goes.
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_metrics_read
+// Purpose:	Brings the metrics up to date and copies them out, if m is
+//		given.
+//----------------------------------------------------------------------------
+int
+ravm_metrics_read (VM *vm, Metrics *m)
+{
+	if (!vm || !vm->metrics)
+		return RESULT_INVALID_PARAM;
+	Metrics *totals = &vm->metrics->totals;
+
+	totals->instructions = vm->instructions;
+
+	uint32_t *p = (uint32_t*) vm->stack_start;
+	while (p < (uint32_t*) vm->stack_end && *p == STACK_PAINT)
+		p++;
+	uint32_t depth = vm->stack_end - (char*) p;
+	if (depth > totals->max_stack_depth)
+		totals->max_stack_depth = depth;
+
+	uint64_t touched = touched_memory (vm);
+	if (touched > totals->peak_memory)
+		totals->peak_memory = touched;
+
+	if (m)
+		*m = *totals;
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	metrics_unload
+// Purpose:	Called as a program is unloaded, while its memory is still
+//		there. What it used is added in, then the whole stack is
+//		painted again for the next program, which also clears it.
+//----------------------------------------------------------------------------
+void
+metrics_unload (VM *vm)
+{
+	ravm_metrics_read (vm, NULL);
+	paint_stack (vm, vm->stack_end);
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_metrics_write
+// Purpose:	Writes the metrics as a JSON object. Times are in
+//		nanoseconds, sizes in bytes. Only callout latency buckets
+//		that were used are written, each with its upper bound; the
+//		last has none.
+//----------------------------------------------------------------------------
+int
+ravm_metrics_write (VM *vm, FILE *f)
+{
+	Metrics m;
+	int result = ravm_metrics_read (vm, &m);
+	if (result)
+		return result;
+
+	fprintf (f, "{\n");
+	fprintf (f, "  \"instructions\": %llu,\n", (unsigned long long) m.instructions);
+	fprintf (f, "  \"max_stack_depth\": %u,\n", m.max_stack_depth);
+	fprintf (f, "  \"stack_size\": %u,\n", STACKSIZE);
+	fprintf (f, "  \"callouts\": %llu,\n", (unsigned long long) m.callouts);
+	fprintf (f, "  \"callout_time\": %llu,\n", (unsigned long long) m.callout_time);
+	fprintf (f, "  \"callout_latency\": [");
+	int i;
+	const char *separator = "";
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		if (!m.callout_latency [i])
+			continue;
+		fprintf (f, "%s\n    { \"below\": ", separator);
+		if (i < METRICS_BUCKETS - 1)
+			fprintf (f, "%llu", 2ULL << i);
+		else
+			fprintf (f, "null");
+		fprintf (f, ", \"count\": %llu }", (unsigned long long) m.callout_latency [i]);
+		separator = ",";
+	}
+	fprintf (f, "%s],\n", *separator ? "\n  " : "");
+	fprintf (f, "  \"peak_memory\": %llu,\n", (unsigned long long) m.peak_memory);
+	fprintf (f, "  \"memory_size\": %llu,\n",
+		 (unsigned long long) (vm->memory_end - vm->memory_start));
+	fprintf (f, "  \"wall_time\": %llu,\n", (unsigned long long) m.wall_time);
+	fprintf (f, "  \"cpu_time\": %llu\n", (unsigned long long) m.cpu_time);
+	fprintf (f, "}\n");
+	return ferror (f) ? RESULT_IO_ERROR : RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	metrics_free
+//----------------------------------------------------------------------------
+void
+metrics_free (VM *vm)
+{
+	free (vm->metrics);
+	vm->metrics = NULL;
+}
@@ -0,0 +1,240 @@
+/*============================================================================
+  RAVM, a RISC-approximating virtual machine that fits in the L1 cache.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// Native code made by ravm-aot. A program is translated into one C
+// function, ravm_native, which runs it on a VM just as Interpret would,
+// and built into a shared object that ravm_load_native attaches to the
+// VM. Fuel, yields and callouts behave as in the interpreter.
+//
+// ravm_native can resume at any instruction it knows to be a branch
+// target or return address. Anywhere else, and at anything it could not
+// translate, it saves the VM state and returns NATIVE_INTERPRET, and the
+// interpreter carries on from there.
+//
+// The rest of this file is the support the generated code uses, and is
+// only compiled into it.
+//---------------------------------------------------------------------------
+
+#ifndef _NATIVE_H
+#define _NATIVE_H
+
+#include <stdint.h>
+
+#include "defs.h"
+
+#define NATIVE_INTERPRET (-1)
+
+// Symbols of the shared object.
+#define NATIVE_FUNCTION "ravm_native"
+#define NATIVE_LENGTH "ravm_native_length"
+#define NATIVE_CHECKSUM "ravm_native_checksum"
+
+//----------------------------------------------------------------------------
+// Name:	native_checksum
+// Purpose:	Identifies the program text native code was made from.
+//----------------------------------------------------------------------------
+static inline uint32_t
+native_checksum (const char *program, uint32_t length)
+{
+	uint32_t hash = 2166136261u;	// FNV-1a
+	uint32_t i;
+	for (i = 0; i < length; i++)
+		hash = (hash ^ (unsigned char) program [i]) * 16777619u;
+	return hash;
+}
+
+#ifdef NATIVE_CODE
+
+#include <stdio.h>
+#include <string.h>
+#include <emmintrin.h>
+
+//------------------------------
+// ravm_native keeps in locals:
+// r, the registers; ip, the
+// program offset being run;
+// sp, fuel and the bounds of
+// the program, memory and stack.
+//
+#define NATIVE_ENTER \
+	uint32_t *r = vm->registers; \
+	char *program = vm->program_start; \
+	uint32_t length = vm->program_end - vm->program_start; \
+	char *memory = vm->memory_start; \
+	char *memory_end = vm->memory_end; \
+	char *writable = vm->writable_start; \
+	char *stack_start = vm->stack_start; \
+	char *stack_end = vm->stack_end; \
+	uint32_t fuel = vm->fuel; \
+	uint32_t ip; \
+	char *sp; \
+	int retval; \
+	if (!vm->ip) { \
+		for (ip = 0; ip < 256; ip++) \
+			r [ip] = ip; \
+		sp = stack_end; \
+		ip = vm->entry; \
+	} else { \
+		sp = vm->sp; \
+		ip = vm->ip - program; \
+		if (vm->callout_pending) { \
+			vm->callout_pending = 0; \
+			r [vm->callout_register] = vm->callout_result; \
+		} \
+	}
+
+// Where a branch whose target is not
+// known goes, and where it all ends.
+#define NATIVE_LEAVE \
+taken: \
+	if (!fuel--) { \
+		fuel = 0; \
+		STOP (RESULT_YIELD, ip); \
+	} \
+	goto dispatch; \
+out: \
+	vm->ip = (char*) ((uintptr_t) program + ip); \
+	vm->sp = sp; \
+	vm->fuel = fuel; \
+	return retval;
+
+#define STOP(result,next) do { retval = (result); ip = (next); goto out; } while (0)
+
+// A VM address of the program, as
+// pushed by calls.
+#define HOST(offset) ((uint32_t) (uintptr_t) (program + (offset)))
+
+// Taken branches use fuel, as
+// in the interpreter.
+#define TAKEN(offset) do { \
+	if (!fuel--) { \
+		fuel = 0; \
+		STOP (RESULT_YIELD, offset); \
+	} \
+	goto L##offset; \
+} while (0)
+
+#define JUMP(host) do { ip = (uint32_t) (host) - HOST (0); goto taken; } while (0)
+
+// Only the first byte is checked,
+// as in the interpreter.
+#define ADDRESS(p,a,next) do { \
+	p = (char*) ((uintptr_t) memory + (uint32_t) (a)); \
+	if ((uintptr_t) p < (uintptr_t) memory || p >= memory_end) \
+		STOP (RESULT_MEMORY_BOUNDS, next); \
+} while (0)
+
+// Stores may not go below writable,
+// where memory is read-only.
+#define WRITE_ADDRESS(p,a,next) do { \
+	p = (char*) ((uintptr_t) memory + (uint32_t) (a)); \
+	if ((uintptr_t) p < (uintptr_t) writable || p >= memory_end) \
+		STOP (RESULT_MEMORY_BOUNDS, next); \
+} while (0)
+
+#define PUSH(v,next) do { \
+	sp -= 4; \
+	if (sp < stack_start) \
+		STOP (RESULT_STACK_OVERFLOW, next); \
+	put32 (sp, v); \
+} while (0)
+
+static inline uint32_t get32 (const char *p) { uint32_t v; memcpy (&v, p, 4); return v; }
+static inline uint16_t get16 (const char *p) { uint16_t v; memcpy (&v, p, 2); return v; }
+static inline void put32 (char *p, uint32_t v) { memcpy (p, &v, 4); }
+static inline void put16 (char *p, uint16_t v) { memcpy (p, &v, 2); }
+
+// Single precision uses the first
+// 4 bytes of an FP register.
+static inline float
+getf (VM *vm, unsigned n)
+{
+	float f;
+	memcpy (&f, &vm->fregs [n], 4);
+	return f;
+}
+
+static inline void
+setf (VM *vm, unsigned n, float f)
+{
+	memcpy (&vm->fregs [n], &f, 4);
+}
+
+static inline uint32_t
+fcompare (double a, double b)
+{
+	if (a != a || b != b)
+		return 2;
+	return a > b ? 1 : a == b ? 0 : -1;
+}
+
+static inline uint32_t
+crc32c_bits (uint32_t crc, int n)
+{
+	while (n--)
+		crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+	return crc;
+}
+
+static inline uint32_t
+rotate_left (uint32_t v, unsigned n)
+{
+	n &= 31;
+	return n ? (v << n) | (v >> (32 - n)) : v;
+}
+
+//----------------------------------------------------------------------------
+// Name:	native_print
+// Purpose:	Prints a string from VM memory. Returns 0 if it ran off the
+//		end of memory.
+//----------------------------------------------------------------------------
+static inline int
+native_print (VM *vm, uint32_t address, unsigned newline)
+{
+	char *p = (char*) ((uintptr_t) vm->memory_start + address);
+	for (;;) {
+		if ((uintptr_t) p < (uintptr_t) vm->memory_start || p >= vm->memory_end)
+			return 0;
+		if (!*p)
+			break;
+		putchar ((unsigned char) *p++);
+	}
+	if (newline)
+		putchar ('\n');
+	return 1;
+}
+
+static inline void
+native_dump (uint32_t *r)
+{
+	int i;
+	for (i = 0; i < 32; i++)
+		printf ("r%d %08x\tr%d %08x\tr%d %08x\tr%d %08x\t"
+			"r%d %08x\tr%d %08x\tr%d %08x\tr%d %08x\n",
+			i, r [i], i + 32, r [i + 32], i + 64, r [i + 64],
+			i + 96, r [i + 96], i + 128, r [i + 128],
+			i + 160, r [i + 160], i + 192, r [i + 192],
+			i + 224, r [i + 224]);
+}
+
+#endif
+#endif
@@ -0,0 +1,280 @@
+/*============================================================================
+  RAVM, a RISC-approximating virtual machine that fits in the L1 cache.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// Instruction encoding, shared by rasm and the runtime.
+// The order must match opcode_handlers in interpreter-x86.asm.
+//---------------------------------------------------------------------------
+
+#ifndef _OPCODES_H
+#define _OPCODES_H
+
+#define DEST(XX) (((((unsigned)XX) & 255))<<0)
+#define SRC(XX) (((((unsigned)XX) & 255))<<8)
+#define SRC2(XX) (((((unsigned)XX) & 255))<<16)
+
+enum {
+	MAINLOOP = 0<<24,
+	OP_DUMP = 1<<24,
+	OP_EXIT = 2<<24,
+	OP_LOAD16_SIGNED = 3<<24,
+	OP_LOAD16_UNSIGNED = 4<<24,
+	OP_LOAD32 = 5<<24,
+	OP_LOAD8_SIGNED = 6<<24,
+	OP_LOAD8_UNSIGNED = 7<<24,
+	OP_MOV = 8<<24,
+	OP_MOV_IMM16_SIGNED = 9<<24,
+	OP_MOV_IMM32 = 10<<24,
+	OP_MOV_IMM8_SIGNED = 11<<24,
+	OP_STORE16 = 12<<24,
+	OP_STORE32 = 13<<24,
+	OP_STORE8 = 14<<24,
+	OP_WRITE_MEMORY16 = 15<<24,
+	OP_WRITE_MEMORY32 = 16<<24,
+	OP_WRITE_MEMORY8 = 17<<24,
+	OP_SAR = 18<<24,
+	OP_SAR_IMM8 = 19<<24,
+	OP_SHL = 20<<24,
+	OP_SHL_IMM8 = 21<<24,
+	OP_SHR = 22<<24,
+	OP_SHR_IMM8 = 23<<24,
+	OP_ADD = 24<<24,
+	OP_ADD_IMM32 = 25<<24,
+	OP_ADD_IMM8 = 26<<24,
+	OP_DIV = 27<<24,
+	OP_DIV_IMM8 = 28<<24,
+	OP_IDIV = 29<<24,
+	OP_IDIV_IMM8 = 30<<24,
+	OP_IMOD = 31<<24,
+	OP_IMOD_IMM8 = 32<<24,
+	OP_IMUL = 33<<24,
+	OP_IMUL_IMM8 = 34<<24,
+	OP_MOD = 35<<24,
+	OP_MOD_IMM8 = 36<<24,
+	OP_MUL = 37<<24,
+	OP_MUL_10 = 38<<24,
+	OP_MUL_100 = 39<<24,
+	OP_MUL_IMM8 = 40<<24,
+	OP_NEG = 41<<24,
+	OP_SUB = 42<<24,
+	OP_SUB_IMM8 = 43<<24,
+	OP_LOGICAL_AND = 44<<24,
+	OP_LOGICAL_NOT = 45<<24,
+	OP_LOGICAL_OR = 46<<24,
+	OP_AND = 47<<24,
+	OP_AND_IMM8 = 48<<24,
+	OP_CLEAR_BIT_IMM8 = 49<<24,
+	OP_INVERT_BIT_IMM8 = 50<<24,
+	OP_NOT = 51<<24,
+	OP_OR = 52<<24,
+	OP_OR_IMM8 = 53<<24,
+	OP_SET_BIT_IMM8 = 54<<24,
+	OP_XOR = 55<<24,
+	OP_XOR_IMM8 = 56<<24,
+	OP_CALL = 57<<24,
+	OP_CALL_REGISTER_INDIRECT = 58<<24,
+	OP_CALL_RELATIVE_NEAR_BACKWARD = 59<<24,
+	OP_CALL_RELATIVE_NEAR_FORWARD = 60<<24,
+	OP_RET = 61<<24,
+	OP_ALLOCA = 62<<24,
+	OP_DROP = 63<<24,
+	OP_GET_STACK_RELATIVE = 64<<24,
+	OP_POP = 65<<24,
+	OP_PUSH = 66<<24,
+	OP_PUT_STACK_RELATIVE = 67<<24,
+	OP_DECJNZ = 68<<24,
+	OP_DECJNZ_NEAR = 69<<24,
+	OP_JA = 70<<24,
+	OP_JA_NEAR = 71<<24,
+	OP_JAE = 72<<24,
+	OP_JAE_NEAR = 73<<24,
+	OP_JB = 74<<24,
+	OP_JB_NEAR = 75<<24,
+	OP_JBE = 76<<24,
+	OP_JBE_NEAR = 77<<24,
+	OP_JCLEAR = 78<<24,
+	OP_JCLEAR_NEAR = 79<<24,
+	OP_JE = 80<<24,
+	OP_JE_NEAR = 81<<24,
+	OP_JG = 82<<24,
+	OP_JG_NEAR = 83<<24,
+	OP_JGE = 84<<24,
+	OP_JGE_NEAR = 85<<24,
+	OP_JL = 86<<24,
+	OP_JL_NEAR = 87<<24,
+	OP_JLE = 88<<24,
+	OP_JLE_NEAR = 89<<24,
+	OP_JNE = 90<<24,
+	OP_JNE_NEAR = 91<<24,
+	OP_JNZ = 92<<24,
+	OP_JNZ_NEAR = 93<<24,
+	OP_JSET = 94<<24,
+	OP_JSET_NEAR = 95<<24,
+	OP_JUMP = 96<<24,
+	OP_JUMP_NEAR = 97<<24,
+	OP_JUMP_RELATIVE_NEAR = 98<<24,
+	OP_JZ = 99<<24,
+	OP_JZ_NEAR = 100<<24,
+	OP_LOOP = 101<<24,
+	OP_REPEAT = 102<<24,
+	OP_PUTCHAR = 103<<24,
+	OP_CALLOUT = 104<<24,
+	OP_PRINT = 105<<24,
+	OP_PRINTHEX = 106<<24,
+	OP_PUSHM = 107<<24,
+	OP_POPM = 108<<24,
+	OP_ADD64 = 109<<24,
+	OP_SUB64 = 110<<24,
+	OP_MUL64 = 111<<24,
+	OP_MULW = 112<<24,
+	OP_IMULW = 113<<24,
+	OP_SHL64 = 114<<24,
+	OP_SHR64 = 115<<24,
+	OP_SAR64 = 116<<24,
+	OP_SHL64_IMM8 = 117<<24,
+	OP_SHR64_IMM8 = 118<<24,
+	OP_SAR64_IMM8 = 119<<24,
+	OP_CMP64 = 120<<24,
+	OP_CMPU64 = 121<<24,
+	OP_FADDS = 122<<24,
+	OP_FADDD = 123<<24,
+	OP_FSUBS = 124<<24,
+	OP_FSUBD = 125<<24,
+	OP_FMULS = 126<<24,
+	OP_FMULD = 127<<24,
+	OP_FDIVS = 128u<<24,
+	OP_FDIVD = 129u<<24,
+	OP_FSQRTS = 130u<<24,
+	OP_FSQRTD = 131u<<24,
+	OP_FCMPS = 132u<<24,
+	OP_FCMPD = 133u<<24,
+	OP_CVTSI2S = 134u<<24,
+	OP_CVTSI2D = 135u<<24,
+	OP_CVTS2SI = 136u<<24,
+	OP_CVTD2SI = 137u<<24,
+	OP_CVTS2D = 138u<<24,
+	OP_CVTD2S = 139u<<24,
+	OP_FLOADS = 140u<<24,
+	OP_FLOADD = 141u<<24,
+	OP_FSTORES = 142u<<24,
+	OP_FSTORED = 143u<<24,
+	OP_FMOV = 144u<<24,
+	OP_POPCNT = 145u<<24,
+	OP_LZCNT = 146u<<24,
+	OP_TZCNT = 147u<<24,
+	OP_BSWAP = 148u<<24,
+	OP_ROL = 149u<<24,
+	OP_ROR = 150u<<24,
+	OP_ROL_IMM8 = 151u<<24,
+	OP_ROR_IMM8 = 152u<<24,
+	OP_CRC32C = 153u<<24,
+	OP_CRC32C8 = 154u<<24,
+	OP_SWITCH = 155u<<24,
+	OP_LOAD32_DISP = 156u<<24,
+	OP_LOAD16_UNSIGNED_DISP = 157u<<24,
+	OP_LOAD16_SIGNED_DISP = 158u<<24,
+	OP_LOAD8_UNSIGNED_DISP = 159u<<24,
+	OP_LOAD8_SIGNED_DISP = 160u<<24,
+	OP_STORE32_DISP = 161u<<24,
+	OP_STORE16_DISP = 162u<<24,
+	OP_STORE8_DISP = 163u<<24,
+	OP_LOAD32_INDEXED = 164u<<24,
+	OP_LOAD16_UNSIGNED_INDEXED = 165u<<24,
+	OP_LOAD16_SIGNED_INDEXED = 166u<<24,
+	OP_LOAD8_UNSIGNED_INDEXED = 167u<<24,
+	OP_LOAD8_SIGNED_INDEXED = 168u<<24,
+	OP_STORE32_INDEXED = 169u<<24,
+	OP_STORE16_INDEXED = 170u<<24,
+	OP_STORE8_INDEXED = 171u<<24,
+	OP_PAIR = 172u<<24,
+	OP_ALLOC = 173u<<24,
+	OP_FREE = 174u<<24,
+	OP_REALLOC = 175u<<24,
+};
+
+//---------------------------------------------------------------------------
+// Short forms. An OP_PAIR word holds two of them, run in order. A short
+// form is written (op << 8) | (src << 4) | dest, src being a register or
+// an imm4. Byte 0 holds the registers of the first, byte 1 those of the
+// second and byte 2 both ops, the first in its low nibble.
+// SHORT_FORMS gives the instruction each op stands for, and must match
+// SHORT_TABLE in interpreter-x86.asm.
+//---------------------------------------------------------------------------
+
+enum {
+	SHORT_MOV,
+	SHORT_ADD,
+	SHORT_SUB,
+	SHORT_AND,
+	SHORT_OR,
+	SHORT_XOR,
+	SHORT_MUL,
+	SHORT_ADD_IMM,
+	SHORT_SUB_IMM,
+	SHORT_SHL_IMM,
+	SHORT_SHR_IMM,
+	SHORT_SAR_IMM,
+	SHORT_MOV_IMM,
+	SHORT_LOAD32,
+	SHORT_STORE32,
+	SHORT_NOP,
+	N_SHORT_FORMS
+};
+
+#define SHORT_PAIR(A,B) (OP_PAIR | ((A) & 255) | (((B) & 255) << 8) | \
+			 (((A) >> 8) << 16) | (((B) >> 8) << 20))
+
+#define SHORT_FORMS { \
+	OP_MOV, OP_ADD, OP_SUB, OP_AND, OP_OR, OP_XOR, OP_MUL, \
+	OP_ADD_IMM8, OP_SUB_IMM8, OP_SHL_IMM8, OP_SHR_IMM8, OP_SAR_IMM8, \
+	OP_MOV_IMM8_SIGNED, OP_LOAD32, OP_STORE32, MAINLOOP }
+
+//----------------------------------------------------------------------------
+// Name:	instruction_length
+// Purpose:	Gives how far the interpreter steps over an instruction when
+//		it does not branch. Switch tables are not counted.
+//----------------------------------------------------------------------------
+static inline uint32_t
+instruction_length (uint32_t op)
+{
+	switch (op) {
+	case OP_WRITE_MEMORY16:
+	case OP_WRITE_MEMORY32:
+		return 12;
+	case OP_MOV_IMM32: case OP_ADD_IMM32: case OP_WRITE_MEMORY8:
+	case OP_CALL: case OP_DECJNZ: case OP_JUMP: case OP_SWITCH:
+	case OP_LOAD32_DISP: case OP_LOAD16_UNSIGNED_DISP: case OP_LOAD16_SIGNED_DISP:
+	case OP_LOAD8_UNSIGNED_DISP: case OP_LOAD8_SIGNED_DISP:
+	case OP_STORE32_DISP: case OP_STORE16_DISP: case OP_STORE8_DISP:
+	case OP_JZ: case OP_JNZ: case OP_JSET: case OP_JCLEAR:
+	case OP_JSET_NEAR: case OP_JCLEAR_NEAR:
+	case OP_JA: case OP_JAE: case OP_JB: case OP_JBE:
+	case OP_JE: case OP_JNE: case OP_JG: case OP_JGE:
+	case OP_JL: case OP_JLE:
+	case OP_JA_NEAR: case OP_JAE_NEAR: case OP_JB_NEAR: case OP_JBE_NEAR:
+	case OP_JE_NEAR: case OP_JNE_NEAR: case OP_JG_NEAR: case OP_JGE_NEAR:
+	case OP_JL_NEAR: case OP_JLE_NEAR:
+		return 8;	// Near compares also skip a word when not taken.
+	}
+	return 4;
+}
+
+#endif
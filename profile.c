@@ -0,0 +1,449 @@
+/*============================================================================
+  libravm, an embeddable RAVM.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// Sampling profiler. A SIGPROF timer interrupts the host now and then,
+// and the handler notes where the VM was: the instruction it was at and
+// the return addresses on its stack. Samples go into a buffer of the VM's
+// own that only the handler writes and that is only read once profiling
+// has stopped, so no locks are needed.
+//
+// Where the VM was depends on what the host was doing:
+//
+// - In the interpreter, REGIP and REGSP are EDI and ESI.
+// - In a compiled trace, ESI is still REGSP, and the trace is found
+//   from the hot table; it is charged to the loop head.
+// - In C, such as a callout, the interpreter left them in vm->ip and
+//   vm->sp before calling out. These samples get a [host] frame on top.
+//
+// The stack holds data as well as return addresses, so a word is taken
+// for one only if it points just past a call instruction.
+//
+// One VM is profiled at a time, since the timer belongs to the process.
+//---------------------------------------------------------------------------
+
+#define _GNU_SOURCE		// For REG_EIP and friends.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/time.h>
+
+#include "libravm.h"
+#include "opcodes.h"
+#include "image.h"
+
+#define PROFILE_WORDS (1 << 20)		// 4 MB of samples.
+#define MAX_DEPTH 64			// Callers kept per sample.
+
+// A sample is a header word, the
+// leaf, then the callers innermost
+// first. Addresses are offsets into
+// the program.
+#define SAMPLE_DEPTH 0xffff		// Callers in the sample.
+#define SAMPLE_HOST 0x10000		// The host was running C.
+#define NO_ADDRESS 0xffffffff		// The VM had not started.
+
+#if defined(__APPLE__)
+#define CONTEXT_EIP(uc) ((uc)->uc_mcontext->__ss.__eip)
+#define CONTEXT_EDI(uc) ((uc)->uc_mcontext->__ss.__edi)
+#define CONTEXT_ESI(uc) ((uc)->uc_mcontext->__ss.__esi)
+#else
+#define CONTEXT_EIP(uc) ((uc)->uc_mcontext.gregs [REG_EIP])
+#define CONTEXT_EDI(uc) ((uc)->uc_mcontext.gregs [REG_EDI])
+#define CONTEXT_ESI(uc) ((uc)->uc_mcontext.gregs [REG_ESI])
+#endif
+
+// The interpreters' code, from
+// interpreter-x86.asm.
+extern char InterpretCode [], InterpretCodeEnd [];
+extern char InterpretCountingCode [], InterpretCountingCodeEnd [];
+extern char InterpretUnfueledCode [], InterpretUnfueledCodeEnd [];
+extern char InterpretUntracedCode [], InterpretUntracedCodeEnd [];
+extern char InterpretUnfueledUntracedCode [], InterpretUnfueledUntracedCodeEnd [];
+
+static char *const interpreter_code [][2] = {
+	{ InterpretCode, InterpretCodeEnd },
+	{ InterpretCountingCode, InterpretCountingCodeEnd },
+	{ InterpretUnfueledCode, InterpretUnfueledCodeEnd },
+	{ InterpretUntracedCode, InterpretUntracedCodeEnd },
+	{ InterpretUnfueledUntracedCode, InterpretUnfueledUntracedCodeEnd },
+};
+
+typedef struct Profile {
+	uint32_t *samples;
+	volatile uint32_t used;		// Words.
+	volatile uint32_t n_samples;
+	volatile uint32_t dropped;	// For want of room.
+	struct sigaction old_action;
+	struct itimerval old_timer;
+} Profile;
+
+static VM *volatile profiled = NULL;
+
+//----------------------------------------------------------------------------
+// Name:	is_return_address
+// Purpose:	Tells whether a stack word points just past a call.
+//----------------------------------------------------------------------------
+static inline bool
+is_return_address (VM *vm, uint32_t word)
+{
+	char *p = (char*) (uintptr_t) word;
+	if (p < vm->program_start + 4 || p > vm->program_end
+	    || (p - vm->program_start) & 3)
+		return false;
+
+	uint32_t op = *(uint32_t*) (p - 4) & 0xff000000;
+	if (op == OP_CALL_REGISTER_INDIRECT || op == OP_CALL_RELATIVE_NEAR_FORWARD
+	    || op == OP_CALL_RELATIVE_NEAR_BACKWARD)
+		return true;
+	return p >= vm->program_start + 8
+	       && (*(uint32_t*) (p - 8) & 0xff000000) == OP_CALL;
+}
+
+//----------------------------------------------------------------------------
+// Name:	trace_head
+// Purpose:	Finds the loop a compiled trace was made from.
+// Returns:	Its head, or NULL if the trace is no longer in the hot table.
+//----------------------------------------------------------------------------
+static char *
+trace_head (VM *vm, char *code)
+{
+	char *best = NULL, *head = NULL;
+	int i;
+	for (i = 0; i < HOT_SLOTS; i++) {
+		char *start = vm->hot_code [i];
+		if (start && start <= code && start > best) {
+			best = start;
+			head = vm->hot_ip [i];
+		}
+	}
+	return head;
+}
+
+//----------------------------------------------------------------------------
+// Name:	in_interpreter
+//----------------------------------------------------------------------------
+static bool
+in_interpreter (char *eip)
+{
+	unsigned i;
+	for (i = 0; i < sizeof (interpreter_code) / sizeof (interpreter_code [0]); i++)
+		if (eip >= interpreter_code [i][0] && eip < interpreter_code [i][1])
+			return true;
+	return false;
+}
+
+//----------------------------------------------------------------------------
+// Name:	on_sigprof
+// Purpose:	Takes a sample. Only reads the VM.
+//----------------------------------------------------------------------------
+static void
+on_sigprof (int sig, siginfo_t *info, void *context)
+{
+	VM *vm = profiled;
+	if (!vm || !vm->profile || !vm->program_start)
+		return;
+	Profile *profile = vm->profile;
+
+	ucontext_t *uc = context;
+	char *eip = (char*) CONTEXT_EIP (uc);
+	char *ip = vm->ip;
+	char *sp = vm->sp;
+	uint32_t header = 0;
+
+	if (in_interpreter (eip)) {
+		// Not yet in EDI on the way in.
+		char *edi = (char*) CONTEXT_EDI (uc);
+		if (edi >= vm->program_start && edi < vm->program_end) {
+			ip = edi;
+			sp = (char*) CONTEXT_ESI (uc);
+		}
+	}
+	else if (vm->trace_arena && eip >= vm->trace_arena
+		 && eip < vm->trace_arena + vm->trace_arena_used) {
+		char *head = trace_head (vm, eip);
+		if (head) {
+			ip = head;
+			sp = (char*) CONTEXT_ESI (uc);
+		}
+	}
+	else
+		header = SAMPLE_HOST;
+
+	uint32_t used = profile->used;
+	if (used + 2 + MAX_DEPTH > PROFILE_WORDS) {
+		profile->dropped++;
+		return;
+	}
+	uint32_t *sample = profile->samples + used;
+
+	if (ip >= vm->program_start && ip < vm->program_end)
+		sample [1] = ip - vm->program_start;
+	else {
+		sample [1] = NO_ADDRESS;
+		header = SAMPLE_HOST;
+		sp = NULL;
+	}
+
+	uint32_t depth = 0;
+	if (sp >= vm->stack_start && sp <= vm->stack_end) {
+		uint32_t *p;
+		for (p = (uint32_t*) sp; p + 1 <= (uint32_t*) vm->stack_end
+		     && depth < MAX_DEPTH; p++)
+			if (is_return_address (vm, *p))
+				sample [2 + depth++] = *p - 4 - (uint32_t) (uintptr_t) vm->program_start;
+	}
+
+	sample [0] = header | depth;
+	profile->used = used + 2 + depth;
+	profile->n_samples++;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_profile_start
+// Purpose:	Starts sampling the VM hz times per second of CPU time.
+//----------------------------------------------------------------------------
+int
+ravm_profile_start (VM *vm, unsigned hz)
+{
+	if (!vm || !hz || hz > 1000000 || profiled)
+		return RESULT_INVALID_PARAM;
+
+	if (!vm->profile) {
+		vm->profile = calloc (1, sizeof (Profile));
+		if (!vm->profile)
+			return RESULT_NO_MEMORY;
+		vm->profile->samples = malloc (PROFILE_WORDS * sizeof (uint32_t));
+		if (!vm->profile->samples) {
+			profile_free (vm);
+			return RESULT_NO_MEMORY;
+		}
+	}
+	Profile *profile = vm->profile;
+	profiled = vm;
+
+	struct sigaction action;
+	memset (&action, 0, sizeof (action));
+	action.sa_sigaction = on_sigprof;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset (&action.sa_mask);
+	sigaction (SIGPROF, &action, &profile->old_action);
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	if (setitimer (ITIMER_PROF, &timer, &profile->old_timer)) {
+		sigaction (SIGPROF, &profile->old_action, NULL);
+		profiled = NULL;
+		return RESULT_INVALID_PARAM;
+	}
+	return RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_profile_stop
+//----------------------------------------------------------------------------
+void
+ravm_profile_stop (VM *vm)
+{
+	if (!vm || profiled != vm)
+		return;
+	setitimer (ITIMER_PROF, &vm->profile->old_timer, NULL);
+	sigaction (SIGPROF, &vm->profile->old_action, NULL);
+	profiled = NULL;
+}
+
+//----------------------------------------------------------------------------
+// Name:	compare_samples
+//----------------------------------------------------------------------------
+static int
+compare_samples (const void *a, const void *b)
+{
+	const uint32_t *x = *(uint32_t* const*) a;
+	const uint32_t *y = *(uint32_t* const*) b;
+	uint32_t n = 2 + (x [0] & SAMPLE_DEPTH);
+	uint32_t i;
+	if (x [0] != y [0])
+		return x [0] < y [0] ? -1 : 1;
+	for (i = 1; i < n; i++)
+		if (x [i] != y [i])
+			return x [i] < y [i] ? -1 : 1;
+	return 0;
+}
+
+static int
+compare_symbols (const void *a, const void *b)
+{
+	const ImageSymbol *x = *(ImageSymbol* const*) a;
+	const ImageSymbol *y = *(ImageSymbol* const*) b;
+	return x->address < y->address ? -1 : x->address > y->address;
+}
+
+//----------------------------------------------------------------------------
+// Name:	find_label
+// Returns:	The last text label at or before an address, or NULL.
+//----------------------------------------------------------------------------
+static ImageSymbol *
+find_label (ImageSymbol **text, uint32_t n_text, uint32_t address)
+{
+	uint32_t low = 0, high = n_text;
+	while (low < high) {
+		uint32_t middle = (low + high) / 2;
+		if (text [middle]->address <= address)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low ? text [low - 1] : NULL;
+}
+
+//----------------------------------------------------------------------------
+// Name:	frame_of
+// Purpose:	Gives the address a frame is known by, so that samples in
+//		the same function, or on the same line, come out as one.
+//----------------------------------------------------------------------------
+static uint32_t
+frame_of (VM *vm, ImageSymbol **text, uint32_t n_text, uint32_t address, bool lines)
+{
+	if (address == NO_ADDRESS)
+		return address;
+	if (lines && vm->n_lines && address >= vm->lines[0].address) {
+		uint32_t low = 0, high = vm->n_lines;
+		while (high - low > 1) {
+			uint32_t middle = (low + high) / 2;
+			if (vm->lines [middle].address <= address)
+				low = middle;
+			else
+				high = middle;
+		}
+		return vm->lines [low].address;
+	}
+	ImageSymbol *label = find_label (text, n_text, address);
+	return label ? label->address : address;
+}
+
+//----------------------------------------------------------------------------
+// Name:	write_frame
+// Purpose:	Writes the label an address is under, or the address if
+//		there is none, and its line number if asked.
+//----------------------------------------------------------------------------
+static void
+write_frame (VM *vm, FILE *f, ImageSymbol **text, uint32_t n_text,
+	     uint32_t address, bool lines)
+{
+	ImageSymbol *label = find_label (text, n_text, address);
+	if (label)
+		fputs (vm->strings + label->name, f);
+	else
+		fprintf (f, "0x%x", address);
+
+	uint32_t line = lines ? ravm_line_at (vm, address) : 0;
+	if (line)
+		fprintf (f, ":%u", line);
+}
+
+//----------------------------------------------------------------------------
+// Name:	ravm_profile_write
+// Purpose:	Writes the samples as folded stacks, outermost frame first,
+//		one line per distinct stack with how often it was seen.
+//		Frames are named by label, with line numbers if asked.
+// Returns:	How many samples had no room, in *dropped if given.
+//----------------------------------------------------------------------------
+int
+ravm_profile_write (VM *vm, FILE *f, bool lines, uint32_t *dropped)
+{
+	if (!vm || !f || !vm->profile || profiled == vm)
+		return RESULT_INVALID_PARAM;
+	Profile *profile = vm->profile;
+	if (dropped)
+		*dropped = profile->dropped;
+
+	uint32_t n = profile->n_samples;
+	uint32_t *frames = malloc ((profile->used + 1) * sizeof (uint32_t));
+	uint32_t **samples = malloc ((n + 1) * sizeof (uint32_t*));
+	ImageSymbol **text = malloc ((vm->n_symbols + 1) * sizeof (ImageSymbol*));
+	if (!frames || !samples || !text) {
+		free (frames);
+		free (samples);
+		free (text);
+		return RESULT_NO_MEMORY;
+	}
+
+	uint32_t i, j, k, n_text = 0;
+	for (i = 0; i < vm->n_symbols; i++)
+		if (vm->symbols [i].section == SECTION_TEXT)
+			text [n_text++] = &vm->symbols [i];
+	qsort (text, n_text, sizeof (ImageSymbol*), compare_symbols);
+
+	// Samples are compared by frame,
+	// not by address.
+	uint32_t *p = frames;
+	memcpy (frames, profile->samples, profile->used * sizeof (uint32_t));
+	for (i = 0; i < n; i++) {
+		uint32_t length = 2 + (p [0] & SAMPLE_DEPTH);
+		samples [i] = p;
+		for (k = 1; k < length; k++)
+			p [k] = frame_of (vm, text, n_text, p [k], lines);
+		p += length;
+	}
+	qsort (samples, n, sizeof (uint32_t*), compare_samples);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && !compare_samples (&samples [i], &samples [j]); j++)
+			;
+
+		uint32_t *sample = samples [i];
+		uint32_t depth = sample [0] & SAMPLE_DEPTH;
+		for (k = depth; k > 0; k--) {
+			write_frame (vm, f, text, n_text, sample [1 + k], lines);
+			fputc (';', f);
+		}
+		if (sample [1] != NO_ADDRESS)
+			write_frame (vm, f, text, n_text, sample [1], lines);
+		if (sample [0] & SAMPLE_HOST)
+			fputs (sample [1] != NO_ADDRESS ? ";[host]" : "[host]", f);
+		fprintf (f, " %u\n", j - i);
+	}
+
+	free (frames);
+	free (samples);
+	free (text);
+	return ferror (f) ? RESULT_IO_ERROR : RESULT_OK;
+}
+
+//----------------------------------------------------------------------------
+// Name:	profile_free
+//----------------------------------------------------------------------------
+void
+profile_free (VM *vm)
+{
+	if (!vm->profile)
+		return;
+	ravm_profile_stop (vm);
+	free (vm->profile->samples);
+	free (vm->profile);
+	vm->profile = NULL;
+}
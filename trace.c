@@ -0,0 +1,681 @@
+/*============================================================================
+  RAVM, a RISC-approximating virtual machine that fits in the L1 cache.
+  Copyright (C) 2012-2013 by Zack T Smith.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+  The author may be reached at 1@zsmith.co.
+ *===========================================================================*/
+
+//---------------------------------------------------------------------------
+// Trace compiler. When a branch target gets hot the interpreter calls
+// trace_compile, which follows the straight-line path from there until
+// a branch closes the loop, and turns it into 32-bit x86 code:
+//
+// - VM registers stay in the context, addressed off EBP as usual.
+// - Branches leaving the loop become guards that put the VM address
+//   in EDI and jump back into the interpreter.
+// - The back edge uses fuel just like the interpreter does.
+//
+// Only simple instructions are handled; a loop containing anything
+// else is left to the interpreter.
+//
+// The hot table only has HOT_SLOTS entries, so a head can lose its slot
+// and get hot again. Its code is then found in an index by VM address,
+// kept at the start of the arena, rather than compiled again. When the
+// arena or the index fills up, both are emptied and compiling starts over.
+//---------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "libravm.h"
+#include "opcodes.h"
+
+#define TRACE_ARENA_SIZE (256 * 1024)
+#define MAX_TRACE_LENGTH 64		// VM instructions.
+#define MAX_EXITS (4 * MAX_TRACE_LENGTH + 2)
+#define MAX_INSTRUCTION_CODE 128	// x86 bytes for one VM instruction.
+#define EXIT_STUB_SIZE 11
+#define MAX_TRACE_CODE (MAX_TRACE_LENGTH * MAX_INSTRUCTION_CODE + MAX_EXITS * EXIT_STUB_SIZE)
+#define TRACE_INDEX_SIZE 1024		// Must be a power of 2.
+#define TRACE_INDEX_PROBES 8
+
+// Compiled code by VM address.
+typedef struct {
+	char *ip;
+	void *code;
+} TraceEntry;
+
+// x86 registers.
+enum { EAX = 0, ECX = 1, EDX = 2 };
+
+// x86 condition codes.
+enum { CC_B = 2, CC_AE = 3, CC_E = 4, CC_NE = 5, CC_BE = 6, CC_A = 7,
+	CC_L = 12, CC_GE = 13, CC_LE = 14, CC_G = 15 };
+
+// Where an exit goes in the interpreter.
+#define VIA_MAINLOOP offsetof (VM, trace_exit)
+#define VIA_FULL_CHECK offsetof (VM, trace_exit_taken)
+#define VIA_YIELD offsetof (VM, trace_yield)
+#define VIA_FAULT offsetof (VM, trace_fault)
+
+typedef struct {
+	unsigned char *start;
+	unsigned char *p;
+	unsigned char *end;
+	int n_exits;
+	struct {
+		unsigned char *patch;	// rel32 to point at the stub.
+		char *ip;		// VM address to carry on at.
+		uint32_t via;
+	} exits [MAX_EXITS];
+} Emitter;
+
+static void
+emit8 (Emitter *e, unsigned v)
+{
+	*e->p++ = v;
+}
+
+static void
+emit32 (Emitter *e, uint32_t v)
+{
+	memcpy (e->p, &v, 4);
+	e->p += 4;
+}
+
+//----------------------------------------------------------------------------
+// Name:	emit_vm
+// Purpose:	Emits an instruction whose memory operand is [EBP + offset],
+//		i.e. a VM register or a field of the context.
+//----------------------------------------------------------------------------
+static void
+emit_vm (Emitter *e, unsigned opcode, unsigned reg, uint32_t offset)
+{
+	if (opcode > 255)
+		emit8 (e, opcode >> 8);
+	emit8 (e, opcode & 255);
+	emit8 (e, 0x85 | (reg << 3));
+	emit32 (e, offset);
+}
+
+#define LOAD(e,x86,vmreg) emit_vm (e, 0x8b, x86, 4 * (vmreg))
+#define STORE(e,x86,vmreg) emit_vm (e, 0x89, x86, 4 * (vmreg))
+
+//----------------------------------------------------------------------------
+// Name:	emit_exit
+// Purpose:	Emits a conditional jump to an exit stub, or an unconditional
+//		one if cc is negative.
+//----------------------------------------------------------------------------
+static void
+emit_exit (Emitter *e, int cc, char *ip, uint32_t via)
+{
+	if (cc < 0)
+		emit8 (e, 0xe9);
+	else {
+		emit8 (e, 0x0f);
+		emit8 (e, 0x80 | cc);
+	}
+	e->exits [e->n_exits].patch = e->p;
+	e->exits [e->n_exits].ip = ip;
+	e->exits [e->n_exits].via = via;
+	e->n_exits++;
+	emit32 (e, 0);
+}
+
+//----------------------------------------------------------------------------
+// Name:	emit_fuel_check
+// Purpose:	Same as the interpreter's FUEL_CHECK at mainloop_full_check.
+//----------------------------------------------------------------------------
+static void
+emit_fuel_check (Emitter *e, char *ip)
+{
+	emit_vm (e, 0x83, 5, offsetof (VM, fuel));	// sub dword [ebp+fuel], 1
+	emit8 (e, 1);
+	emit_exit (e, CC_B, ip, VIA_YIELD);
+}
+
+//----------------------------------------------------------------------------
+// Name:	emit_address
+// Purpose:	Leaves the host address for VM address register s, plus disp
+//		or plus index register times size, in EDX, leaving the trace
+//		if it is out of bounds. size is 0 for no index. Writes may
+//		not go below writable_start.
+//----------------------------------------------------------------------------
+static void
+emit_address (Emitter *e, unsigned s, uint32_t disp, unsigned index, unsigned size,
+	      bool writing, char *next)
+{
+	LOAD (e, EDX, s);
+	if (size) {
+		LOAD (e, ECX, index);
+		emit8 (e, 0x8d);		// lea edx, [edx + size*ecx]
+		emit8 (e, 0x14);
+		emit8 (e, (size == 4 ? 0x80 : size == 2 ? 0x40 : 0) | 0x0a);
+	} else if (disp) {
+		emit8 (e, 0x81);		// add edx, disp
+		emit8 (e, 0xc2);
+		emit32 (e, disp);
+	}
+	emit_vm (e, 0x03, EDX, offsetof (VM, memory_start));
+	emit_vm (e, 0x3b, EDX, writing ? offsetof (VM, writable_start)
+				       : offsetof (VM, memory_start));
+	emit_exit (e, CC_B, next, VIA_FAULT);
+	emit_vm (e, 0x3b, EDX, offsetof (VM, memory_end));
+	emit_exit (e, CC_AE, next, VIA_FAULT);
+}
+
+// The plain loads and stores, in the order of their _DISP and _INDEXED forms.
+static const uint32_t memory_ops [] = {
+	OP_LOAD32, OP_LOAD16_UNSIGNED, OP_LOAD16_SIGNED, OP_LOAD8_UNSIGNED,
+	OP_LOAD8_SIGNED, OP_STORE32, OP_STORE16, OP_STORE8,
+};
+
+static unsigned
+access_size (uint32_t op)
+{
+	switch (op) {
+	case OP_LOAD32: case OP_STORE32: return 4;
+	case OP_LOAD16_UNSIGNED: case OP_LOAD16_SIGNED: case OP_STORE16: return 2;
+	}
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+// Name:	emit_memory_access
+// Purpose:	Emits the load or store op, a plain one, with the address
+//		worked out as emit_address does.
+//----------------------------------------------------------------------------
+static void
+emit_memory_access (Emitter *e, uint32_t op, unsigned d, unsigned s,
+		    uint32_t disp, unsigned index, unsigned size, char *next)
+{
+	bool writing = op == OP_STORE32 || op == OP_STORE16 || op == OP_STORE8;
+	emit_address (e, s, disp, index, size, writing, next);
+	switch (op) {
+	case OP_STORE32: case OP_STORE16: case OP_STORE8:
+		LOAD (e, EAX, d);
+		if (op == OP_STORE16)
+			emit8 (e, 0x66);
+		emit8 (e, op == OP_STORE8 ? 0x88 : 0x89);
+		emit8 (e, 0x02);		// [edx], eax
+		return;
+	case OP_LOAD32:
+		emit8 (e, 0x8b);
+		break;
+	default:
+		emit8 (e, 0x0f);
+		emit8 (e, op == OP_LOAD16_UNSIGNED ? 0xb7 : op == OP_LOAD16_SIGNED ? 0xbf :
+			  op == OP_LOAD8_UNSIGNED ? 0xb6 : 0xbe);
+	}
+	emit8 (e, 0x02);		// eax, [edx]
+	STORE (e, EAX, d);
+}
+
+//----------------------------------------------------------------------------
+// Name:	emit_simple
+// Purpose:	Emits an instruction that is one word long and does not
+//		branch, so that OP_PAIR can reuse it for its short forms.
+// Returns:	false if it is not one of those.
+//----------------------------------------------------------------------------
+static bool
+emit_simple (Emitter *e, uint32_t word, char *next)
+{
+	uint32_t op = word & 0xff000000;
+	unsigned d = word & 255;
+	unsigned s = (word >> 8) & 255;
+
+	switch (op) {
+	case MAINLOOP:
+		break;
+
+	case OP_MOV:
+		LOAD (e, EAX, s);
+		STORE (e, EAX, d);
+		break;
+	case OP_MOV_IMM8_SIGNED:
+		emit8 (e, 0xb8);
+		emit32 (e, (int32_t) (int8_t) s);
+		STORE (e, EAX, d);
+		break;
+
+	case OP_ADD: case OP_SUB: case OP_AND: case OP_OR: case OP_XOR:
+		LOAD (e, EAX, d);
+		emit_vm (e, op == OP_ADD ? 0x03 : op == OP_SUB ? 0x2b :
+			     op == OP_AND ? 0x23 : op == OP_OR ? 0x0b : 0x33, EAX, 4*s);
+		STORE (e, EAX, d);
+		break;
+	case OP_ADD_IMM8: case OP_SUB_IMM8: case OP_AND_IMM8:
+	case OP_OR_IMM8: case OP_XOR_IMM8:
+		LOAD (e, EAX, d);
+		emit8 (e, op == OP_ADD_IMM8 ? 0x05 :
+			   op == OP_SUB_IMM8 ? 0x2d : op == OP_AND_IMM8 ? 0x25 :
+			   op == OP_OR_IMM8 ? 0x0d : 0x35);
+		emit32 (e, s);
+		STORE (e, EAX, d);
+		break;
+
+	case OP_MUL: case OP_IMUL:	// Only the low half is kept.
+		LOAD (e, EAX, d);
+		emit_vm (e, 0x0faf, EAX, 4*s);
+		STORE (e, EAX, d);
+		break;
+	case OP_MUL_IMM8: case OP_IMUL_IMM8: case OP_MUL_10: case OP_MUL_100:
+		LOAD (e, EAX, d);
+		emit8 (e, 0x69);
+		emit8 (e, 0xc0);
+		emit32 (e, op == OP_MUL_10 ? 10 : op == OP_MUL_100 ? 100 : s);
+		STORE (e, EAX, d);
+		break;
+
+	case OP_SHL: case OP_SHR: case OP_SAR:
+	case OP_SHL_IMM8: case OP_SHR_IMM8: case OP_SAR_IMM8: {
+		unsigned ext = (op == OP_SHL || op == OP_SHL_IMM8) ? 0xe0 :
+			       (op == OP_SHR || op == OP_SHR_IMM8) ? 0xe8 : 0xf8;
+		LOAD (e, EAX, d);
+		if (op == OP_SHL || op == OP_SHR || op == OP_SAR) {
+			LOAD (e, ECX, s);
+			emit8 (e, 0xd3);
+			emit8 (e, ext);
+		} else {
+			emit8 (e, 0xc1);
+			emit8 (e, ext);
+			emit8 (e, s);
+		}
+		STORE (e, EAX, d);
+		break;
+	}
+
+	case OP_NEG: case OP_NOT:
+		LOAD (e, EAX, d);
+		emit8 (e, 0xf7);
+		emit8 (e, op == OP_NEG ? 0xd8 : 0xd0);
+		STORE (e, EAX, d);
+		break;
+
+	case OP_LOAD32: case OP_LOAD16_UNSIGNED: case OP_LOAD16_SIGNED:
+	case OP_LOAD8_UNSIGNED: case OP_LOAD8_SIGNED:
+	case OP_STORE32: case OP_STORE16: case OP_STORE8:
+		emit_memory_access (e, op, d, s, 0, 0, 0, next);
+		break;
+
+	default:
+		return false;
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// Name:	compare_cc
+// Purpose:	Maps a compare-and-branch opcode to its x86 condition.
+//----------------------------------------------------------------------------
+static int
+compare_cc (uint32_t op)
+{
+	switch (op) {
+	case OP_JB: case OP_JB_NEAR: return CC_B;
+	case OP_JA: case OP_JA_NEAR: return CC_A;
+	case OP_JBE: case OP_JBE_NEAR: return CC_BE;
+	case OP_JAE: case OP_JAE_NEAR: return CC_AE;
+	case OP_JL: case OP_JL_NEAR: return CC_L;
+	case OP_JG: case OP_JG_NEAR: return CC_G;
+	case OP_JLE: case OP_JLE_NEAR: return CC_LE;
+	case OP_JGE: case OP_JGE_NEAR: return CC_GE;
+	case OP_JE: case OP_JE_NEAR: return CC_E;
+	case OP_JNE: case OP_JNE_NEAR: return CC_NE;
+	}
+	return -1;
+}
+
+//----------------------------------------------------------------------------
+// Name:	emit_branch
+// Purpose:	Emits the end of a conditional branch whose condition is
+//		in the flags. If it goes back to the head it closes the loop,
+//		otherwise it becomes a guard and the trace carries on.
+// Returns:	true if the loop was closed.
+//----------------------------------------------------------------------------
+static bool
+emit_branch (Emitter *e, int cc, char *head, char *taken, char *not_taken,
+	     uint32_t not_taken_via, unsigned char *loop)
+{
+	if (taken == head) {
+		emit_exit (e, cc ^ 1, not_taken, not_taken_via);
+		emit_fuel_check (e, head);
+		emit8 (e, 0xe9);
+		emit32 (e, loop - (e->p + 4));
+		return true;
+	}
+
+	emit_exit (e, cc, taken, VIA_FULL_CHECK);
+	if (not_taken_via == VIA_FULL_CHECK)
+		emit_fuel_check (e, not_taken);
+	return false;
+}
+
+//----------------------------------------------------------------------------
+// Name:	compile
+// Purpose:	Compiles the loop starting at head into the free part of the
+//		arena.
+// Returns:	The native code, or NULL if the loop cannot be compiled.
+//----------------------------------------------------------------------------
+static void *
+compile (VM *vm, char *head)
+{
+	Emitter e;
+	e.start = (unsigned char*) vm->trace_arena + vm->trace_arena_used;
+	e.p = e.start;
+	e.end = (unsigned char*) vm->trace_arena + TRACE_ARENA_SIZE;
+	e.n_exits = 0;
+
+	char *ip = head;
+	bool closed = false;
+	int n;
+	for (n = 0; n < MAX_TRACE_LENGTH && !closed; n++) {
+		if (e.end - e.p < MAX_INSTRUCTION_CODE + MAX_EXITS * EXIT_STUB_SIZE)
+			return NULL;
+		if (ip < vm->program_start || ip + 8 > vm->program_end)
+			return NULL;
+
+		uint32_t word = *(uint32_t*) ip;
+		uint32_t op = word & 0xff000000;
+		unsigned d = word & 255;
+		unsigned s = (word >> 8) & 255;
+		uint32_t imm32 = *(uint32_t*) (ip + 4);
+		char *next = ip + 4;
+		int cc;
+
+		switch (op) {
+		case OP_MOV_IMM32:
+			emit8 (&e, 0xb8);
+			emit32 (&e, imm32);
+			STORE (&e, EAX, d);
+			next += 4;
+			break;
+		case OP_ADD_IMM32:
+			LOAD (&e, EAX, d);
+			emit8 (&e, 0x05);
+			emit32 (&e, imm32);
+			STORE (&e, EAX, d);
+			next += 4;
+			break;
+
+		case OP_PAIR: {
+			static const uint32_t short_forms [N_SHORT_FORMS] = SHORT_FORMS;
+			unsigned i;
+			for (i = 0; i < 2; i++) {
+				unsigned regs = (word >> (8 * i)) & 255;
+				unsigned form = (word >> (16 + 4 * i)) & 15;
+				emit_simple (&e, short_forms [form] | SRC (regs >> 4) |
+					     DEST (regs & 15), next);
+			}
+			break;
+		}
+
+		//------------------------------
+		// Loads and stores, in all three
+		// addressing modes. The opcodes of
+		// each mode are in the same order.
+		//
+		case OP_LOAD32_DISP: case OP_LOAD16_UNSIGNED_DISP: case OP_LOAD16_SIGNED_DISP:
+		case OP_LOAD8_UNSIGNED_DISP: case OP_LOAD8_SIGNED_DISP:
+		case OP_STORE32_DISP: case OP_STORE16_DISP: case OP_STORE8_DISP:
+			next += 4;
+			emit_memory_access (&e, memory_ops [(op - OP_LOAD32_DISP) >> 24], d,
+					    s, imm32, 0, 0, next);
+			break;
+		case OP_LOAD32_INDEXED: case OP_LOAD16_UNSIGNED_INDEXED: case OP_LOAD16_SIGNED_INDEXED:
+		case OP_LOAD8_UNSIGNED_INDEXED: case OP_LOAD8_SIGNED_INDEXED:
+		case OP_STORE32_INDEXED: case OP_STORE16_INDEXED: case OP_STORE8_INDEXED: {
+			uint32_t plain = memory_ops [(op - OP_LOAD32_INDEXED) >> 24];
+			emit_memory_access (&e, plain, d, s, 0, (word >> 16) & 255,
+					    access_size (plain), next);
+			break;
+		}
+
+		//------------------------------
+		// Branches. The addresses each
+		// goes to, and through which part
+		// of the main loop, follow the
+		// interpreter exactly.
+		//
+		case OP_JZ: case OP_JNZ:
+			LOAD (&e, EAX, d);
+			emit8 (&e, 0x85);		// test eax, eax
+			emit8 (&e, 0xc0);
+			closed = emit_branch (&e, op == OP_JZ ? CC_E : CC_NE, head,
+					      next + (int32_t) imm32, next + 4, VIA_FULL_CHECK, e.start);
+			next += 4;
+			break;
+		case OP_JZ_NEAR: case OP_JNZ_NEAR:
+			LOAD (&e, EAX, d);
+			emit8 (&e, 0x85);
+			emit8 (&e, 0xc0);
+			closed = emit_branch (&e, op == OP_JZ_NEAR ? CC_E : CC_NE, head,
+					      next + (int8_t) s, next, VIA_MAINLOOP, e.start);
+			break;
+		case OP_DECJNZ: case OP_DECJNZ_NEAR:
+			LOAD (&e, EAX, d);
+			emit8 (&e, 0x48);		// dec eax
+			STORE (&e, EAX, d);
+			if (op == OP_DECJNZ) {
+				closed = emit_branch (&e, CC_NE, head, next + (int32_t) imm32, next + 4,
+						      VIA_FULL_CHECK, e.start);
+				next += 4;
+			} else
+				closed = emit_branch (&e, CC_NE, head, next - s, next,
+						      VIA_MAINLOOP, e.start);
+			break;
+		case OP_REPEAT:
+			emit_vm (&e, 0xc7, 0, 4*d);	// mov dword [reg], next
+			emit32 (&e, (uint32_t) (uintptr_t) next);
+			break;
+		case OP_LOOP:
+			// The target is in a register, so the
+			// loop only closes if it is still head.
+			if (vm->registers [s] != (uint32_t) (uintptr_t) head)
+				return NULL;
+			LOAD (&e, EAX, d);
+			emit8 (&e, 0x48);		// dec eax
+			STORE (&e, EAX, d);
+			emit_exit (&e, CC_E, next, VIA_MAINLOOP);
+			LOAD (&e, EDX, s);
+			emit8 (&e, 0x81);		// cmp edx, head
+			emit8 (&e, 0xfa);
+			emit32 (&e, (uint32_t) (uintptr_t) head);
+			emit8 (&e, 0x74);		// je over
+			emit8 (&e, 8);
+			emit8 (&e, 0x89);		// mov edi, edx
+			emit8 (&e, 0xd7);
+			emit_vm (&e, 0xff, 4, VIA_FULL_CHECK);	// jmp [ebp+via]
+			emit_fuel_check (&e, head);
+			emit8 (&e, 0xe9);
+			emit32 (&e, e.start - (e.p + 4));
+			closed = true;
+			break;
+		case OP_JUMP:
+			if (next + (int32_t) imm32 != head)
+				return NULL;
+			emit_fuel_check (&e, head);
+			emit8 (&e, 0xe9);
+			emit32 (&e, e.start - (e.p + 4));
+			closed = true;
+			break;
+
+		default:
+			if ((cc = compare_cc (op)) < 0) {
+				if (!emit_simple (&e, word, next))
+					return NULL;
+				break;
+			}
+			LOAD (&e, EAX, d);
+			emit_vm (&e, 0x3b, EAX, 4*s);	// cmp eax, [reg]
+			if (op == OP_JB || op == OP_JA || op == OP_JBE || op == OP_JAE ||
+			    op == OP_JL || op == OP_JG || op == OP_JLE || op == OP_JGE ||
+			    op == OP_JE || op == OP_JNE)
+				closed = emit_branch (&e, cc, head, next + (int32_t) imm32, next + 4,
+						      VIA_MAINLOOP, e.start);
+			else
+				closed = emit_branch (&e, cc, head, next + (int8_t) s, next + 4,
+						      VIA_MAINLOOP, e.start);
+			next += 4;
+		}
+		ip = next;
+	}
+
+	if (!closed)
+		return NULL;
+
+	//------------------------------
+	// The exit stubs:
+	//	mov edi, ip
+	//	jmp [ebp + via]
+	//
+	int i;
+	for (i = 0; i < e.n_exits; i++) {
+		uint32_t rel = e.p - (e.exits[i].patch + 4);
+		memcpy (e.exits[i].patch, &rel, 4);
+		emit8 (&e, 0xbf);
+		emit32 (&e, (uint32_t) (uintptr_t) e.exits[i].ip);
+		emit8 (&e, 0xff);
+		emit8 (&e, 0xa5);
+		emit32 (&e, e.exits[i].via);
+	}
+
+	vm->trace_arena_used = ((e.p - (unsigned char*) vm->trace_arena) + 15) & ~15;
+	return e.start;
+}
+
+//----------------------------------------------------------------------------
+// Name:	find_entry
+// Purpose:	Finds the index entry for head, or a free one for it.
+// Returns:	NULL if neither is within TRACE_INDEX_PROBES of its hash.
+//----------------------------------------------------------------------------
+static TraceEntry *
+find_entry (VM *vm, char *head)
+{
+	TraceEntry *index = (TraceEntry*) vm->trace_arena;
+	uint32_t hash = (uint32_t) (uintptr_t) head >> 2;
+	int i;
+	for (i = 0; i < TRACE_INDEX_PROBES; i++) {
+		TraceEntry *entry = &index [(hash + i) & (TRACE_INDEX_SIZE - 1)];
+		if (!entry->ip || entry->ip == head)
+			return entry;
+	}
+	return NULL;
+}
+
+//----------------------------------------------------------------------------
+// Name:	trace_restart
+// Purpose:	Empties the arena and its index. Hot slots that had code
+//		count down again, so that their heads are compiled anew.
+//----------------------------------------------------------------------------
+static void
+trace_restart (VM *vm)
+{
+	int i;
+	memset (vm->trace_arena, 0, TRACE_INDEX_SIZE * sizeof (TraceEntry));
+	vm->trace_arena_used = TRACE_INDEX_SIZE * sizeof (TraceEntry);
+	for (i = 0; i < HOT_SLOTS; i++)
+		if (vm->hot_code [i]) {
+			vm->hot_code [i] = NULL;
+			vm->hot_count [i] = HOT_THRESHOLD;
+		}
+}
+
+//----------------------------------------------------------------------------
+// Name:	trace_compile
+// Purpose:	Gives the code for the loop starting at head, compiling it
+//		unless that was done before. The arena is only writable
+//		while code is being added to it, and executable otherwise.
+// Returns:	The native code, or NULL if the loop cannot be compiled.
+//----------------------------------------------------------------------------
+void *
+trace_compile (VM *vm, char *head)
+{
+	TraceEntry *entry = NULL;
+	if (vm->trace_arena && vm->trace_arena_used) {
+		entry = find_entry (vm, head);
+		if (entry && entry->ip)
+			return entry->code;
+	}
+
+	if (!vm->trace_arena) {
+		void *p = mmap (NULL, TRACE_ARENA_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		vm->trace_arena = p;
+		vm->trace_arena_used = 0;
+	}
+	else if (mprotect (vm->trace_arena, TRACE_ARENA_SIZE, PROT_READ | PROT_WRITE))
+		return NULL;
+
+	if (!vm->trace_arena_used) {
+		trace_restart (vm);
+		entry = find_entry (vm, head);
+	}
+	if (!entry || TRACE_ARENA_SIZE - vm->trace_arena_used < MAX_TRACE_CODE) {
+		trace_restart (vm);
+		entry = find_entry (vm, head);
+	}
+
+	void *code = compile (vm, head);
+	if (code) {
+		entry->ip = head;
+		entry->code = code;
+	}
+
+	//------------------------------
+	// Code that cannot be made
+	// executable must not be run.
+	//
+	if (mprotect (vm->trace_arena, TRACE_ARENA_SIZE, PROT_READ | PROT_EXEC)) {
+		trace_restart (vm);
+		return NULL;
+	}
+	return code;
+}
+
+//----------------------------------------------------------------------------
+// Name:	trace_flush
+// Purpose:	Forgets all traces and hot counts, e.g. for a new program.
+//		The index is emptied before the arena is next used, by
+//		trace_compile while the arena is writable.
+//----------------------------------------------------------------------------
+void
+trace_flush (VM *vm)
+{
+	vm->trace_arena_used = 0;
+	memset (vm->hot_ip, 0, sizeof (vm->hot_ip));
+	memset (vm->hot_code, 0, sizeof (vm->hot_code));
+	memset (vm->hot_count, 0, sizeof (vm->hot_count));
+}
+
+//----------------------------------------------------------------------------
+// Name:	trace_free
+//----------------------------------------------------------------------------
+void
+trace_free (VM *vm)
+{
+	if (vm->trace_arena)
+		munmap (vm->trace_arena, TRACE_ARENA_SIZE);
+	vm->trace_arena = NULL;
+	trace_flush (vm);
+}